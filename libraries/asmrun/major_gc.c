@@ -14,6 +14,8 @@
 /* $Id: major_gc.c 9410 2009-11-04 12:25:47Z doligez $ */
 
 #include <limits.h>
+#include <trace.h>
+#include <vmm.h>
 
 #include "compact.h"
 #include "custom.h"
@@ -32,6 +34,7 @@
 uintnat caml_percent_free;
 uintnat caml_major_heap_increment;
 CAMLexport char *caml_heap_start;
+CAMLexport int caml_heap_large_pages = 0;
 char *caml_gc_sweep_hp;
 int caml_gc_phase;        /* always Phase_mark, Phase_sweep, or Phase_idle */
 static value *gray_vals;
@@ -379,6 +382,7 @@ intnat caml_major_collection_slice (intnat howmuch)
      This slice will either mark MS words or sweep SS words.
   */
 
+  trace (TRACE_MAJOR_BEGIN, caml_gc_phase, 0);
   if (caml_gc_phase == Phase_idle) start_cycle ();
 
   p = (double) caml_allocated_words * 3.0 * (100 + caml_percent_free)
@@ -426,6 +430,7 @@ intnat caml_major_collection_slice (intnat howmuch)
   caml_allocated_words = 0;
   caml_dependent_allocated = 0;
   caml_extra_heap_resources = 0.0;
+  trace (TRACE_MAJOR_END, caml_gc_phase, 0);
   return computed_work;
 }
 
@@ -438,6 +443,7 @@ intnat caml_major_collection_slice (intnat howmuch)
 */
 void caml_finish_major_cycle (void)
 {
+  trace (TRACE_MAJOR_BEGIN, caml_gc_phase, 0);
   if (caml_gc_phase == Phase_idle) start_cycle ();
   while (caml_gc_phase == Phase_mark) mark_slice (LONG_MAX);
   Assert (caml_gc_phase == Phase_sweep);
@@ -445,16 +451,22 @@ void caml_finish_major_cycle (void)
   Assert (caml_gc_phase == Phase_idle);
   caml_stat_major_words += caml_allocated_words;
   caml_allocated_words = 0;
+  trace (TRACE_MAJOR_END, caml_gc_phase, 0);
 }
 
 /* Make sure the request is at least Heap_chunk_min and round it up
-   to a multiple of the page size.
+   to a multiple of the page size.  With large pages, round it up to
+   fill them, less the page that holds the chunk head.
 */
 static asize_t clip_heap_chunk_size (asize_t request)
 {
   if (request < Bsize_wsize (Heap_chunk_min)){
     request = Bsize_wsize (Heap_chunk_min);
   }
+  if (caml_heap_large_pages){
+    return ((request + Page_size + VMM_LARGE_PAGE_SIZE - 1)
+            & ~(VMM_LARGE_PAGE_SIZE - 1)) - Page_size;
+  }
   return ((request + Page_size - 1) >> Page_log) << Page_log;
 }
 
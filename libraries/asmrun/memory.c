@@ -15,6 +15,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <vmm.h>
 #include "fail.h"
 #include "freelist.h"
 #include "gc.h"
@@ -224,16 +225,34 @@ int caml_page_table_remove(int kind, void * start, void * end)
    [caml_alloc_for_heap] returns NULL if the request cannot be satisfied.
    The returned pointer is a hp, but the header must be initialized by
    the caller.
+   Chunks come from the kernel's VMM when it has room, so that freeing
+   them gives the pages back; the chunk head sits at the end of an extra
+   page in front.  With [caml_heap_large_pages] they are whole 4MB pages
+   of RAM, which keeps the TLB misses down while the GC walks them.
+   Otherwise they come from malloc.
 */
 char *caml_alloc_for_heap (asize_t request)
 {
   char *mem;
-  void *block;
+  void *block = NULL;
                                               Assert (request % Page_size == 0);
-  mem = caml_aligned_malloc (request + sizeof (heap_chunk_head),
-                             sizeof (heap_chunk_head), &block);
-  if (mem == NULL) return NULL;
-  mem += sizeof (heap_chunk_head);
+  /* Only requests sized to fill them, as clip_heap_chunk_size does;
+     anything else would waste the rest of the last page. */
+  if (caml_heap_large_pages
+      && (request + Page_size) % VMM_LARGE_PAGE_SIZE == 0){
+    block = vmm_alloc_large (request + Page_size);
+  }
+  if (block == NULL){
+    block = vmm_alloc (request + Page_size, VMM_READ | VMM_WRITE);
+  }
+  if (block != NULL){
+    mem = (char *) block + Page_size;
+  }else{
+    mem = caml_aligned_malloc (request + sizeof (heap_chunk_head),
+                               sizeof (heap_chunk_head), &block);
+    if (mem == NULL) return NULL;
+    mem += sizeof (heap_chunk_head);
+  }
   Chunk_size (mem) = request;
   Chunk_block (mem) = block;
   return mem;
@@ -244,7 +263,9 @@ char *caml_alloc_for_heap (asize_t request)
 */
 void caml_free_for_heap (char *mem)
 {
-  free (Chunk_block (mem));
+  if (vmm_free (Chunk_block (mem), Chunk_size (mem) + Page_size) != 0){
+    free (Chunk_block (mem));
+  }
 }
 
 /* Take a chunk of memory as argument, which must be the result of a
@@ -14,6 +14,7 @@
 /* $Id: minor_gc.c 8954 2008-07-28 12:03:55Z doligez $ */
 
 #include <string.h>
+#include <trace.h>
 #include "config.h"
 #include "fail.h"
 #include "finalise.h"
@@ -225,6 +226,7 @@ void caml_empty_minor_heap (void)
 
   if (caml_young_ptr != caml_young_end){
     caml_in_minor_collection = 1;
+    trace (TRACE_MINOR_BEGIN, 0, 0);
     caml_gc_message (0x02, "<", 0);
     caml_oldify_local_roots();
     for (r = caml_ref_table.base; r < caml_ref_table.ptr; r++){
@@ -247,6 +249,7 @@ void caml_empty_minor_heap (void)
     clear_table (&caml_ref_table);
     clear_table (&caml_weak_ref_table);
     caml_gc_message (0x02, ">", 0);
+    trace (TRACE_MINOR_END, 0, 0);
     caml_in_minor_collection = 0;
   }
   caml_final_empty_young ();
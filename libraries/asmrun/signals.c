@@ -37,6 +37,12 @@
 CAMLexport intnat volatile caml_signals_are_pending = 0;
 CAMLexport intnat volatile caml_pending_signals[NSIG];
 
+/* Run at the same poll points as signal handlers, after them.  The
+   threads library uses it to make the running thread give up the
+   runtime; it raises caml_signals_are_pending to get it called. */
+
+CAMLexport void (* volatile caml_async_action_hook)(void) = NULL;
+
 /* Execute all pending signals */
 
 void caml_process_pending_signals(void)
@@ -51,6 +57,7 @@ void caml_process_pending_signals(void)
         caml_execute_signal(i, 0);
       }
     }
+    if (caml_async_action_hook != NULL) (*caml_async_action_hook)();
   }
 }
 
@@ -225,7 +225,7 @@
 #if defined(STANDALONE)
 #undef linux
 #define HAVE_MEMCPY 1
-#define HAVE_MMAP 0
+#define HAVE_MMAP 1
 #define HAVE_MREMAP 0
 #define malloc_getpagesize 4096
 #define LACKS_UNISTD_H 1
@@ -234,6 +234,31 @@
 #define MORECORE sbrk
 #define MORECORE_CONTIGUOUS 1 
 #define MALLOC_FAILURE_ACTION
+
+/* Large requests get pages of their own from the kernel's VMM, so freeing
+   them gives the memory back; see the functions at the end of this file */
+#include <vmm.h>
+#define MUNMAP_FAILURE  (-1)
+#define MMAP_CLEARS 0
+#define MAP_PRIVATE 1
+#define MAP_ANONYMOUS 2
+#define PROT_READ VMM_READ
+#define PROT_WRITE VMM_WRITE
+
+static void *mmap(void *ptr, long size, long prot, long type, long handle, long arg);
+static long munmap(void *ptr, long size);
+
+/* Heap accounting, see mallocstat.h. The public wrappers call these with
+   the lock held; the caller is the wrapper's return address */
+#include <mallocstat.h>
+#define MALLOC_ALLOC_HOOK(m, bytes) do { \
+    if (mallocstat_enabled && (m) != 0) \
+      mallocstat_alloc((m), (bytes), (unsigned long)__builtin_return_address(0)); \
+  } while (0)
+#define MALLOC_FREE_HOOK(m) do { \
+    if (mallocstat_enabled && (m) != 0) \
+      mallocstat_free(m); \
+  } while (0)
 #endif
 
 #if defined(_WIN32)
@@ -840,7 +865,10 @@ extern Void_t*     sbrk();
 
 /* #define HAVE_USR_INCLUDE_MALLOC_H */
 
-#ifdef HAVE_USR_INCLUDE_MALLOC_H
+#if defined(STANDALONE)
+/* The same structure, from libraries/include for mallinfo's callers */
+#include <malloc.h>
+#elif defined(HAVE_USR_INCLUDE_MALLOC_H)
 #include "/usr/include/malloc.h"
 #else
 
@@ -1554,6 +1582,35 @@ static pthread_mutex_t mALLOC_MUTEx = PTHREAD_MUTEX_INITIALIZER;
 
 #endif /* USE_MALLOC_LOCK */
 
+#elif defined(STANDALONE)
+
+/*
+  Threads can be preempted from the timer interrupt and run on several
+  CPUs, so each call holds a spinlock with interrupts off. Only the lock
+  holder touches mALLOC_ISTATe, so one saved state is enough.
+*/
+
+#include <threads.h>
+
+static spinlock_t mALLOC_LOCk = SPINLOCK_INITIALIZER;
+static long mALLOC_ISTATe;
+
+static inline int malloc_lock(void)
+{
+  long istate = spin_lock_irqsave(&mALLOC_LOCk);
+  mALLOC_ISTATe = istate;
+  return 0;
+}
+
+static inline int malloc_unlock(void)
+{
+  spin_unlock_irqrestore(&mALLOC_LOCk, mALLOC_ISTATe);
+  return 0;
+}
+
+#define MALLOC_PREACTION   malloc_lock()
+#define MALLOC_POSTACTION  malloc_unlock()
+
 #else
 
 /* Substitute anything you like for these */
@@ -1562,6 +1619,11 @@ static pthread_mutex_t mALLOC_MUTEx = PTHREAD_MUTEX_INITIALIZER;
 
 #endif
 
+#ifndef MALLOC_ALLOC_HOOK
+#define MALLOC_ALLOC_HOOK(m, bytes)
+#define MALLOC_FREE_HOOK(m)
+#endif
+
 Void_t* public_mALLOc(size_t bytes) {
   Void_t* m;
   if (MALLOC_PREACTION != 0) {
@@ -1571,6 +1633,7 @@ Void_t* public_mALLOc(size_t bytes) {
 	  bytes = ((bytes / sizeof(void *)) + 1) * sizeof(void *);
   }
   m = mALLOc(bytes);
+  MALLOC_ALLOC_HOOK(m, bytes);
 #ifdef INIT_MEM
   int i;
   for(i = 0; i < bytes/sizeof(size_t); i++) {
@@ -1587,16 +1650,23 @@ void public_fREe(Void_t* m) {
   if (MALLOC_PREACTION != 0) {
     return;
   }
+  MALLOC_FREE_HOOK(m);
   fREe(m);
   if (MALLOC_POSTACTION != 0) {
   }
 }
 
 Void_t* public_rEALLOc(Void_t* m, size_t bytes) {
+  Void_t* old = m;
   if (MALLOC_PREACTION != 0) {
     return 0;
   }
   m = rEALLOc(m, bytes);
+  /* On failure the old block is still there */
+  if (m != 0) {
+    MALLOC_FREE_HOOK(old);
+    MALLOC_ALLOC_HOOK(m, bytes);
+  }
   if (MALLOC_POSTACTION != 0) {
   }
   return m;
@@ -1608,6 +1678,7 @@ Void_t* public_mEMALIGn(size_t alignment, size_t bytes) {
     return 0;
   }
   m = mEMALIGn(alignment, bytes);
+  MALLOC_ALLOC_HOOK(m, bytes);
   if (MALLOC_POSTACTION != 0) {
   }
   return m;
@@ -1619,6 +1690,7 @@ Void_t* public_vALLOc(size_t bytes) {
     return 0;
   }
   m = vALLOc(bytes);
+  MALLOC_ALLOC_HOOK(m, bytes);
   if (MALLOC_POSTACTION != 0) {
   }
   return m;
@@ -1630,6 +1702,7 @@ Void_t* public_pVALLOc(size_t bytes) {
     return 0;
   }
   m = pVALLOc(bytes);
+  MALLOC_ALLOC_HOOK(m, bytes);
   if (MALLOC_POSTACTION != 0) {
   }
   return m;
@@ -1641,6 +1714,7 @@ Void_t* public_cALLOc(size_t n, size_t elem_size) {
     return 0;
   }
   m = cALLOc(n, elem_size);
+  MALLOC_ALLOC_HOOK(m, n * elem_size);
   if (MALLOC_POSTACTION != 0) {
   }
   return m;
@@ -1673,6 +1747,7 @@ void public_cFREe(Void_t* m) {
   if (MALLOC_PREACTION != 0) {
     return;
   }
+  MALLOC_FREE_HOOK(m);
   cFREe(m);
   if (MALLOC_POSTACTION != 0) {
   }
@@ -1797,7 +1872,9 @@ do {                                                                          \
 
 #if HAVE_MMAP
 
+#ifndef STANDALONE
 #include <fcntl.h>
+#endif
 #ifndef LACKS_SYS_MMAN_H
 #include <sys/mman.h>
 #endif
@@ -3761,6 +3838,7 @@ void fREe(mem) Void_t* mem;
       ret = munmap((char*)p - offset, size + offset);
       /* munmap returns non-zero on failure */
       assert(ret == 0);
+      (void)ret;
 #endif
     }
   }
@@ -5327,6 +5405,23 @@ static int cpuinfo (int whole, unsigned long *kernel, unsigned long *user) {
 
 #endif /* WIN32 */
 
+#ifdef STANDALONE
+
+/* mmap and munmap over the kernel's VMM, anonymous memory only */
+
+static void *mmap(void *ptr, long size, long prot, long type, long handle, long arg)
+{
+  void *mem = vmm_alloc(size, prot);
+  return mem != NULL ? mem : (void *)MORECORE_FAILURE;
+}
+
+static long munmap(void *ptr, long size)
+{
+  return vmm_free(ptr, size);
+}
+
+#endif /* STANDALONE */
+
 /* ------------------------------------------------------------
 History:
 
@@ -55,6 +55,13 @@ static inline unsigned int in32(int port) {
 	return dword;
 }
 
+/* Time stamp counter, in CPU cycles */
+static inline unsigned long long rdtsc(void) {
+	unsigned long long tsc;
+	asm volatile("rdtsc" : "=A" (tsc));
+	return tsc;
+}
+
 static inline unsigned char in8_p(int port) {
   register unsigned char byte;
   
@@ -48,6 +48,9 @@ extern uintnat caml_fl_size_at_phase_change;
 #define Subphase_final 13
 
 CAMLextern char *caml_heap_start;
+/* Heap chunks in whole 4MB pages of RAM when the kernel has them, see
+   caml_alloc_for_heap.  Set it before caml_startup for the initial heap. */
+CAMLextern int caml_heap_large_pages;
 extern uintnat total_heap_size;
 extern char *caml_gc_sweep_hp;
 
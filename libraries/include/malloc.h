@@ -0,0 +1,24 @@
+#ifndef MALLOC_HEADER
+#define MALLOC_HEADER
+
+#include <stddef.h>
+
+/* SVID2/XPG mallinfo, laid out as dlmalloc.c expects */
+struct mallinfo {
+  int arena;    /* non-mmapped space allocated from system */
+  int ordblks;  /* number of free chunks */
+  int smblks;   /* number of fastbin blocks */
+  int hblks;    /* number of mmapped regions */
+  int hblkhd;   /* space in mmapped regions */
+  int usmblks;  /* maximum total allocated space */
+  int fsmblks;  /* space available in freed fastbin blocks */
+  int uordblks; /* total allocated space */
+  int fordblks; /* total free space */
+  int keepcost; /* top-most, releasable (via malloc_trim) space */
+};
+
+struct mallinfo mallinfo(void);
+int malloc_trim(size_t pad);
+size_t malloc_usable_size(void *ptr);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef MALLOCSTAT_HEADER
+#define MALLOCSTAT_HEADER
+
+#include <stddef.h>
+
+/* Heap accounting
+ *
+ * While mallocstat is on, every block malloc, calloc, realloc or memalign
+ * hands out is charged to an owner, and live bytes, peak live bytes and
+ * call counts are kept per owner. The owner is the allocating thread's
+ * tag if it has set one with malloc_tag_set, so a subsystem's memory adds
+ * up wherever in it the calls are made, and otherwise the function that
+ * called malloc.
+ *
+ * Blocks of at least the threshold given to mallocstat_start also have
+ * the call stack that allocated them recorded, unwound as the sampling
+ * profiler does (profile.h), so that a large block from a general purpose
+ * wrapper can be traced to whoever wanted it.
+ *
+ * Only blocks allocated since mallocstat_start are known; freeing older
+ * ones is ignored. The block table is grown from the VMM (vmm.h), so
+ * without a VMM window blocks past its first size go uncounted.
+ *
+ * Off by default; when off the cost is a load and a branch in malloc and
+ * free. */
+
+/* Tags that can be registered, including the untagged tag 0 */
+#define MALLOC_TAGS		64
+/* Distinct owners tracked, the rest are lumped together */
+#define MALLOC_OWNERS		256
+/* Large blocks whose stacks are kept, later ones are counted as dropped */
+#define MALLOC_SAMPLES		256
+
+extern volatile int mallocstat_enabled;
+
+/* A new tag named name, 0 if they've run out. name isn't copied */
+extern int malloc_tag_register(const char *name);
+/* Charge the calling thread's allocations to tag, 0 for its callers.
+ * Returns the previous tag, to put back when the subsystem returns */
+extern int malloc_tag_set(int tag);
+
+/* Forget what's been counted and start counting, recording stacks for
+ * blocks of at least large bytes (0 for none) */
+extern void mallocstat_start(size_t large);
+extern void mallocstat_stop();
+/* Owners by live bytes, the live large blocks and malloc's own mallinfo
+ * over serial */
+extern void mallocstat_report();
+
+/* Hooks, called by dlmalloc.c while mallocstat_enabled, under malloc's
+ * lock */
+extern void mallocstat_alloc(void *mem, size_t size, unsigned long caller);
+extern void mallocstat_free(void *mem);
+
+#endif
@@ -31,9 +31,6 @@
 /* The magic number passed by a Multiboot-compliant boot loader. */
 #define MULTIBOOT_BOOTLOADER_MAGIC      0x2BADB002
 
-/* The size of our stack (128KB). */
-#define STACK_SIZE                      0x20000
-
 /* C symbol format. HAVE_ASM_USCORE is defined by configure. */
 #ifdef HAVE_ASM_USCORE
 # define EXT_C(sym)                     _ ## sym
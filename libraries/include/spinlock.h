@@ -0,0 +1,48 @@
+#ifndef _SPINLOCK_H
+#define _SPINLOCK_H
+
+/* Test-and-test-and-set spinlock. These don't touch IF; anything that can
+ * also be taken from an interrupt handler must be locked with interrupts
+ * disabled (see spin_lock_irqsave in threads.h) */
+
+typedef struct spinlock {
+	volatile unsigned long locked;
+} spinlock_t;
+
+#define SPINLOCK_INITIALIZER { 0 }
+
+static inline void spin_init(spinlock_t *lock)
+{
+	lock->locked = 0;
+}
+
+static inline int spin_trylock(spinlock_t *lock)
+{
+	unsigned long old = 1;
+	asm volatile("xchgl %0, %1" : "+r"(old), "+m"(lock->locked) :: "memory");
+	return old == 0;
+}
+
+static inline void spin_lock(spinlock_t *lock)
+{
+	while(!spin_trylock(lock)) {
+		while(lock->locked) {
+			asm volatile("pause");
+		}
+	}
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+	asm volatile("" ::: "memory");
+	lock->locked = 0;
+}
+
+/* Atomically add to *p, returning the previous value */
+static inline unsigned long atomic_fetch_add(volatile unsigned long *p, unsigned long n)
+{
+	asm volatile("lock; xaddl %0, %1" : "+r"(n), "+m"(*p) :: "memory");
+	return n;
+}
+
+#endif
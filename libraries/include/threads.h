@@ -2,18 +2,72 @@
 #define _THREADS_H
 
 #include <list.h>
+#include <spinlock.h>
 
 #define RUNNABLE 0
 #define BLOCKED 1
 #define KILLED 2
 #define EXITED 4
 
+/* Scheduling priorities, higher runs first */
+#define THREAD_PRIORITIES 32
+#define PRIORITY_MIN 0
+#define PRIORITY_DEFAULT 16
+#define PRIORITY_MAX (THREAD_PRIORITIES - 1)
+
 typedef struct thread {
 	unsigned long *stack;
+	/* Size of the allocation at stack, in bytes */
+	size_t stack_size;
+	/* Unmapped page below the stack when guarded, otherwise NULL */
+	void *stack_guard;
+	/* Stack was filled with canaries at creation */
+	unsigned long stack_painted;
 	unsigned long *esp;
 	void *slot;
 	unsigned long id;
 	unsigned long status;
+	/* Ticks left before the thread is preempted */
+	unsigned long quantum;
+	/* Preemption is held off while this is non-zero */
+	unsigned long preempt_count;
+	/* Which run queue the thread goes on, PRIORITY_MIN..PRIORITY_MAX. This
+	 * is base_priority, raised while a more urgent thread waits on a mutex
+	 * the thread holds */
+	unsigned long priority;
+	/* Priority as set by thread_set_priority */
+	unsigned long base_priority;
+	/* Mutexes held, for working out the inherited priority on unlock */
+	link_t held_mutexes;
+	/* Mutex the thread is blocked in mutex_lock on, and its node in the
+	 * mutex's waitqueue; both protected by that mutex's lock */
+	struct mutex *blocked_on;
+	struct waitqueue_node *blocked_node;
+	/* Non-zero once fpu_area holds a saved FPU/SSE context */
+	unsigned long fpu_valid;
+	/* FXSAVE image, 512 bytes that must be 16-byte aligned (see fpu_state) */
+	unsigned char fpu_area[512 + 15];
+	/* CPU whose run queue the thread is on, or last ran on */
+	struct cpu *cpu;
+	/* Set while some CPU is running on the thread's stack */
+	volatile unsigned long on_cpu;
+	/* Set while the thread is linked on a run queue */
+	unsigned long on_rq;
+	
+	/* CPU accounting, in TSC cycles, see thread_get_stats */
+	unsigned long long run_cycles;
+	unsigned long long blocked_cycles;
+	/* TSC when the thread was last switched in */
+	unsigned long long switched_at;
+	/* TSC when the thread was switched out blocked, 0 once woken */
+	unsigned long long blocked_at;
+	/* run_cycles as of the last thread_top */
+	unsigned long long top_cycles;
+	unsigned long switches;
+	unsigned long wakeups;
+	
+	/* Tag the thread's allocations are charged to, see mallocstat.h */
+	int malloc_tag;
 	
 	/* Doubly-linked list of threads in the system */
 	link_t global_link;
@@ -24,33 +78,131 @@ typedef struct thread {
 /* Pointer to emulate unique thread ID semantics of pthread_t */
 typedef real_thread_t *thread_t;
 
+/* Snapshot of a thread's CPU accounting. Cycles are TSC cycles, run time
+ * includes the slice in progress. switches counts times the thread was
+ * switched in, wakeups times it was made runnable after blocking */
+typedef struct thread_stats {
+	unsigned long id;
+	unsigned long status;
+	unsigned long priority;
+	unsigned long long run_cycles;
+	unsigned long long blocked_cycles;
+	unsigned long switches;
+	unsigned long wakeups;
+} thread_stats_t;
+
 typedef struct waitqueue_node {
 	thread_t thread;
 	link_t link;
 } waitqueue_node_t;
 
+/* Contention statistics, gathered while thread_lock_profiling is on.
+ * Cycles are TSC cycles. For a mutex, waits are the time contended
+ * acquisitions spent blocked and hold is the time from acquisition to
+ * unlock. For a cond, acquisitions count waits, contended counts threads
+ * woken by signal/broadcast and waits are the time until woken */
+typedef struct lock_stats {
+	/* On the list thread_lock_report walks */
+	link_t link;
+	char type;
+	unsigned long id;
+	unsigned long acquisitions;
+	unsigned long contended;
+	unsigned long long wait_cycles;
+	unsigned long long wait_max;
+	unsigned long long hold_cycles;
+	unsigned long long hold_max;
+	/* TSC when the current owner got the mutex, 0 if not measured */
+	unsigned long long acquired_at;
+} lock_stats_t;
+
+/* Waiters queue in priority order, and the owner runs at no less than the
+ * priority of the first (priority inheritance, see mutex_boost) */
 typedef struct mutex {
+	spinlock_t lock;
 	link_t waitqueue_head;
 	thread_t owner;
+	/* On the owner's held_mutexes */
+	link_t held_link;
+	/* Priority of the first waiter, PRIORITY_MIN if none */
+	volatile unsigned long waiter_priority;
 	unsigned long id;
+	lock_stats_t stats;
 } mutex_t;
 
 typedef struct cond {
+	spinlock_t lock;
 	link_t waitqueue_head;
 	unsigned long id;
+	lock_stats_t stats;
 } cond_t;
 
+/* Shared for reading, exclusive for writing, see rwlock_rdlock */
+typedef struct rwlock {
+	spinlock_t lock;
+	/* Readers held off by a writer, woken together */
+	link_t readers_head;
+	/* Writers waiting for exclusive access, woken one at a time */
+	link_t writers_head;
+	/* Readers holding the lock */
+	unsigned long readers;
+	/* Writer holding the lock, or NULL */
+	thread_t volatile writer;
+	/* Writers queued or about to be, new readers wait behind them */
+	unsigned long writers_waiting;
+	unsigned long id;
+} rwlock_t;
+
+typedef struct sem {
+	spinlock_t lock;
+	link_t waitqueue_head;
+	unsigned long count;
+	unsigned long id;
+} sem_t;
+
 typedef void *(*thread_func)(void *);
 
+/* Stack sizes in bytes; thread_create uses STACK_SIZE */
+#define STACK_SIZE (64 * 1024)
+#define STACK_SIZE_MIN (4 * 1024)
+#define STACK_SIZE_MAX (64 * 1024)
+
+/* Default preemption rate and time slice, in PIT ticks */
+#define PREEMPT_HZ 100
+#define PREEMPT_QUANTUM 2
+
 extern void thread_init();
 extern void thread_yield();
 extern void thread_exit(void *);
-extern void thread_create(thread_t *, void *(*)(void *), void *);
+/* 0 on success, -1 with *thread set to NULL if there's no memory for the
+ * thread or its stack */
+extern int thread_create(thread_t *, void *(*)(void *), void *);
+extern int thread_create_ex(thread_t *, void *(*)(void *), void *, size_t);
 extern thread_t thread_self();
 extern void thread_setspecific(void *);
 extern void *thread_getspecific();
 extern void thread_sleep();
 extern void thread_wake(thread_t);
+extern void thread_sleep_for(unsigned long long ns);
+extern void thread_stack_watermarks(int);
+extern void thread_stack_guards(int);
+extern size_t thread_stack_high_watermark(thread_t);
+extern void thread_stack_report();
+extern thread_t thread_find_guard(unsigned long);
+extern int thread_get_priority(thread_t);
+extern void thread_set_priority(thread_t, int);
+extern void thread_preempt_init(unsigned int hz, unsigned int quantum);
+extern void thread_preempt_disable();
+extern void thread_preempt_enable();
+extern void thread_tick();
+extern void thread_get_stats(thread_t, thread_stats_t *);
+extern int thread_get_all_stats(thread_stats_t *, int max);
+extern void thread_top();
+extern void thread_top_every(unsigned long long ns);
+extern void thread_lock_profiling(int);
+extern void thread_lock_report();
+extern void thread_lock_reset();
+extern void thread_resched();
 
 //extern mutex_t *mutex_create();
 extern void mutex_init(mutex_t *);
@@ -58,6 +210,7 @@ extern void mutex_destroy(mutex_t *);
 extern void mutex_lock(mutex_t *);
 extern void mutex_unlock(mutex_t *);
 extern int mutex_trylock(mutex_t *);
+extern int mutex_timedlock(mutex_t *, unsigned long long ns);
 extern void mutex_unsafe_lock(mutex_t *);
 extern void mutex_unsafe_unlock(mutex_t *);
 
@@ -65,18 +218,48 @@ extern void mutex_unsafe_unlock(mutex_t *);
 extern void cond_init(cond_t *);
 extern void cond_destroy(cond_t *);
 extern void cond_wait(cond_t *, mutex_t *);
+extern int cond_timedwait(cond_t *, mutex_t *, unsigned long long ns);
 extern void cond_signal(cond_t *);
 extern void cond_broadcast(cond_t *);
 
+extern void rwlock_init(rwlock_t *);
+extern void rwlock_destroy(rwlock_t *);
+extern void rwlock_rdlock(rwlock_t *);
+extern int rwlock_tryrdlock(rwlock_t *);
+extern void rwlock_wrlock(rwlock_t *);
+extern int rwlock_trywrlock(rwlock_t *);
+extern void rwlock_unlock(rwlock_t *);
+
+extern void sem_init(sem_t *, unsigned long count);
+extern void sem_destroy(sem_t *);
+extern void sem_wait(sem_t *);
+extern int sem_trywait(sem_t *);
+extern int sem_timedwait(sem_t *, unsigned long long ns);
+extern void sem_post(sem_t *);
+extern unsigned long sem_getvalue(sem_t *);
+
+/* Interrupt-disabled time is measured per call site while irqstat is on,
+ * see libraries/kernel/irqstat.c. Out of line so the return address is
+ * inside the function that disabled interrupts */
+extern volatile int irqstat_enabled;
+extern void irqoff_begin(void);
+extern void irqoff_end(void);
+
 static inline long interrupts_disable(void)
 {
 	long eflags;
 	asm volatile("pushf;cli;pop %0":"=rm"(eflags));
+	if(irqstat_enabled && (eflags & 0x200)) {
+		irqoff_begin();
+	}
 	return eflags & 0x200;
 }
 
 static inline void interrupts_enable(void)
 {
+	if(irqstat_enabled) {
+		irqoff_end();
+	}
 	asm volatile("sti;nop");
 }
 
@@ -88,4 +271,19 @@ static inline void interrupts_restore(long state)
 	}
 }
 
+/* Spinlocks shared with interrupt handlers must be taken with interrupts off,
+ * or the handler can spin forever on a lock its own CPU holds */
+static inline long spin_lock_irqsave(spinlock_t *lock)
+{
+	long state = interrupts_disable();
+	spin_lock(lock);
+	return state;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, long state)
+{
+	spin_unlock(lock);
+	interrupts_restore(state);
+}
+
 #endif
@@ -0,0 +1,52 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/* Event tracing
+ *
+ * While tracing is on, events are written to a per-CPU ring of fixed size
+ * records stamped with the TSC, overwriting the oldest once it fills up.
+ * Each CPU only ever writes its own ring, with interrupts disabled, so
+ * nothing takes a lock. trace_dump stops tracing and prints the rings over
+ * serial for tools/trace2json.ml to turn into a Chrome trace.
+ *
+ * The event numbers are shared with irqs.S and trace2json.ml */
+
+#define TRACE_SWITCH		1	/* a = previous thread, b = next thread */
+#define TRACE_WAKE			2	/* a = woken thread, b = waking thread */
+#define TRACE_IRQ_ENTER		3	/* a = IRQ line, or IPI vector */
+#define TRACE_IRQ_EXIT		4
+#define TRACE_MINOR_BEGIN	5
+#define TRACE_MINOR_END		6
+#define TRACE_MAJOR_BEGIN	7	/* a = GC phase */
+#define TRACE_MAJOR_END		8
+
+/* Events per CPU, must be a power of two */
+#define TRACE_EVENTS		4096
+
+#ifndef __ASSEMBLER__
+
+typedef struct trace_event {
+	unsigned long long tsc;
+	unsigned long type;
+	unsigned long a;
+	unsigned long b;
+} trace_event_t;
+
+extern volatile int trace_enabled;
+
+extern void trace_start();
+extern void trace_stop();
+extern void trace_dump();
+extern void trace_record(unsigned long type, unsigned long a, unsigned long b);
+
+/* Costs a load and a branch while tracing is off */
+static inline void trace(unsigned long type, unsigned long a, unsigned long b)
+{
+	if(trace_enabled) {
+		trace_record(type, a, b);
+	}
+}
+
+#endif
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef VMM_HEADER
+#define VMM_HEADER
+
+/* Virtual memory manager
+ *
+ * Physical memory stays identity mapped, with 4MB pages, so that the kernel
+ * and everything allocated through sbrk keeps using physical addresses.
+ * The address space between the top of RAM and the PCI hole at 3GB is a
+ * window that the VMM hands out instead: vmm_alloc reserves a range of it
+ * and backs it with page frames from pmm.c, in whatever pieces are free,
+ * and vmm_free unmaps them and gives the frames back.
+ *
+ * Every CPU shares the one page directory. A CPU that unmaps or
+ * downgrades a page flushes its own TLB; the others flush at their next
+ * tick (or when they wake from idle), so an address range vmm_free has
+ * released isn't handed out again until all of them have. Until then they
+ * may still reach the old frames through stale entries, which only matters
+ * to code that uses memory after freeing it.
+ *
+ * None of this sleeps or calls malloc, so it's usable from under malloc's
+ * lock (dlmalloc's MMAP and MUNMAP) but not from interrupt handlers. */
+
+/* Page protections, the same values as mmap's PROT_*. The MMU can't make
+ * a present page unreadable, so anything but VMM_NONE is readable */
+#define VMM_NONE	0
+#define VMM_READ	1
+#define VMM_WRITE	2
+
+#define VMM_LARGE_PAGE_SIZE	0x400000
+
+/* Turn paging on and set up the window, after pmm_init */
+extern void vmm_init();
+
+/* Map count pages at virt to the frames from phys, replacing whatever was
+ * there. 0 on success, -1 if a page table couldn't be allocated */
+extern int vmm_map(unsigned long virt, unsigned long phys, unsigned long count, int prot);
+/* Unmap count pages at virt, their frames are the caller's to free */
+extern void vmm_unmap(unsigned long virt, unsigned long count);
+/* Change the protection of count mapped pages at virt, -1 if one isn't
+ * mapped */
+extern int vmm_protect(unsigned long virt, unsigned long count, int prot);
+/* Physical address virt maps to, 0 if it isn't mapped */
+extern unsigned long vmm_phys(unsigned long virt);
+
+/* size bytes, rounded up to whole pages, of fresh memory from the window;
+ * NULL if there isn't enough address space or RAM. Not zeroed */
+extern void *vmm_alloc(unsigned long size, int prot);
+/* size bytes, rounded up to whole 4MB pages, of physically contiguous and
+ * 4MB aligned RAM, which the identity mapping covers with large pages (so
+ * long as nothing split one for a guard page). For memory that's swept
+ * end to end, where 4KB pages would miss the TLB all the way. NULL if
+ * there's no such run of free RAM */
+extern void *vmm_alloc_large(unsigned long size);
+/* Give back memory from vmm_alloc or vmm_alloc_large, size as it was
+ * allocated. -1 if addr came from neither, so callers that fell back on
+ * malloc can tell */
+extern int vmm_free(void *addr, unsigned long size);
+
+/* Catch this CPU's TLB up with unmaps done elsewhere, called from the tick
+ * and the idle loop with interrupts disabled */
+extern void vmm_tlb_sync();
+
+extern void vmm_report();
+
+#endif
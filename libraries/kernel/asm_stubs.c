@@ -4,9 +4,21 @@
 #include <caml/memory.h>
 #include <caml/fail.h>
 #include <caml/alloc.h>
+#include <caml/signals.h>
+#include <caml/major_gc.h>
 
 #include <asm.h>
+#include <stdlib.h>
 #include <string.h>
+#include <threads.h>
+#include <trace.h>
+#include "irqstat.h"
+#include "profile.h"
+#include "pmm.h"
+#include <vmm.h>
+#include "slab.h"
+#include "timer.h"
+#include <mallocstat.h>
 
 CAMLprim value snowflake_out8(value port, value val) {
 	out8(Int_val(port), Int_val(val));
@@ -112,12 +124,231 @@ unsigned long long get_ticks()
 	return (tick.tick >> 16);
 }
 
-/*
 CAMLprim value snowflake_usleep(value usec) {
-	tick_t start, tick;
-	int diff = Int_val(usec);
-	ticks(start);
+	unsigned long long ns = (unsigned long long)Long_val(usec) * 1000;
+	caml_enter_blocking_section();
+	thread_sleep_for(ns);
+	caml_leave_blocking_section();
+	return Val_unit;
+}
+
+CAMLprim value snowflake_lock_profiling(value enable) {
+	thread_lock_profiling(Bool_val(enable));
+	return Val_unit;
+}
+
+CAMLprim value snowflake_lock_report(value unit) {
+	thread_lock_report();
+	return Val_unit;
+}
+
+CAMLprim value snowflake_lock_reset(value unit) {
+	thread_lock_reset();
+	return Val_unit;
+}
+
+/* Array of { id; status; priority; run_cycles : int64; blocked_cycles : int64;
+ * switches; wakeups } records, one per thread */
+CAMLprim value snowflake_thread_stats(value unit) {
+	CAMLparam1(unit);
+	CAMLlocal3(result, record, cycles);
+	thread_stats_t *stats = NULL;
+	int i, n = 0, max = 0;
+	
+	do {
+		free(stats);
+		max = n + 8;
+		stats = malloc(max * sizeof(thread_stats_t));
+		if(stats == NULL) {
+			caml_raise_out_of_memory();
+		}
+		n = thread_get_all_stats(stats, max);
+	} while(n > max);
+	
+	result = caml_alloc_tuple(n);
+	for(i = 0; i < n; i++) {
+		record = caml_alloc_tuple(7);
+		Store_field(record, 0, Val_long(stats[i].id));
+		Store_field(record, 1, Val_long(stats[i].status));
+		Store_field(record, 2, Val_long(stats[i].priority));
+		cycles = caml_copy_int64(stats[i].run_cycles);
+		Store_field(record, 3, cycles);
+		cycles = caml_copy_int64(stats[i].blocked_cycles);
+		Store_field(record, 4, cycles);
+		Store_field(record, 5, Val_long(stats[i].switches));
+		Store_field(record, 6, Val_long(stats[i].wakeups));
+		Store_field(result, i, record);
+	}
+	free(stats);
+	CAMLreturn(result);
+}
+
+CAMLprim value snowflake_thread_top(value unit) {
+	thread_top();
+	return Val_unit;
+}
+
+/* Dump every period milliseconds, 0 to stop */
+CAMLprim value snowflake_thread_top_every(value period) {
+	thread_top_every((unsigned long long)Long_val(period) * 1000000);
+	return Val_unit;
+}
+
+CAMLprim value snowflake_trace_start(value unit) {
+	trace_start();
+	return Val_unit;
+}
+
+CAMLprim value snowflake_trace_stop(value unit) {
+	trace_stop();
+	return Val_unit;
+}
+
+CAMLprim value snowflake_trace_dump(value unit) {
+	trace_dump();
+	return Val_unit;
+}
+
+CAMLprim value snowflake_profile_start(value unit) {
+	profile_start();
+	return Val_unit;
+}
+
+CAMLprim value snowflake_profile_stop(value unit) {
+	profile_stop();
+	return Val_unit;
+}
+
+CAMLprim value snowflake_profile_dump(value unit) {
+	profile_dump();
+	return Val_unit;
+}
+
+CAMLprim value snowflake_pmm_report(value unit) {
+	pmm_report();
+	return Val_unit;
+}
+
+CAMLprim value snowflake_vmm_report(value unit) {
+	vmm_report();
+	return Val_unit;
+}
+
+CAMLprim value snowflake_slab_report(value unit) {
+	slab_report();
+	return Val_unit;
+}
+
+/* Stacks are kept for blocks of at least large bytes, 0 for none */
+CAMLprim value snowflake_mallocstat_start(value large) {
+	mallocstat_start(Long_val(large));
+	return Val_unit;
+}
+
+CAMLprim value snowflake_mallocstat_stop(value unit) {
+	mallocstat_stop();
+	return Val_unit;
+}
+
+CAMLprim value snowflake_mallocstat_report(value unit) {
+	mallocstat_report();
+	return Val_unit;
+}
+
+/* Heap chunks added from now on come in 4MB pages, see memory.c */
+CAMLprim value snowflake_heap_large_pages(value enable) {
+	caml_heap_large_pages = Bool_val(enable);
+	return Val_unit;
+}
+
+/* Stop the tick while every CPU is idle, see timer_idle */
+CAMLprim value snowflake_timer_set_tickless(value enable) {
+	timer_set_tickless(Bool_val(enable));
+	return Val_unit;
+}
+
+CAMLprim value snowflake_irqstat_start(value unit) {
+	irqstat_start();
+	return Val_unit;
+}
+
+CAMLprim value snowflake_irqstat_stop(value unit) {
+	irqstat_stop();
+	return Val_unit;
+}
+
+CAMLprim value snowflake_irqstat_reset(value unit) {
+	irqstat_reset();
+	return Val_unit;
+}
+
+CAMLprim value snowflake_irqstat_report(value unit) {
+	irqstat_report();
+	return Val_unit;
+}
+
+static value alloc_irq_histogram(irq_histogram_t *hist) {
+	CAMLparam0();
+	CAMLlocal3(result, buckets, cycles);
+	int i;
+	
+	buckets = caml_alloc_tuple(IRQSTAT_BUCKETS);
+	for(i = 0; i < IRQSTAT_BUCKETS; i++) {
+		Store_field(buckets, i, Val_long(hist->buckets[i]));
+	}
+	result = caml_alloc_tuple(4);
+	Store_field(result, 0, Val_long(hist->count));
+	cycles = caml_copy_int64(hist->total);
+	Store_field(result, 1, cycles);
+	cycles = caml_copy_int64(hist->max);
+	Store_field(result, 2, cycles);
+	Store_field(result, 3, buckets);
+	CAMLreturn(result);
+}
+
+/* { count; total : int64; max : int64; buckets : int array } for an IRQ
+ * line; kind 0 is latency, 1 handler time */
+CAMLprim value snowflake_irqstat_irq(value kind, value irq) {
+	irq_histogram_t hist;
+	int err;
+	
+	if(Int_val(kind) == 0) {
+		err = irqstat_get_latency(Int_val(irq), &hist);
+	} else {
+		err = irqstat_get_handler(Int_val(irq), &hist);
+	}
+	if(err) {
+		caml_invalid_argument("irqstat_irq");
+	}
+	return alloc_irq_histogram(&hist);
+}
+
+/* Array of (site, longest section's end, histogram), most total time first */
+CAMLprim value snowflake_irqstat_irqoff(value unit) {
+	CAMLparam1(unit);
+	CAMLlocal3(result, tuple, hist);
+	irqoff_site_t *sites = NULL;
+	int i, n = 0, max = 0;
+	
 	do {
-		ticks(tick);
-	} while (tick
-*/
+		free(sites);
+		max = n + 16;
+		sites = malloc(max * sizeof(irqoff_site_t));
+		if(sites == NULL) {
+			caml_raise_out_of_memory();
+		}
+		n = irqstat_get_irqoff(sites, max);
+	} while(n > max);
+	
+	result = caml_alloc_tuple(n);
+	for(i = 0; i < n; i++) {
+		hist = alloc_irq_histogram(&sites[i].hist);
+		tuple = caml_alloc_tuple(3);
+		Store_field(tuple, 0, Val_long(sites[i].site));
+		Store_field(tuple, 1, Val_long(sites[i].max_end));
+		Store_field(tuple, 2, hist);
+		Store_field(result, i, tuple);
+	}
+	free(sites);
+	CAMLreturn(result);
+}
@@ -0,0 +1,261 @@
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include "dma.h"
+#include "slab.h"
+#include "pmm.h"
+
+/* A cache line up to a page, in powers of two */
+#define DMA_CLASSES	7
+
+static slab_cache_t *caches[DMA_CLASSES];
+static const char *class_names[DMA_CLASSES] = {
+	"dma-64", "dma-128", "dma-256", "dma-512", "dma-1024", "dma-2048", "dma-4096"
+};
+/* Buffers bigger than a page, straight from pmm */
+static volatile unsigned long big_buffers = 0;
+static volatile unsigned long big_pages = 0;
+
+void dma_init()
+{
+	int i;
+
+	for(i = 0; i < DMA_CLASSES; i++) {
+		caches[i] = slab_cache_create_ex(class_names[i], SLAB_CACHE_LINE << i, 0, DMA_LIMIT);
+	}
+}
+
+static int class_of(size_t size)
+{
+	int c = 0;
+
+	while((SLAB_CACHE_LINE << c) < size) {
+		c++;
+	}
+	return c;
+}
+
+void *dma_alloc(size_t size, unsigned long *phys)
+{
+	unsigned long addr, count;
+	int c;
+
+	if(size == 0 || size > DMA_MAX_SIZE) {
+		return NULL;
+	}
+	if(size <= PAGE_SIZE) {
+		c = class_of(size);
+		addr = caches[c] != NULL ? (unsigned long)slab_alloc(caches[c]) : 0;
+	} else {
+		count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+		addr = pmm_alloc_contig(count, PAGE_SIZE, DMA_LIMIT, DMA_BOUNDARY);
+		if(addr != 0) {
+			atomic_fetch_add(&big_buffers, 1);
+			atomic_fetch_add(&big_pages, count);
+		}
+	}
+	if(addr != 0 && phys != NULL) {
+		*phys = addr;
+	}
+	return (void *)addr;
+}
+
+void dma_free(void *buf, size_t size)
+{
+	unsigned long count;
+
+	if(buf == NULL) {
+		return;
+	}
+	if(size <= PAGE_SIZE) {
+		slab_free(caches[class_of(size)], buf);
+	} else {
+		count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+		pmm_free((unsigned long)buf, count);
+		atomic_fetch_add(&big_buffers, -1);
+		atomic_fetch_add(&big_pages, -count);
+	}
+}
+
+void dma_report()
+{
+	slab_stats_t stats;
+	int i;
+
+	for(i = 0; i < DMA_CLASSES; i++) {
+		if(caches[i] == NULL) {
+			continue;
+		}
+		slab_cache_stats(caches[i], &stats);
+		dprintf("dma: %u byte buffers: %u in use (peak %u), %u KB of slabs\r\n",
+			stats.size, stats.in_use, stats.peak,
+			stats.slabs * stats.slab_pages * (PAGE_SIZE / 1024));
+	}
+	dprintf("dma: %u buffers over a page, %u KB\r\n",
+		big_buffers, big_pages * (PAGE_SIZE / 1024));
+}
+
+/* OCaml interface
+ *
+ * A buffer is a custom block holding its address and length, standing in
+ * for a Bigarray since the bigarray library isn't built into the kernel.
+ * Accesses are bounds checked, and the 16 and 32 bit ones are little
+ * endian, as descriptor rings are laid out. New buffers are zeroed.
+ *
+ * The GC doesn't know when a device is done with a buffer, so drivers
+ * should release it explicitly once it is; collection frees it otherwise.
+ * A released buffer raises Invalid_argument on any use. */
+
+typedef struct dma_view {
+	unsigned char *buf;
+	size_t size;
+} dma_view_t;
+
+#define Dma_val(v) ((dma_view_t *) Data_custom_val(v))
+
+/* Unreachable buffers adding up to this much push the GC along as hard as
+ * a heap's worth of garbage would */
+#define DMA_GC_MAX	(1024 * 1024)
+
+static void snowflake_dma_finalize(value v)
+{
+	dma_view_t *d = Dma_val(v);
+
+	dma_free(d->buf, d->size);
+	d->buf = NULL;
+}
+
+static int snowflake_dma_compare(value v1, value v2)
+{
+	unsigned char *b1 = Dma_val(v1)->buf, *b2 = Dma_val(v2)->buf;
+	return b1 == b2 ? 0 : (b1 < b2 ? -1 : 1);
+}
+
+static struct custom_operations dma_ops = {
+	"snowflake.dma",
+	snowflake_dma_finalize,
+	snowflake_dma_compare,
+	custom_hash_default,
+	custom_serialize_default,
+	custom_deserialize_default
+};
+
+/* len bytes at off, raising unless they're all in the buffer */
+static unsigned char *dma_at(value v, value off, size_t len)
+{
+	dma_view_t *d = Dma_val(v);
+	long o = Long_val(off);
+
+	if(d->buf == NULL) {
+		caml_invalid_argument("Dma: buffer released");
+	}
+	if(o < 0 || (size_t)o > d->size || len > d->size - o) {
+		caml_array_bound_error();
+	}
+	return d->buf + o;
+}
+
+CAMLprim value snowflake_dma_create(value size) {
+	long n = Long_val(size);
+	void *buf;
+	value v;
+
+	if(n <= 0 || n > DMA_MAX_SIZE) {
+		caml_invalid_argument("Dma.create");
+	}
+	buf = dma_alloc(n, NULL);
+	if(buf == NULL) {
+		caml_raise_out_of_memory();
+	}
+	memset(buf, 0, n);
+	v = caml_alloc_custom(&dma_ops, sizeof(dma_view_t), n, DMA_GC_MAX);
+	Dma_val(v)->buf = buf;
+	Dma_val(v)->size = n;
+	return v;
+}
+
+CAMLprim value snowflake_dma_release(value v) {
+	snowflake_dma_finalize(v);
+	return Val_unit;
+}
+
+CAMLprim value snowflake_dma_length(value v) {
+	return Val_long(Dma_val(v)->size);
+}
+
+CAMLprim value snowflake_dma_phys(value v) {
+	return Val_long((unsigned long)dma_at(v, Val_long(0), 0));
+}
+
+CAMLprim value snowflake_dma_get_uint8(value v, value off) {
+	return Val_int(*dma_at(v, off, 1));
+}
+
+CAMLprim value snowflake_dma_set_uint8(value v, value off, value x) {
+	*dma_at(v, off, 1) = Int_val(x);
+	return Val_unit;
+}
+
+CAMLprim value snowflake_dma_get_uint16(value v, value off) {
+	unsigned char *p = dma_at(v, off, 2);
+	return Val_int(p[0] | (p[1] << 8));
+}
+
+CAMLprim value snowflake_dma_set_uint16(value v, value off, value x) {
+	unsigned char *p = dma_at(v, off, 2);
+	int n = Int_val(x);
+
+	p[0] = n;
+	p[1] = n >> 8;
+	return Val_unit;
+}
+
+CAMLprim value snowflake_dma_get_int32(value v, value off) {
+	unsigned char *p = dma_at(v, off, 4);
+	return caml_copy_int32(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32)p[3] << 24));
+}
+
+CAMLprim value snowflake_dma_set_int32(value v, value off, value x) {
+	unsigned char *p = dma_at(v, off, 4);
+	uint32 n = Int32_val(x);
+
+	p[0] = n;
+	p[1] = n >> 8;
+	p[2] = n >> 16;
+	p[3] = n >> 24;
+	return Val_unit;
+}
+
+/* String.blit's argument order, from a string into a buffer */
+CAMLprim value snowflake_dma_blit_from_string(value src, value srcoff, value dst, value dstoff, value len) {
+	long s = Long_val(srcoff), n = Long_val(len);
+
+	if(n < 0 || s < 0 || s > (long)caml_string_length(src) - n) {
+		caml_invalid_argument("Dma.blit_from_string");
+	}
+	memcpy(dma_at(dst, dstoff, n), String_val(src) + s, n);
+	return Val_unit;
+}
+
+/* And from a buffer into a string */
+CAMLprim value snowflake_dma_blit_to_string(value src, value srcoff, value dst, value dstoff, value len) {
+	long d = Long_val(dstoff), n = Long_val(len);
+
+	if(n < 0 || d < 0 || d > (long)caml_string_length(dst) - n) {
+		caml_invalid_argument("Dma.blit_to_string");
+	}
+	memcpy(String_val(dst) + d, dma_at(src, srcoff, n), n);
+	return Val_unit;
+}
+
+CAMLprim value snowflake_dma_report(value unit) {
+	dma_report();
+	return Val_unit;
+}
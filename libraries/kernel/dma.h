@@ -0,0 +1,38 @@
+#ifndef DMA_HEADER
+#define DMA_HEADER
+
+#include <stddef.h>
+
+/* DMA buffers
+ *
+ * Memory for bus masters and the ISA DMA controller: physically contiguous,
+ * below 16MB, never crossing a 64KB boundary, and starting and ending on a
+ * cache line so no other data shares a line with a buffer a device writes.
+ * That is what the most limited devices need, so any buffer suits any
+ * device. RAM below 16MB is identity mapped, so a buffer's physical address
+ * is also its address.
+ *
+ * Buffers of up to a page come from slab caches (slab.h) of power of two
+ * sizes, whose slabs are no bigger than 64KB and aligned to their size, so
+ * nothing in them crosses a boundary. Bigger ones get frames of their own
+ * from pmm_alloc_contig. Frames are taken from 16MB down while the sbrk heap
+ * grows up towards them from the kernel, so keep buffers to what devices
+ * need. Safe from interrupt handlers. */
+
+#define DMA_LIMIT	0x1000000
+#define DMA_BOUNDARY	0x10000
+/* The largest buffer, a whole 64KB block */
+#define DMA_MAX_SIZE	DMA_BOUNDARY
+
+/* Sets up the caches, after pmm_init once malloc works */
+extern void dma_init();
+/* size bytes, up to DMA_MAX_SIZE, with the address devices use in *phys
+ * (unless phys is NULL). NULL if size is 0 or too big, or there is no such
+ * memory free. Not zeroed */
+extern void *dma_alloc(size_t size, unsigned long *phys);
+/* size as it was allocated */
+extern void dma_free(void *buf, size_t size);
+
+extern void dma_report();
+
+#endif
@@ -1,9 +1,11 @@
 
 #include "idt.h"
+#include "ioapic.h"
 
 #include <asm.h>
 #include <stdio.h>
 #include <signal.h>
+#include <threads.h>
 
 /* interrupts use interrupt gates */
 /* exceptions use trap gates */
@@ -27,8 +29,24 @@
 unsigned short signal_mask = 0xFFFF;
 
 void update_mask() {
+	static unsigned short ioapic_mask = 0xFFFF;
+	unsigned short changed;
+	int irq;
+	
 	//dprintf("updating signal mask: %4x\n", signal_mask);
 	
+	if (ioapic_enabled) {
+		/* Each line is a separate MMIO write, only touch the ones that
+		 * changed; the cascade bit means nothing to the IO APIC */
+		changed = (signal_mask ^ ioapic_mask) & ~(1 << 2);
+		for (irq = 0; irq < 16; irq++) {
+			if (changed & (1 << irq)) {
+				ioapic_set_masked(irq, signal_mask & (1 << irq));
+			}
+		}
+		ioapic_mask = signal_mask;
+		return;
+	}
 	out8(PICMI, signal_mask & 0xFF);
 	out8(PICSI, signal_mask >> 8);
 }
@@ -54,7 +72,8 @@ struct gate {
 static struct gate descriptors[256];
 	
 void set_vector(unsigned char vector, interrupt_handler handler, gate_type type) {
-	/* interrupt gate is 0x8E00, trap gate is 0x8E00 | 0x100 */
+	/* interrupt gate is 0x8E00, trap gate is 0x8E00 | 0x100,
+	 * task gate is 0x8500 with handler ignored and the TSS as selector */
 	struct address {
 		unsigned short offset_lo;
 		unsigned short offset_hi;
@@ -66,12 +85,57 @@ void set_vector(unsigned char vector, interrupt_handler handler, gate_type type)
 	
 	entry.handler = handler;
 	
+	if (type == task) {
+		descriptors[vector].offset_lo = 0;
+		descriptors[vector].selector = DOUBLE_FAULT_TSS;
+		descriptors[vector].flags = 0x8500;
+		descriptors[vector].offset_hi = 0;
+		return;
+	}
+	
 	descriptors[vector].offset_lo = entry.address.offset_lo;
 	descriptors[vector].selector = 0x08;
 	descriptors[vector].flags = type == interrupt ? 0x8E00 : 0x8F00;
 	descriptors[vector].offset_hi = entry.address.offset_hi;
 }
 
+/* Hardware task state. Only used so that a double fault gets a fresh stack
+ * through a task gate: a kernel stack overflow into a guard page can't take
+ * #PF on the stack that overflowed */
+struct tss {
+	unsigned short link, link_h;
+	unsigned long esp0;
+	unsigned short ss0, ss0_h;
+	unsigned long esp1;
+	unsigned short ss1, ss1_h;
+	unsigned long esp2;
+	unsigned short ss2, ss2_h;
+	unsigned long cr3, eip, eflags;
+	unsigned long eax, ecx, edx, ebx, esp, ebp, esi, edi;
+	unsigned short es, es_h, cs, cs_h, ss, ss_h, ds, ds_h, fs, fs_h, gs, gs_h;
+	unsigned short ldt, ldt_h, trap, iomap;
+} __attribute__ ((packed));
+
+extern unsigned long long gdt[];
+
+static struct tss kernel_tss;
+static struct tss double_fault_tss;
+static unsigned long double_fault_stack[1024];
+
+/* Paging changes the address space the double fault task has to run in */
+void tss_set_cr3(unsigned long cr3) {
+	double_fault_tss.cr3 = cr3;
+}
+
+static void set_tss_descriptor(unsigned short selector, struct tss *tss) {
+	unsigned long long base = (unsigned long)tss;
+	unsigned long long limit = sizeof(struct tss) - 1;
+	
+	/* present, DPL 0, 32-bit available TSS */
+	gdt[selector >> 3] = (limit & 0xFFFF) | ((base & 0xFFFFFF) << 16)
+		| (0x89ULL << 40) | (((limit >> 16) & 0xF) << 48) | ((base >> 24) << 56);
+}
+
 void set_irq(unsigned char irq, interrupt_handler handler) {
 	if (irq >= 8) {
 		set_vector(irq + SLAVE - 8, handler, interrupt);
@@ -122,7 +186,6 @@ MK_E(4, "Overflow error")
 MK_E(5, "Bounds check error")
 MK_E(6, "Invalid opcode")
 MK_E(7, "Coprocessor not available")
-MK_E(8, "Double fault")
 MK_E(9, "Coprocessor segment overflow")
 MK_E(10, "Invalid TSS")
 MK_E(11, "Segment not present")
@@ -140,27 +203,62 @@ void exception13(unsigned int eip, unsigned short cs, unsigned int eflags) {
 }
 void exception14(unsigned int eip, unsigned short cs, unsigned int eflags) {
 	unsigned int cr2;
+	thread_t thread;
 	asm volatile("mov %%cr2, %0" : "=r"(cr2));
 	dprintf("Page fault\r\n");
 	dprintf("EFLAGS: %08X\r\n", eflags);
 	dprintf("CS: %02X\r\n", cs);
 	dprintf("EIP: %08X\r\n", eip);
 	dprintf("CR2: %08X\r\n", cr2);
+	if ((thread = thread_find_guard(cr2)) != NULL) {
+		dprintf("Stack overflow in thread %u\r\n", thread->id);
+	}
 	stacktrace();
 	while (1) {
 		asm volatile("cli");
 		asm volatile("hlt");
 	}
 }
+/* Entered through a task gate on its own stack; the faulting context is in
+ * kernel_tss */
+static void double_fault() {
+	unsigned int cr2;
+	thread_t thread;
+	asm volatile("mov %%cr2, %0" : "=r"(cr2));
+	dprintf("Double fault\r\n");
+	dprintf("EFLAGS: %08X\r\n", kernel_tss.eflags);
+	dprintf("EIP: %08X\r\n", kernel_tss.eip);
+	dprintf("ESP: %08X\r\n", kernel_tss.esp);
+	dprintf("CR2: %08X\r\n", cr2);
+	if ((thread = thread_find_guard(cr2)) != NULL
+			|| (thread = thread_find_guard(kernel_tss.esp)) != NULL) {
+		dprintf("Stack overflow in thread %u\r\n", thread->id);
+	}
+	while (1) {
+		asm volatile("cli");
+		asm volatile("hlt");
+	}
+}
+
 MK_E(15, "Unknown exception")
 MK_E(16, "Coprocessor error")
 
+/* Acknowledge an IRQ at the local APIC if the IO APIC delivered it, else at
+ * the PIC, the slave as well for lines 8-15 */
+void irq_eoi(int irq) {
+	if (ioapic_enabled) {
+		lapic_eoi();
+		return;
+	}
+	if (irq > 7) {
+		out8(PICS, 0x20);
+	}
+	out8(PICM, 0x20);
+}
+
 void default_handler(int n) {
 	if (n < 16) {
-		out8(0x20, 0x20);
-		if (n > 7) {
-			out8(0x20, 0xA0);
-		}
+		irq_eoi(n);
 	}
 }
 
@@ -211,6 +309,9 @@ void set_signal_handler(int signum, struct sigaction *sa, struct sigaction *olds
 	#endif
 }
 
+/* #NM stub in irqs.S, hands off to the scheduler's lazy FPU switch */
+extern void fpu_trap();
+
 #define EI(n) extern irq##n();
 #define I(n) set_irq(n, (interrupt_handler)irq##n);
 
@@ -253,8 +354,8 @@ void idt_init() {
 	E(4);
 	E(5);
 	E(6);
-	E(7);
-	E(8);
+	set_vector(7, (interrupt_handler)fpu_trap, interrupt);
+	set_vector(8, NULL, task);
 	E(9);
 	E(10);
 	E(11);
@@ -293,6 +394,24 @@ void idt_init() {
 	
 	signal_mask = 0xFFFF;
 	
+	/* The CPU saves the faulting context into the current TSS on a task
+	 * switch, so one has to be loaded before the double fault gate works */
+	set_tss_descriptor(KERNEL_TSS, &kernel_tss);
+	double_fault_tss.eip = (unsigned long)double_fault;
+	double_fault_tss.esp = (unsigned long)(double_fault_stack + 1024);
+	double_fault_tss.cs = 0x08;
+	double_fault_tss.ds = double_fault_tss.es = double_fault_tss.ss = 0x10;
+	double_fault_tss.fs = double_fault_tss.gs = 0x10;
+	double_fault_tss.eflags = 0x2;
+	asm volatile("mov %%cr3, %0" : "=r"(double_fault_tss.cr3));
+	set_tss_descriptor(DOUBLE_FAULT_TSS, &double_fault_tss);
+	asm volatile("ltr %w0" :: "r"(KERNEL_TSS));
+	
+	idt_load();
+}
+
+/* Point this CPU at the IDT; application processors share the BSP's */
+void idt_load() {
 	struct {
 		unsigned short size  __attribute__ ((packed));
 		unsigned long offset __attribute__ ((packed));
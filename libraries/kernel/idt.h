@@ -15,9 +15,13 @@
 
 typedef void (*interrupt_handler)();
 
-typedef enum { interrupt, trap } gate_type;
+#define KERNEL_TSS			0x18
+#define DOUBLE_FAULT_TSS	0x20
+
+typedef enum { interrupt, trap, task } gate_type;
 
 extern void idt_init();
+extern void idt_load();
 
 extern void set_vector(unsigned char vector, interrupt_handler handler, gate_type type);
 
@@ -28,4 +32,10 @@ extern void unmask_irq(unsigned char irq);
 
 extern void update_mask();
 
+extern void irq_eoi(int irq);
+
+extern void tss_set_cr3(unsigned long cr3);
+
+extern void exception7();
+
 #endif
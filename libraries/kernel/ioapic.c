@@ -0,0 +1,357 @@
+#include "ioapic.h"
+#include "idt.h"
+#include "paging.h"
+
+#include <asm.h>
+#include <stdio.h>
+#include <string.h>
+
+/* IO APIC interrupt routing
+ *
+ * With an IO APIC, ISA IRQs are delivered to a chosen CPU's local APIC on
+ * the same vectors the 8259s used (MASTER + irq), so irqs.S and the
+ * signal_handlers table don't change; masking becomes an MMIO write to the
+ * line's redirection entry and EOI a write to the local APIC. idt.c's
+ * update_mask and irq_eoi pick the backend. If there is no IO APIC, or no
+ * table describing one, the 8259s stay as they are. */
+
+int ioapic_enabled = 0;
+
+struct ioapic {
+	volatile unsigned long *base;
+	unsigned int id;
+	unsigned int gsi_base;
+	unsigned int lines;
+};
+
+static struct ioapic ioapics[MAX_IOAPICS];
+static unsigned int ioapic_count = 0;
+
+/* Where each ISA IRQ comes in, and how, after any overrides */
+static unsigned int isa_gsi[16];
+static unsigned int isa_flags[16];
+static int isa_overridden = 0;
+
+/* Protects the redirection tables; IOREGSEL/IOWIN is a two step access */
+static spinlock_t ioapic_lock = SPINLOCK_INITIALIZER;
+
+#define IOAPIC_VER		0x01
+#define IOAPIC_REDTBL	0x10
+
+#define REDTBL_LEVEL		(1 << 15)
+#define REDTBL_ACTIVE_LOW	(1 << 13)
+#define REDTBL_MASKED		(1 << 16)
+
+static unsigned long ioapic_read(struct ioapic *io, unsigned int reg)
+{
+	io->base[0] = reg;
+	return io->base[4];
+}
+
+static void ioapic_write(struct ioapic *io, unsigned int reg, unsigned long value)
+{
+	io->base[0] = reg;
+	io->base[4] = value;
+}
+
+void ioapic_add(unsigned int id, unsigned long address, int gsi_base)
+{
+	struct ioapic *io;
+
+	if(ioapic_count == MAX_IOAPICS) {
+		dprintf("ioapic: ignoring IO APIC %d, MAX_IOAPICS reached\r\n", id);
+		return;
+	}
+	io = &ioapics[ioapic_count];
+	io->base = (volatile unsigned long *)address;
+	io->id = id;
+	io->lines = ((ioapic_read(io, IOAPIC_VER) >> 16) & 0xFF) + 1;
+	if(gsi_base < 0) {
+		gsi_base = ioapic_count ? ioapics[ioapic_count - 1].gsi_base + ioapics[ioapic_count - 1].lines : 0;
+	}
+	io->gsi_base = gsi_base;
+	ioapic_count++;
+}
+
+/* GSI of a pin, -1 if there's no such IO APIC */
+int ioapic_gsi(unsigned int id, unsigned int pin)
+{
+	unsigned int i;
+
+	for(i = 0; i < ioapic_count; i++) {
+		if(ioapics[i].id == id) {
+			return ioapics[i].gsi_base + pin;
+		}
+	}
+	return -1;
+}
+
+void ioapic_isa_override(unsigned int irq, unsigned int gsi, unsigned int inti_flags)
+{
+	unsigned int flags = 0;
+
+	if(irq >= 16) {
+		return;
+	}
+	if((inti_flags & 3) == 3) {
+		flags |= IRQ_ACTIVE_LOW;
+	}
+	if(((inti_flags >> 2) & 3) == 3) {
+		flags |= IRQ_LEVEL;
+	}
+	isa_gsi[irq] = gsi;
+	isa_flags[irq] = flags;
+	isa_overridden = 1;
+}
+
+/* IO APIC and pin for a GSI */
+static struct ioapic *gsi_lookup(unsigned int gsi, unsigned int *pin)
+{
+	unsigned int i;
+
+	for(i = 0; i < ioapic_count; i++) {
+		if(gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].lines) {
+			*pin = gsi - ioapics[i].gsi_base;
+			return &ioapics[i];
+		}
+	}
+	return NULL;
+}
+
+/* Program a redirection entry: fixed delivery, physical destination */
+static int ioapic_program(unsigned int gsi, unsigned char vector, cpu_t *cpu, unsigned int flags, int masked)
+{
+	struct ioapic *io;
+	unsigned int pin;
+	unsigned long lo = vector;
+
+	if((io = gsi_lookup(gsi, &pin)) == NULL) {
+		return -1;
+	}
+	if(flags & IRQ_LEVEL) {
+		lo |= REDTBL_LEVEL;
+	}
+	if(flags & IRQ_ACTIVE_LOW) {
+		lo |= REDTBL_ACTIVE_LOW;
+	}
+	if(masked) {
+		lo |= REDTBL_MASKED;
+	}
+
+	long istate = spin_lock_irqsave(&ioapic_lock);
+	/* Mask first so the line never fires half programmed */
+	ioapic_write(io, IOAPIC_REDTBL + pin * 2, REDTBL_MASKED);
+	ioapic_write(io, IOAPIC_REDTBL + pin * 2 + 1, (unsigned long)cpu->apic_id << 24);
+	ioapic_write(io, IOAPIC_REDTBL + pin * 2, lo);
+	spin_unlock_irqrestore(&ioapic_lock, istate);
+	return 0;
+}
+
+int ioapic_route_gsi(unsigned int gsi, unsigned char vector, cpu_t *cpu, unsigned int flags)
+{
+	return ioapic_program(gsi, vector, cpu, flags, 0);
+}
+
+void ioapic_set_masked(unsigned int irq, int masked)
+{
+	struct ioapic *io;
+	unsigned int pin;
+	unsigned long lo;
+
+	if(irq >= 16 || (io = gsi_lookup(isa_gsi[irq], &pin)) == NULL) {
+		return;
+	}
+	long istate = spin_lock_irqsave(&ioapic_lock);
+	lo = ioapic_read(io, IOAPIC_REDTBL + pin * 2);
+	if(masked) {
+		lo |= REDTBL_MASKED;
+	} else {
+		lo &= ~REDTBL_MASKED;
+	}
+	ioapic_write(io, IOAPIC_REDTBL + pin * 2, lo);
+	spin_unlock_irqrestore(&ioapic_lock, istate);
+}
+
+void ioapic_set_affinity(unsigned int irq, cpu_t *cpu)
+{
+	struct ioapic *io;
+	unsigned int pin;
+
+	if(irq >= 16 || (io = gsi_lookup(isa_gsi[irq], &pin)) == NULL) {
+		return;
+	}
+	long istate = spin_lock_irqsave(&ioapic_lock);
+	ioapic_write(io, IOAPIC_REDTBL + pin * 2 + 1, (unsigned long)cpu->apic_id << 24);
+	spin_unlock_irqrestore(&ioapic_lock, istate);
+}
+
+/* ACPI
+ *
+ * Only as much as it takes to read the MADT: the RSDP is found the way the
+ * MP floating pointer is, it points at the RSDT, which lists the tables. */
+
+struct acpi_rsdp {
+	char signature[8];
+	unsigned char checksum;
+	char oem[6];
+	unsigned char revision;
+	unsigned long rsdt;
+} __attribute__ ((packed));
+
+struct acpi_header {
+	char signature[4];
+	unsigned long length;
+	unsigned char revision;
+	unsigned char checksum;
+	char oem[6];
+	char oem_table[8];
+	unsigned long oem_revision;
+	unsigned long creator;
+	unsigned long creator_revision;
+} __attribute__ ((packed));
+
+struct acpi_madt {
+	struct acpi_header header;
+	unsigned long lapic;
+	unsigned long flags;
+} __attribute__ ((packed));
+
+#define MADT_IOAPIC		1
+#define MADT_OVERRIDE	2
+
+struct madt_ioapic {
+	unsigned char type;
+	unsigned char length;
+	unsigned char id;
+	unsigned char reserved;
+	unsigned long address;
+	unsigned long gsi_base;
+} __attribute__ ((packed));
+
+struct madt_override {
+	unsigned char type;
+	unsigned char length;
+	unsigned char bus;
+	unsigned char source;
+	unsigned long gsi;
+	unsigned short flags;
+} __attribute__ ((packed));
+
+static int acpi_checksum(void *p, unsigned int length)
+{
+	unsigned char *c = p, sum = 0;
+
+	while(length--) {
+		sum += *c++;
+	}
+	return sum == 0;
+}
+
+static struct acpi_rsdp *rsdp_scan(unsigned long base, unsigned long length)
+{
+	unsigned long p;
+
+	for(p = base; p < base + length; p += 16) {
+		if(memcmp((void *)p, "RSD PTR ", 8) == 0 && acpi_checksum((void *)p, 20)) {
+			return (struct acpi_rsdp *)p;
+		}
+	}
+	return NULL;
+}
+
+static struct acpi_madt *madt_find(void)
+{
+	struct acpi_rsdp *rsdp = NULL;
+	struct acpi_header *rsdt, *table;
+	unsigned long ebda = bios_ebda(), *entries;
+	unsigned int i, count;
+
+	if(ebda) {
+		rsdp = rsdp_scan(ebda, 1024);
+	}
+	if(rsdp == NULL) {
+		rsdp = rsdp_scan(0xE0000, 0x20000);
+	}
+	if(rsdp == NULL) {
+		return NULL;
+	}
+
+	rsdt = (struct acpi_header *)rsdp->rsdt;
+	if(memcmp(rsdt->signature, "RSDT", 4) != 0 || !acpi_checksum(rsdt, rsdt->length)) {
+		dprintf("ioapic: bad RSDT\r\n");
+		return NULL;
+	}
+	entries = (unsigned long *)(rsdt + 1);
+	count = (rsdt->length - sizeof(struct acpi_header)) / 4;
+	for(i = 0; i < count; i++) {
+		table = (struct acpi_header *)entries[i];
+		if(memcmp(table->signature, "APIC", 4) == 0 && acpi_checksum(table, table->length)) {
+			return (struct acpi_madt *)table;
+		}
+	}
+	return NULL;
+}
+
+/* Returns the number of IO APICs found */
+static int madt_parse(void)
+{
+	struct acpi_madt *madt = madt_find();
+	unsigned char *entry, *end;
+
+	if(madt == NULL) {
+		return 0;
+	}
+	entry = (unsigned char *)(madt + 1);
+	end = (unsigned char *)madt + madt->header.length;
+	while(entry < end && entry[1] != 0) {
+		if(entry[0] == MADT_IOAPIC) {
+			struct madt_ioapic *io = (struct madt_ioapic *)entry;
+			ioapic_add(io->id, io->address, io->gsi_base);
+		} else if(entry[0] == MADT_OVERRIDE) {
+			struct madt_override *o = (struct madt_override *)entry;
+			if(o->bus == 0) {
+				ioapic_isa_override(o->source, o->gsi, o->flags);
+			}
+		}
+		entry += entry[1];
+	}
+	return ioapic_count;
+}
+
+int ioapic_init()
+{
+	unsigned int irq;
+
+	for(irq = 0; irq < 16; irq++) {
+		/* Identity mapped, edge triggered, active high unless overridden */
+		isa_gsi[irq] = irq;
+		isa_flags[irq] = 0;
+	}
+	if(!lapic_init()) {
+		return 0;
+	}
+	if(madt_parse() == 0 && mp_parse_ioapics() == 0) {
+		return 0;
+	}
+	if(!isa_overridden && ioapic_count > 1) {
+		dprintf("ioapic: %d IO APICs and no ISA routing, assuming the first\r\n", ioapic_count);
+	}
+
+	/* Silence the 8259s, they stay programmed at MASTER/SLAVE so a
+	 * spurious IRQ7/15 still lands somewhere harmless */
+	out8(PICMI, 0xFF);
+	out8(PICSI, 0xFF);
+
+	for(irq = 0; irq < 16; irq++) {
+		if(irq == 2) {
+			/* The PIC cascade, never raised */
+			continue;
+		}
+		ioapic_program(isa_gsi[irq], MASTER + irq, &cpus[0], isa_flags[irq], 1);
+	}
+	ioapic_enabled = 1;
+	/* Bring the lines in step with signal_mask */
+	update_mask();
+	dprintf("ioapic: %d IO APICs, ISA IRQs routed to APIC %d\r\n", ioapic_count, cpus[0].apic_id);
+	return 1;
+}
@@ -0,0 +1,45 @@
+#ifndef IOAPIC_HEADER
+#define IOAPIC_HEADER
+
+#include "smp.h"
+
+/* Vector usage
+ *
+ *   0x00-0x1F  CPU exceptions
+ *   0x20-0x2F  ISA IRQs 0-15 (MASTER + irq), through the 8259s or IO APIC
+ *   0x30-0xEF  free for ioapic_route_gsi, e.g. PCI interrupts
+ *   0xF0-0xFF  IPIs and the local APIC spurious vector, see smp.h
+ *
+ * Handlers for vectors outside the ISA range are installed with set_vector
+ * and must lapic_eoi themselves. */
+#define GSI_VECTOR_BASE		0x30
+#define GSI_VECTOR_LIMIT	0xF0
+
+#define MAX_IOAPICS			8
+
+/* Polarity and trigger for ioapic_route_gsi, ISA default is neither */
+#define IRQ_ACTIVE_LOW		0x1
+#define IRQ_LEVEL			0x2
+
+/* Set once ISA IRQs are delivered through the IO APIC rather than the PICs */
+extern int ioapic_enabled;
+
+/* Find the IO APICs through the ACPI MADT, or failing that the MP tables,
+ * route ISA IRQs to the boot CPU and mask the 8259s. Returns 0, leaving the
+ * PICs in charge, if there is no local APIC or IO APIC */
+extern int ioapic_init();
+
+/* Table parsers report what they find here. gsi_base -1 means the one
+ * after the last IO APIC's lines; override flags are the MPS INTI flags
+ * both the MP table and the MADT use */
+extern void ioapic_add(unsigned int id, unsigned long address, int gsi_base);
+extern int ioapic_gsi(unsigned int id, unsigned int pin);
+extern void ioapic_isa_override(unsigned int irq, unsigned int gsi, unsigned int inti_flags);
+
+extern void ioapic_set_masked(unsigned int irq, int masked);
+/* Deliver ISA irq to cpu from now on */
+extern void ioapic_set_affinity(unsigned int irq, cpu_t *cpu);
+/* Route any global system interrupt to vector on cpu, unmasked */
+extern int ioapic_route_gsi(unsigned int gsi, unsigned char vector, cpu_t *cpu, unsigned int flags);
+
+#endif
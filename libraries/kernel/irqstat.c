@@ -0,0 +1,303 @@
+#include <asm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include "irqstat.h"
+#include "smp.h"
+#include "timer.h"
+
+volatile int irqstat_enabled = 0;
+
+/* ISA lines only: they are all delivered to one CPU at a time, and a line
+ * can't interrupt itself, so these need no lock */
+static irq_histogram_t irq_latency[16];
+static irq_histogram_t irq_handler[16];
+/* TSC at stub entry, for the handler time and for threaded latency */
+static unsigned long long irq_entered[16];
+static unsigned long long irq_raised[16];
+
+/* TSC cycles per PIT count, times 256, worked out once 64 ticks have gone
+ * by since irqstat_start; until then IRQ0 has no latency samples */
+#define PIT_CALIBRATE_TICKS 64
+static unsigned long pit_cycles;
+static unsigned long long start_tsc;
+static unsigned long long start_ticks;
+
+/* Interrupts-off section in progress on each CPU, begin 0 if none */
+static struct {
+	unsigned long long begin;
+	unsigned long site;
+} irqoff_cpu[MAX_CPUS];
+
+/* Open addressed on the call site; irqoff_other takes what doesn't fit */
+static irqoff_site_t irqoff_sites[IRQOFF_SITES];
+static irqoff_site_t irqoff_other;
+static spinlock_t irqoff_lock = SPINLOCK_INITIALIZER;
+
+static void hist_add(irq_histogram_t *hist, unsigned long long cycles)
+{
+	unsigned long hi = cycles >> 32, lo = cycles;
+	int bucket;
+
+	if(hi) {
+		bucket = 63 - __builtin_clz(hi);
+	} else if(lo) {
+		bucket = 31 - __builtin_clz(lo);
+	} else {
+		bucket = 0;
+	}
+	if(bucket >= IRQSTAT_BUCKETS) {
+		bucket = IRQSTAT_BUCKETS - 1;
+	}
+	hist->buckets[bucket]++;
+	hist->count++;
+	hist->total += cycles;
+	if(cycles > hist->max) {
+		hist->max = cycles;
+	}
+}
+
+void irqstat_start()
+{
+	unsigned int i;
+
+	long istate = interrupts_disable();
+	for(i = 0; i < MAX_CPUS; i++) {
+		irqoff_cpu[i].begin = 0;
+	}
+	memset(irq_entered, 0, sizeof(irq_entered));
+	memset(irq_raised, 0, sizeof(irq_raised));
+	pit_cycles = 0;
+	start_ticks = timer_ticks;
+	start_tsc = rdtsc();
+	irqstat_enabled = 1;
+	interrupts_restore(istate);
+}
+
+void irqstat_stop()
+{
+	irqstat_enabled = 0;
+}
+
+void irqstat_reset()
+{
+	long istate = spin_lock_irqsave(&irqoff_lock);
+	memset(irq_latency, 0, sizeof(irq_latency));
+	memset(irq_handler, 0, sizeof(irq_handler));
+	memset(irqoff_sites, 0, sizeof(irqoff_sites));
+	memset(&irqoff_other, 0, sizeof(irqoff_other));
+	spin_unlock_irqrestore(&irqoff_lock, istate);
+}
+
+/* IRQ hooks, interrupts disabled */
+
+void irqstat_irq_enter(int irq)
+{
+	unsigned long long now = rdtsc();
+	unsigned long counts;
+
+	/* IF was set for this interrupt to be taken, so whatever section this
+	 * CPU thought it was in was ended by a bare sti (sti; hlt in the idle
+	 * loops) and its time is not interrupts-off time */
+	irqoff_cpu[this_cpu()->index].begin = 0;
+
+	if(irq >= 16) {
+		/* An IPI, only there for the above */
+		return;
+	}
+	irq_entered[irq] = now;
+	irq_raised[irq] = now;
+	if(irq == 0) {
+		counts = timer_pit_elapsed();
+		if(pit_cycles == 0 && timer_hz != 0 && timer_ticks - start_ticks >= PIT_CALIBRATE_TICKS) {
+			pit_cycles = (now - start_tsc) * 256 * timer_hz / ((timer_ticks - start_ticks) * PIT_FREQUENCY);
+		}
+		if(counts != 0 && pit_cycles != 0) {
+			hist_add(&irq_latency[0], (unsigned long long)counts * pit_cycles / 256);
+		}
+	}
+}
+
+void irqstat_irq_exit(int irq)
+{
+	if(irq_entered[irq] != 0) {
+		hist_add(&irq_handler[irq], rdtsc() - irq_entered[irq]);
+		irq_entered[irq] = 0;
+	}
+}
+
+/* From the IRQ's thread, the line is still masked so nothing else touches
+ * its slots */
+void irqstat_handler_start(int irq)
+{
+	if(irq_raised[irq] != 0) {
+		hist_add(&irq_latency[irq], rdtsc() - irq_raised[irq]);
+		irq_raised[irq] = 0;
+	}
+}
+
+/* Interrupts-off sections */
+
+void irqoff_begin(void)
+{
+	unsigned int cpu = this_cpu()->index;
+
+	irqoff_cpu[cpu].site = (unsigned long)__builtin_return_address(0);
+	irqoff_cpu[cpu].begin = rdtsc();
+}
+
+static irqoff_site_t *irqoff_lookup(unsigned long site)
+{
+	unsigned int i, slot = (site >> 2) % IRQOFF_SITES;
+
+	for(i = 0; i < IRQOFF_SITES; i++) {
+		irqoff_site_t *s = &irqoff_sites[(slot + i) % IRQOFF_SITES];
+		if(s->site == site) {
+			return s;
+		}
+		if(s->site == 0) {
+			s->site = site;
+			return s;
+		}
+	}
+	return &irqoff_other;
+}
+
+void irqoff_end(void)
+{
+	unsigned long eflags;
+	unsigned long long cycles;
+	irqoff_site_t *site;
+	unsigned int cpu;
+
+	asm volatile("pushf;pop %0" : "=rm"(eflags));
+	if(eflags & 0x200) {
+		/* Already on, nothing ends here */
+		return;
+	}
+	cpu = this_cpu()->index;
+	if(irqoff_cpu[cpu].begin == 0) {
+		/* Off since an interrupt gate, or since before irqstat_start */
+		return;
+	}
+	cycles = rdtsc() - irqoff_cpu[cpu].begin;
+	irqoff_cpu[cpu].begin = 0;
+
+	spin_lock(&irqoff_lock);
+	site = irqoff_lookup(irqoff_cpu[cpu].site);
+	if(cycles > site->hist.max) {
+		site->max_end = (unsigned long)__builtin_return_address(0);
+	}
+	hist_add(&site->hist, cycles);
+	spin_unlock(&irqoff_lock);
+}
+
+/* Queries */
+
+int irqstat_get_latency(int irq, irq_histogram_t *hist)
+{
+	if(irq < 0 || irq >= 16) {
+		return -1;
+	}
+	long istate = interrupts_disable();
+	*hist = irq_latency[irq];
+	interrupts_restore(istate);
+	return 0;
+}
+
+int irqstat_get_handler(int irq, irq_histogram_t *hist)
+{
+	if(irq < 0 || irq >= 16) {
+		return -1;
+	}
+	long istate = interrupts_disable();
+	*hist = irq_handler[irq];
+	interrupts_restore(istate);
+	return 0;
+}
+
+int irqstat_get_irqoff(irqoff_site_t *buf, int max)
+{
+	int i, j, n = 0;
+	irqoff_site_t site;
+
+	long istate = spin_lock_irqsave(&irqoff_lock);
+	for(i = 0; i <= IRQOFF_SITES; i++) {
+		irqoff_site_t *s = i < IRQOFF_SITES ? &irqoff_sites[i] : &irqoff_other;
+		if(s->hist.count == 0) {
+			continue;
+		}
+		/* Insertion sort on total time, keeping the top max */
+		site = *s;
+		for(j = n < max ? n : max; j > 0 && buf[j - 1].hist.total < site.hist.total; j--) {
+			if(j < max) {
+				buf[j] = buf[j - 1];
+			}
+		}
+		if(j < max) {
+			buf[j] = site;
+		}
+		n++;
+	}
+	spin_unlock_irqrestore(&irqoff_lock, istate);
+	return n;
+}
+
+/* No 64-bit printf; anything past 4G cycles prints as 4G */
+static unsigned long cycles_ul(unsigned long long cycles)
+{
+	return cycles > 0xFFFFFFFFULL ? 0xFFFFFFFFUL : (unsigned long)cycles;
+}
+
+static void hist_print(irq_histogram_t *hist)
+{
+	int i;
+
+	for(i = 0; i < IRQSTAT_BUCKETS; i++) {
+		if(hist->buckets[i] != 0) {
+			dprintf("  %u-%u: %u\r\n", i ? 1UL << i : 0UL, i == IRQSTAT_BUCKETS - 1 ? 0xFFFFFFFFUL : (2UL << i) - 1, hist->buckets[i]);
+		}
+	}
+}
+
+#define REPORT_SITES 32
+
+void irqstat_report()
+{
+	irq_histogram_t hist;
+	irqoff_site_t *sites;
+	int irq, i, n;
+
+	for(irq = 0; irq < 16; irq++) {
+		irqstat_get_latency(irq, &hist);
+		if(hist.count != 0) {
+			dprintf("irq %d latency: %u samples, avg %u, max %u cycles\r\n", irq, hist.count,
+				cycles_ul(hist.total / hist.count), cycles_ul(hist.max));
+			hist_print(&hist);
+		}
+		irqstat_get_handler(irq, &hist);
+		if(hist.count != 0) {
+			dprintf("irq %d handler: %u samples, avg %u, max %u cycles\r\n", irq, hist.count,
+				cycles_ul(hist.total / hist.count), cycles_ul(hist.max));
+			hist_print(&hist);
+		}
+	}
+
+	sites = malloc(REPORT_SITES * sizeof(irqoff_site_t));
+	if(sites == NULL) {
+		dprintf("irqstat: no memory for the irqs off report\r\n");
+		return;
+	}
+	n = irqstat_get_irqoff(sites, REPORT_SITES);
+	for(i = 0; i < n && i < REPORT_SITES; i++) {
+		dprintf("irqs off at %x: %u samples, avg %u, max %u cycles, longest ended at %x\r\n",
+			sites[i].site, sites[i].hist.count, cycles_ul(sites[i].hist.total / sites[i].hist.count),
+			cycles_ul(sites[i].hist.max), sites[i].max_end);
+		hist_print(&sites[i].hist);
+	}
+	if(n > REPORT_SITES) {
+		dprintf("irqs off: %d more sites\r\n", n - REPORT_SITES);
+	}
+	free(sites);
+}
@@ -0,0 +1,63 @@
+#ifndef IRQSTAT_HEADER
+#define IRQSTAT_HEADER
+
+/* Interrupt latency and interrupt-disabled time
+ *
+ * While irqstat is on, log2 histograms of TSC cycles are kept for:
+ *
+ *   - IRQ latency, from the interrupt being raised to its handler starting.
+ *     For IRQ0 the raise is timed from the PIT count, so it shows how long
+ *     interrupts were off before the tick was taken; for threaded IRQs
+ *     (workqueue.h) it runs from the stub to the IRQ thread picking it up.
+ *     Other lines have no known raise time and get no latency samples.
+ *   - Handler time, from the IRQ stub calling signal_handlers[irq] to it
+ *     returning. IRQ0's runs on through timer_tick up to thread_tick.
+ *   - Time with interrupts disabled, per interrupts_disable call site, from
+ *     the disable to the interrupts_restore/interrupts_enable that ends it.
+ *     Interrupt handlers, which run with IF clear from the gate, are not
+ *     counted here; that time is the handler time above.
+ *
+ * Off by default; when off the cost is a load and a branch in the IRQ stubs
+ * and in interrupts_disable/interrupts_enable. */
+
+/* Bucket n counts samples of [2^n, 2^(n+1)) cycles, bucket 0 also 0 */
+#define IRQSTAT_BUCKETS		32
+
+/* Distinct interrupts_disable call sites tracked, the rest are lumped
+ * together under site 0 */
+#define IRQOFF_SITES		256
+
+typedef struct irq_histogram {
+	unsigned long count;
+	unsigned long long total;
+	unsigned long long max;
+	unsigned long buckets[IRQSTAT_BUCKETS];
+} irq_histogram_t;
+
+typedef struct irqoff_site {
+	/* Return address of the call in interrupts_disable's inlined copy */
+	unsigned long site;
+	/* Where the longest section was ended */
+	unsigned long max_end;
+	irq_histogram_t hist;
+} irqoff_site_t;
+
+extern void irqstat_start();
+extern void irqstat_stop();
+extern void irqstat_reset();
+extern void irqstat_report();
+
+/* Copies of the histograms for an ISA IRQ line, 0 on success */
+extern int irqstat_get_latency(int irq, irq_histogram_t *);
+extern int irqstat_get_handler(int irq, irq_histogram_t *);
+/* Fills in up to max sites, most total time first, and returns how many
+ * sites there are in all */
+extern int irqstat_get_irqoff(irqoff_site_t *, int max);
+
+/* Hooks, called while irqstat_enabled: irqs.S brackets the handlers, and
+ * threaded IRQs mark when their thread starts on the handler */
+extern void irqstat_irq_enter(int irq);
+extern void irqstat_irq_exit(int irq);
+extern void irqstat_handler_start(int irq);
+
+#endif
@@ -0,0 +1,139 @@
+#include <elf.h>
+#include <multiboot.h>
+#include <stdlib.h>
+#include <spinlock.h>
+#include "ksyms.h"
+
+/* multiboot_info_t flags: u.elf_sec is valid */
+#define MULTIBOOT_ELF_SHDR 0x20
+
+static Elf32_Sym *symtab = NULL;
+static unsigned long symtab_count = 0;
+static const char *strtab = NULL;
+
+/* Code symbols sorted by address, built by the first lookup */
+static Elf32_Sym **sorted = NULL;
+static unsigned long sorted_count = 0;
+static spinlock_t sorted_lock = SPINLOCK_INITIALIZER;
+
+static unsigned long max_end(unsigned long end, unsigned long addr, unsigned long size)
+{
+	return addr + size > end ? addr + size : end;
+}
+
+unsigned long ksyms_init(multiboot_info_t *multiboot, unsigned long end)
+{
+	Elf32_Shdr *shdrs, *sh;
+	unsigned long i;
+
+	if(multiboot == NULL || !(multiboot->flags & MULTIBOOT_ELF_SHDR)) {
+		return end;
+	}
+	shdrs = (Elf32_Shdr *)multiboot->u.elf_sec.addr;
+	end = max_end(end, multiboot->u.elf_sec.addr, multiboot->u.elf_sec.num * multiboot->u.elf_sec.size);
+	for(i = 0; i < multiboot->u.elf_sec.num; i++) {
+		sh = &shdrs[i];
+		if(sh->sh_type != SHT_SYMTAB || sh->sh_link >= multiboot->u.elf_sec.num) {
+			continue;
+		}
+		symtab = (Elf32_Sym *)sh->sh_addr;
+		symtab_count = sh->sh_size / sizeof(Elf32_Sym);
+		strtab = (const char *)shdrs[sh->sh_link].sh_addr;
+		end = max_end(end, sh->sh_addr, sh->sh_size);
+		end = max_end(end, shdrs[sh->sh_link].sh_addr, shdrs[sh->sh_link].sh_size);
+		break;
+	}
+	return end;
+}
+
+static int is_code(Elf32_Sym *sym)
+{
+	int type = ELF32_ST_TYPE(sym->st_info);
+
+	/* Labels in .S files are NOTYPE */
+	return (type == STT_FUNC || type == STT_NOTYPE) && sym->st_value != 0 &&
+		sym->st_shndx != SHN_UNDEF && sym->st_shndx < SHN_LORESERVE &&
+		strtab[sym->st_name] != '\0';
+}
+
+/* Shell sort, there's no qsort in libc */
+static void sort_symbols(Elf32_Sym **syms, unsigned long count)
+{
+	unsigned long gap, i, j;
+	Elf32_Sym *sym;
+
+	for(gap = 1; gap < count / 3; gap = gap * 3 + 1);
+	for(; gap > 0; gap /= 3) {
+		for(i = gap; i < count; i++) {
+			sym = syms[i];
+			for(j = i; j >= gap && syms[j - gap]->st_value > sym->st_value; j -= gap) {
+				syms[j] = syms[j - gap];
+			}
+			syms[j] = sym;
+		}
+	}
+}
+
+static int build_index(void)
+{
+	Elf32_Sym **syms;
+	unsigned long i, n = 0;
+
+	spin_lock(&sorted_lock);
+	if(sorted == NULL && symtab != NULL) {
+		for(i = 0; i < symtab_count; i++) {
+			n += is_code(&symtab[i]);
+		}
+		syms = malloc(n * sizeof(Elf32_Sym *));
+		if(syms == NULL) {
+			/* Lookups fail for now, the next one tries again */
+			spin_unlock(&sorted_lock);
+			return 0;
+		}
+		n = 0;
+		for(i = 0; i < symtab_count; i++) {
+			if(is_code(&symtab[i])) {
+				syms[n++] = &symtab[i];
+			}
+		}
+		sort_symbols(syms, n);
+		/* Lookups go lock free once sorted is set */
+		sorted_count = n;
+		asm volatile("" ::: "memory");
+		sorted = syms;
+	}
+	spin_unlock(&sorted_lock);
+	return sorted != NULL;
+}
+
+const char *ksym_lookup(unsigned long addr, unsigned long *offset)
+{
+	unsigned long lo = 0, hi, mid;
+	Elf32_Sym *sym;
+
+	if(sorted == NULL && !build_index()) {
+		return NULL;
+	}
+	/* Last symbol at or below addr */
+	hi = sorted_count;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(sorted[mid]->st_value <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if(lo == 0) {
+		return NULL;
+	}
+	sym = sorted[lo - 1];
+	/* Past the end of a sized function is padding or something unnamed */
+	if(sym->st_size != 0 && addr >= sym->st_value + sym->st_size) {
+		return NULL;
+	}
+	if(offset != NULL) {
+		*offset = addr - sym->st_value;
+	}
+	return strtab + sym->st_name;
+}
@@ -0,0 +1,20 @@
+#ifndef KSYMS_HEADER
+#define KSYMS_HEADER
+
+struct multiboot_info;
+
+/* Kernel symbol table
+ *
+ * A multiboot loader given an ELF kernel passes its section headers, with
+ * the symbol and string tables loaded somewhere after the image. ksyms_init
+ * notes where they are and returns the first address past everything it
+ * loaded, so the heap can start beyond it; end if there is nothing there.
+ * Without the tables, lookups fail and callers fall back to addresses. */
+extern unsigned long ksyms_init(struct multiboot_info *, unsigned long end);
+
+/* Name of the function containing addr and addr's offset into it, NULL if
+ * unknown. The first lookup sorts the table, so don't call it from an
+ * interrupt handler */
+extern const char *ksym_lookup(unsigned long addr, unsigned long *offset);
+
+#endif
@@ -0,0 +1,370 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <threads.h>
+#include <vmm.h>
+#include <mallocstat.h>
+#include "profile.h"
+#include "ksyms.h"
+#include "smp.h"
+
+volatile int mallocstat_enabled = 0;
+
+typedef struct owner {
+	/* Tag, or the address malloc was called from; 0 for the slot
+	 * everything past MALLOC_OWNERS is lumped into */
+	unsigned long key;
+	unsigned long live;
+	unsigned long peak;
+	unsigned long allocs;
+	unsigned long frees;
+} owner_t;
+
+/* A live block, in an open addressing table keyed by address */
+typedef struct block {
+	/* 0 if the slot is empty */
+	unsigned long mem;
+	unsigned long size;
+	unsigned short owner;
+	/* Index into samples plus one, 0 if its stack wasn't kept */
+	unsigned short sample;
+} block_t;
+
+typedef struct sample {
+	unsigned long mem;
+	unsigned long size;
+	unsigned long key;
+	unsigned long freed;
+	unsigned long depth;
+	/* Leaf first */
+	unsigned long pc[PROFILE_DEPTH];
+} sample_t;
+
+/* Slots the block table starts with, it doubles when half full */
+#define BLOCKS_INITIAL	8192
+
+static const char *tag_names[MALLOC_TAGS] = { "untagged" };
+static volatile unsigned long next_tag = 1;
+
+/* Taken inside malloc's lock by the hooks, so with interrupts off */
+static spinlock_t mallocstat_lock = SPINLOCK_INITIALIZER;
+static owner_t owners[MALLOC_OWNERS + 1];
+static block_t *blocks = NULL;
+static unsigned long block_slots = 0;
+static unsigned long block_count;
+static unsigned long blocks_dropped;
+static sample_t samples[MALLOC_SAMPLES];
+static unsigned long sample_count;
+static unsigned long samples_dropped;
+static size_t large_threshold;
+
+int malloc_tag_register(const char *name)
+{
+	unsigned long tag = atomic_fetch_add(&next_tag, 1);
+
+	if(tag >= MALLOC_TAGS) {
+		return 0;
+	}
+	tag_names[tag] = name;
+	return tag;
+}
+
+int malloc_tag_set(int tag)
+{
+	thread_t self = thread_self();
+	int old;
+
+	if(self == NULL) {
+		return 0;
+	}
+	old = self->malloc_tag;
+	self->malloc_tag = tag;
+	return old;
+}
+
+static inline unsigned long block_hash(unsigned long mem)
+{
+	return ((mem >> 3) * 2654435761UL) & (block_slots - 1);
+}
+
+static block_t *block_find(unsigned long mem)
+{
+	unsigned long h;
+
+	if(blocks == NULL) {
+		return NULL;
+	}
+	for(h = block_hash(mem); blocks[h].mem != 0; h = (h + 1) & (block_slots - 1)) {
+		if(blocks[h].mem == mem) {
+			return &blocks[h];
+		}
+	}
+	return NULL;
+}
+
+/* An empty slot for mem, which mustn't be in the table */
+static block_t *block_slot(unsigned long mem)
+{
+	unsigned long h;
+
+	for(h = block_hash(mem); blocks[h].mem != 0; h = (h + 1) & (block_slots - 1));
+	return &blocks[h];
+}
+
+/* Double the table, or make the first one. This is under malloc's lock, so
+ * the memory comes from the VMM */
+static int blocks_grow()
+{
+	unsigned long i, old_slots = block_slots;
+	unsigned long slots = block_slots ? block_slots * 2 : BLOCKS_INITIAL;
+	block_t *old = blocks, *table;
+
+	table = vmm_alloc(slots * sizeof(block_t), VMM_READ | VMM_WRITE);
+	if(table == NULL) {
+		return -1;
+	}
+	memset(table, 0, slots * sizeof(block_t));
+	blocks = table;
+	block_slots = slots;
+	for(i = 0; i < old_slots; i++) {
+		if(old[i].mem != 0) {
+			*block_slot(old[i].mem) = old[i];
+		}
+	}
+	if(old != NULL) {
+		vmm_free(old, old_slots * sizeof(block_t));
+	}
+	return 0;
+}
+
+/* Backward shift deletion, so lookups never need tombstones */
+static void block_remove(block_t *b)
+{
+	unsigned long i = b - blocks, j = i, home, mask = block_slots - 1;
+
+	for(;;) {
+		j = (j + 1) & mask;
+		if(blocks[j].mem == 0) {
+			break;
+		}
+		/* Entries whose home is cyclically in (i, j] stay put */
+		home = block_hash(blocks[j].mem);
+		if(i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+			continue;
+		}
+		blocks[i] = blocks[j];
+		i = j;
+	}
+	blocks[i].mem = 0;
+	block_count--;
+}
+
+static unsigned short owner_of(unsigned long key)
+{
+	unsigned long h = ((key * 2654435761UL) >> 16) % MALLOC_OWNERS, i;
+
+	for(i = 0; i < MALLOC_OWNERS; i++, h = (h + 1) % MALLOC_OWNERS) {
+		if(owners[h].key == key) {
+			return h;
+		}
+		if(owners[h].key == 0) {
+			owners[h].key = key;
+			return h;
+		}
+	}
+	return MALLOC_OWNERS;
+}
+
+void mallocstat_start(size_t large)
+{
+	long istate = spin_lock_irqsave(&mallocstat_lock);
+	if(blocks != NULL) {
+		memset(blocks, 0, block_slots * sizeof(block_t));
+	} else {
+		blocks_grow();
+	}
+	block_count = 0;
+	blocks_dropped = 0;
+	memset(owners, 0, sizeof(owners));
+	sample_count = 0;
+	samples_dropped = 0;
+	large_threshold = large;
+	mallocstat_enabled = 1;
+	spin_unlock_irqrestore(&mallocstat_lock, istate);
+}
+
+void mallocstat_stop()
+{
+	mallocstat_enabled = 0;
+}
+
+void mallocstat_alloc(void *mem, size_t size, unsigned long caller)
+{
+	real_thread_t *self = this_cpu()->running;
+	unsigned long key = self != NULL && self->malloc_tag != 0 ? self->malloc_tag : caller;
+	owner_t *owner;
+	sample_t *sample;
+	block_t *b;
+
+	spin_lock(&mallocstat_lock);
+	if(blocks == NULL || ((block_count + 1) * 2 > block_slots && blocks_grow() != 0 &&
+		(block_count + 1) * 4 > block_slots * 3)) {
+		blocks_dropped++;
+		spin_unlock(&mallocstat_lock);
+		return;
+	}
+	b = block_slot((unsigned long)mem);
+	b->mem = (unsigned long)mem;
+	b->size = size;
+	b->owner = owner_of(key);
+	b->sample = 0;
+	block_count++;
+
+	owner = &owners[b->owner];
+	owner->allocs++;
+	owner->live += size;
+	if(owner->live > owner->peak) {
+		owner->peak = owner->live;
+	}
+
+	if(large_threshold != 0 && size >= large_threshold) {
+		if(sample_count < MALLOC_SAMPLES) {
+			sample = &samples[sample_count++];
+			sample->mem = (unsigned long)mem;
+			sample->size = size;
+			sample->key = key;
+			sample->freed = 0;
+			sample->depth = profile_backtrace(sample->pc);
+			b->sample = sample_count;
+		} else {
+			samples_dropped++;
+		}
+	}
+	spin_unlock(&mallocstat_lock);
+}
+
+void mallocstat_free(void *mem)
+{
+	owner_t *owner;
+	block_t *b;
+
+	spin_lock(&mallocstat_lock);
+	b = block_find((unsigned long)mem);
+	if(b != NULL) {
+		owner = &owners[b->owner];
+		owner->live -= b->size;
+		owner->frees++;
+		if(b->sample != 0) {
+			samples[b->sample - 1].freed = 1;
+		}
+		block_remove(b);
+	}
+	spin_unlock(&mallocstat_lock);
+}
+
+static void print_owner(unsigned long key)
+{
+	unsigned long offset;
+	const char *name;
+
+	if(key == 0) {
+		dprintf("(other)");
+	} else if(key < MALLOC_TAGS) {
+		dprintf("[%s]", tag_names[key] != NULL ? tag_names[key] : "?");
+	} else if((name = ksym_lookup(key, &offset)) != NULL) {
+		dprintf("%s+0x%x", name, offset);
+	} else {
+		dprintf("0x%x", key);
+	}
+}
+
+/* Shell sort, most live bytes first, there's no qsort in libc */
+static void sort_owners(owner_t *o, unsigned long count)
+{
+	unsigned long gap, i, j;
+	owner_t x;
+
+	for(gap = 1; gap < count / 3; gap = gap * 3 + 1);
+	for(; gap > 0; gap /= 3) {
+		for(i = gap; i < count; i++) {
+			x = o[i];
+			for(j = i; j >= gap && o[j - gap].live < x.live; j -= gap) {
+				o[j] = o[j - gap];
+			}
+			o[j] = x;
+		}
+	}
+}
+
+void mallocstat_report()
+{
+	struct mallinfo mi = mallinfo();
+	unsigned long i, j, n, tracked, dropped, large, lost, live = 0;
+	owner_t *o;
+	sample_t *s;
+
+	/* Copies, since malloc can't be called under mallocstat_lock */
+	o = malloc(sizeof(owners));
+	s = malloc(sizeof(samples));
+	if(o == NULL || s == NULL) {
+		dprintf("mallocstat: no memory for the report\r\n");
+		free(o);
+		free(s);
+		return;
+	}
+	long istate = spin_lock_irqsave(&mallocstat_lock);
+	memcpy(o, owners, sizeof(owners));
+	memcpy(s, samples, sample_count * sizeof(sample_t));
+	large = sample_count;
+	lost = samples_dropped;
+	tracked = block_count;
+	dropped = blocks_dropped;
+	spin_unlock_irqrestore(&mallocstat_lock, istate);
+
+	/* Free space out of everything malloc holds, and how much of the free
+	 * space the largest chunk at the top of the heap is */
+	dprintf("mallocstat: arena %u KB, mmapped %u KB in %u regions, in use %u KB, "
+		"free %u KB in %u chunks (%u KB in fastbins), releasable %u KB\r\n",
+		mi.arena / 1024, mi.hblkhd / 1024, mi.hblks, mi.uordblks / 1024,
+		mi.fordblks / 1024, mi.ordblks, mi.fsmblks / 1024, mi.keepcost / 1024);
+	dprintf("mallocstat: fragmentation %u%% of the arena free, %u%% of free space not at the top\r\n",
+		mi.arena ? (unsigned long)((unsigned long long)mi.fordblks * 100 / mi.arena) : 0,
+		mi.fordblks ? (unsigned long)((unsigned long long)(mi.fordblks - mi.keepcost) * 100 / mi.fordblks) : 0);
+
+	n = 0;
+	for(i = 0; i <= MALLOC_OWNERS; i++) {
+		if(o[i].allocs != 0) {
+			live += o[i].live;
+			o[n++] = o[i];
+		}
+	}
+	sort_owners(o, n);
+	dprintf("mallocstat: %u blocks live, %u bytes, %u not tracked%s\r\n", tracked, live, dropped,
+		mallocstat_enabled ? "" : ", stopped");
+	for(i = 0; i < n; i++) {
+		dprintf("mallocstat: ");
+		print_owner(o[i].key);
+		dprintf(" live %u peak %u allocs %u frees %u\r\n",
+			o[i].live, o[i].peak, o[i].allocs, o[i].frees);
+	}
+
+	for(i = 0; i < large; i++) {
+		if(s[i].freed) {
+			continue;
+		}
+		dprintf("mallocstat: large block 0x%x, %u bytes, by ", s[i].mem, s[i].size);
+		print_owner(s[i].key);
+		dprintf("\r\n");
+		for(j = 0; j < s[i].depth; j++) {
+			dprintf("mallocstat:   ");
+			print_owner(s[i].pc[j]);
+			dprintf("\r\n");
+		}
+	}
+	if(lost != 0) {
+		dprintf("mallocstat: %u large blocks past the first %u have no stack\r\n", lost, MALLOC_SAMPLES);
+	}
+	free(o);
+	free(s);
+}
@@ -0,0 +1,14 @@
+#ifndef PAGING_HEADER
+#define PAGING_HEADER
+
+#define PAGE_SIZE 0x1000
+
+extern int paging_enabled;
+
+/* vmm.c: paging_init builds the identity mapping and turns paging on,
+ * paging_load turns it on for another CPU with the same page directory */
+extern void paging_init();
+extern void paging_load();
+extern void page_set_present(unsigned long addr, int present);
+
+#endif
@@ -0,0 +1,291 @@
+#include <multiboot.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include "pmm.h"
+
+/* multiboot_info_t flags */
+#define MULTIBOOT_MEM	0x01
+#define MULTIBOOT_MODS	0x08
+#define MULTIBOOT_MMAP	0x40
+
+#define MMAP_RAM	1
+
+#define PAGE_SHIFT	12
+/* Frames above 4GB aren't reachable without PAE */
+#define MAX_PFN		(1UL << (32 - PAGE_SHIFT))
+
+/* Where the kernel is linked, from the linker script */
+extern char _kernel_start[];
+
+static unsigned long *bitmap = NULL;
+static unsigned long max_pfn = 0;
+static unsigned long total_pages = 0;
+static unsigned long free_pages = 0;
+/* Taken with interrupts off, slab caches come here from interrupt handlers */
+static spinlock_t pmm_lock = SPINLOCK_INITIALIZER;
+
+static inline int frame_used(unsigned long pfn)
+{
+	return (bitmap[pfn / 32] >> (pfn % 32)) & 1;
+}
+
+static inline void set_used(unsigned long pfn)
+{
+	bitmap[pfn / 32] |= 1UL << (pfn % 32);
+}
+
+static inline void set_free(unsigned long pfn)
+{
+	bitmap[pfn / 32] &= ~(1UL << (pfn % 32));
+}
+
+static unsigned long round_up(unsigned long addr)
+{
+	return (addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+/* Whole frames of a 64 bit memory map region, clipped to what we can
+ * address */
+static void clip(memory_map_t *mmap, unsigned long *first, unsigned long *last)
+{
+	unsigned long long base = ((unsigned long long)mmap->base_addr_high << 32) | mmap->base_addr_low;
+	unsigned long long length = ((unsigned long long)mmap->length_high << 32) | mmap->length_low;
+	unsigned long long start = (base + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	unsigned long long end = (base + length) >> PAGE_SHIFT;
+
+	*first = start < MAX_PFN ? (unsigned long)start : MAX_PFN;
+	*last = end < MAX_PFN ? (unsigned long)end : MAX_PFN;
+	if(*last < *first) {
+		*last = *first;
+	}
+}
+
+#define for_each_mmap(mb, mmap) \
+	for(mmap = (memory_map_t *)(mb)->mmap_addr; \
+		(unsigned long)mmap < (mb)->mmap_addr + (mb)->mmap_length; \
+		mmap = (memory_map_t *)((unsigned long)mmap + mmap->size + sizeof(mmap->size)))
+
+/* Free frames [first, last) */
+static void release(unsigned long first, unsigned long last)
+{
+	unsigned long pfn;
+
+	for(pfn = first; pfn < last && pfn < max_pfn; pfn++) {
+		if(frame_used(pfn)) {
+			set_free(pfn);
+			free_pages++;
+			total_pages++;
+		}
+	}
+}
+
+/* Take every frame touching [start, end) */
+static void reserve(unsigned long start, unsigned long end)
+{
+	unsigned long pfn;
+
+	for(pfn = start >> PAGE_SHIFT; pfn < (round_up(end) >> PAGE_SHIFT) && pfn < max_pfn; pfn++) {
+		if(!frame_used(pfn)) {
+			set_used(pfn);
+			free_pages--;
+		}
+	}
+}
+
+unsigned long pmm_init(multiboot_info_t *multiboot, unsigned long end)
+{
+	memory_map_t *mmap;
+	module_t *mods;
+	unsigned long i, first, last, bitmap_size;
+
+	/* Highest frame of RAM */
+	if(multiboot != NULL && (multiboot->flags & MULTIBOOT_MMAP)) {
+		for_each_mmap(multiboot, mmap) {
+			clip(mmap, &first, &last);
+			if(mmap->type == MMAP_RAM && last > max_pfn) {
+				max_pfn = last;
+			}
+		}
+	} else if(multiboot != NULL && (multiboot->flags & MULTIBOOT_MEM)) {
+		/* mem_upper is KB from 1MB, up to the first hole */
+		max_pfn = (0x100000 + multiboot->mem_upper * 1024) >> PAGE_SHIFT;
+	} else {
+		dprintf("pmm: no memory map, assuming 16MB\r\n");
+		max_pfn = 0x1000000 >> PAGE_SHIFT;
+	}
+
+	/* Modules are loaded after the kernel, keep the bitmap clear of them */
+	if(multiboot != NULL && (multiboot->flags & MULTIBOOT_MODS)) {
+		mods = (module_t *)multiboot->mods_addr;
+		for(i = 0; i < multiboot->mods_count; i++) {
+			if(mods[i].mod_end > end) {
+				end = mods[i].mod_end;
+			}
+		}
+	}
+
+	/* Everything starts out used, then what's RAM is freed */
+	bitmap = (unsigned long *)round_up(end);
+	bitmap_size = (max_pfn + 31) / 32 * sizeof(unsigned long);
+	memset(bitmap, 0xFF, bitmap_size);
+	end = round_up((unsigned long)bitmap + bitmap_size);
+
+	if(multiboot != NULL && (multiboot->flags & MULTIBOOT_MMAP)) {
+		for_each_mmap(multiboot, mmap) {
+			if(mmap->type == MMAP_RAM) {
+				clip(mmap, &first, &last);
+				release(first, last);
+			}
+		}
+	} else {
+		release(0x100000 >> PAGE_SHIFT, max_pfn);
+	}
+
+	/* Real mode memory, BIOS data and the MP tables live below 1MB */
+	reserve(0, 0x100000);
+	/* The kernel, symbol tables, modules and the bitmap itself */
+	reserve((unsigned long)_kernel_start, end);
+	if(multiboot != NULL && (multiboot->flags & MULTIBOOT_MODS)) {
+		mods = (module_t *)multiboot->mods_addr;
+		for(i = 0; i < multiboot->mods_count; i++) {
+			reserve(mods[i].mod_start, mods[i].mod_end);
+		}
+	}
+	return end;
+}
+
+unsigned long pmm_alloc_contig(unsigned long count, unsigned long align,
+	unsigned long limit, unsigned long boundary)
+{
+	unsigned long top, s, pfn, mask, bmask;
+	long istate;
+
+	if(count == 0) {
+		return 0;
+	}
+	mask = align > PAGE_SIZE ? (align >> PAGE_SHIFT) - 1 : 0;
+	bmask = boundary ? (boundary >> PAGE_SHIFT) - 1 : 0;
+	if(boundary && count > bmask + 1) {
+		return 0;
+	}
+
+	istate = spin_lock_irqsave(&pmm_lock);
+	top = max_pfn;
+	if(limit && (limit >> PAGE_SHIFT) < top) {
+		top = limit >> PAGE_SHIFT;
+	}
+	if(top < count) {
+		goto fail;
+	}
+	/* Highest candidate first. Checking each candidate from its top frame
+	 * down means a used frame found moves the next candidate right below
+	 * it */
+	s = (top - count) & ~mask;
+	for(;;) {
+		if(boundary && (s & ~bmask) != ((s + count - 1) & ~bmask)) {
+			pfn = (s + count - 1) & ~bmask;
+		} else {
+			for(pfn = s + count; pfn > s && !frame_used(pfn - 1); pfn--);
+			if(pfn == s) {
+				break;
+			}
+			pfn--;
+		}
+		/* Next candidate ends below pfn */
+		if(pfn < count) {
+			goto fail;
+		}
+		s = (pfn - count) & ~mask;
+	}
+	for(pfn = s; pfn < s + count; pfn++) {
+		set_used(pfn);
+	}
+	free_pages -= count;
+	spin_unlock_irqrestore(&pmm_lock, istate);
+	return s << PAGE_SHIFT;
+
+fail:
+	spin_unlock_irqrestore(&pmm_lock, istate);
+	return 0;
+}
+
+unsigned long pmm_alloc(unsigned long count)
+{
+	return pmm_alloc_contig(count, PAGE_SIZE, 0, 0);
+}
+
+void pmm_free(unsigned long addr, unsigned long count)
+{
+	unsigned long pfn = addr >> PAGE_SHIFT;
+	long istate;
+
+	istate = spin_lock_irqsave(&pmm_lock);
+	for(; count > 0; count--, pfn++) {
+		if(pfn >= max_pfn || !frame_used(pfn)) {
+			dprintf("pmm: freeing free frame 0x%x\r\n", pfn << PAGE_SHIFT);
+			continue;
+		}
+		set_free(pfn);
+		free_pages++;
+	}
+	spin_unlock_irqrestore(&pmm_lock, istate);
+}
+
+int pmm_claim(unsigned long addr, unsigned long count)
+{
+	unsigned long pfn, first = addr >> PAGE_SHIFT;
+	long istate;
+
+	istate = spin_lock_irqsave(&pmm_lock);
+	if(first + count > max_pfn || first + count < first) {
+		spin_unlock_irqrestore(&pmm_lock, istate);
+		return -1;
+	}
+	for(pfn = first; pfn < first + count; pfn++) {
+		if(frame_used(pfn)) {
+			spin_unlock_irqrestore(&pmm_lock, istate);
+			return -1;
+		}
+	}
+	for(pfn = first; pfn < first + count; pfn++) {
+		set_used(pfn);
+	}
+	free_pages -= count;
+	spin_unlock_irqrestore(&pmm_lock, istate);
+	return 0;
+}
+
+unsigned long pmm_top_pfn()
+{
+	return max_pfn;
+}
+
+unsigned long pmm_total_pages()
+{
+	return total_pages;
+}
+
+unsigned long pmm_free_pages()
+{
+	return free_pages;
+}
+
+void pmm_report()
+{
+	unsigned long pfn, run = 0, longest = 0;
+	long istate;
+
+	istate = spin_lock_irqsave(&pmm_lock);
+	for(pfn = 0; pfn < max_pfn; pfn++) {
+		if(frame_used(pfn)) {
+			run = 0;
+		} else if(++run > longest) {
+			longest = run;
+		}
+	}
+	dprintf("pmm: %u KB RAM, %u KB free, largest free run %u KB, bitmap covers %u KB\r\n",
+		total_pages * (PAGE_SIZE / 1024), free_pages * (PAGE_SIZE / 1024),
+		longest * (PAGE_SIZE / 1024), max_pfn * (PAGE_SIZE / 1024));
+	spin_unlock_irqrestore(&pmm_lock, istate);
+}
@@ -0,0 +1,43 @@
+#ifndef PMM_HEADER
+#define PMM_HEADER
+
+#include "paging.h"
+
+struct multiboot_info;
+
+/* Physical memory manager
+ *
+ * One bit per 4KB page frame, set if the frame is in use or isn't RAM,
+ * seeded from the multiboot memory map. Allocations are searched for from
+ * the top of memory down, which leaves the low frames right above the
+ * kernel to the sbrk heap (which claims them in order as it grows) and to
+ * callers that need memory below a limit, such as ISA DMA. Everything
+ * below 1MB, the kernel image and whatever the loader put after it are
+ * reserved.
+ *
+ * Addresses are physical; 0 is never handed out, so it means failure. */
+
+/* Sets up the bitmap at end, the first free address past the kernel and
+ * what the loader left after it, and returns the first address past the
+ * bitmap */
+extern unsigned long pmm_init(struct multiboot_info *, unsigned long end);
+
+/* count contiguous frames anywhere */
+extern unsigned long pmm_alloc(unsigned long count);
+/* count contiguous frames starting on a multiple of align (a power of two,
+ * at least PAGE_SIZE), ending at or below limit (0 for no limit), and not
+ * crossing a multiple of boundary (0 for none) */
+extern unsigned long pmm_alloc_contig(unsigned long count, unsigned long align,
+	unsigned long limit, unsigned long boundary);
+extern void pmm_free(unsigned long addr, unsigned long count);
+/* Take these particular frames, 0 on success, -1 if any is already taken
+ * or isn't RAM */
+extern int pmm_claim(unsigned long addr, unsigned long count);
+
+/* One past the highest frame of RAM */
+extern unsigned long pmm_top_pfn();
+extern unsigned long pmm_total_pages();
+extern unsigned long pmm_free_pages();
+extern void pmm_report();
+
+#endif
@@ -0,0 +1,270 @@
+#include <caml/mlvalues.h>
+#include <caml/stack.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include "profile.h"
+#include "ksyms.h"
+#include "smp.h"
+
+volatile int profile_enabled = 0;
+
+typedef struct sample {
+	unsigned long thread;
+	unsigned long depth;
+	/* Leaf first */
+	unsigned long pc[PROFILE_DEPTH];
+} sample_t;
+
+static sample_t *samples = NULL;
+static volatile unsigned long sample_head;
+static volatile unsigned long samples_dropped;
+
+/* Kernel text, from the linker script */
+extern char _stext[], _etext[];
+/* The boot stack in stage1.S, which threads with no stack of their own are
+ * still on */
+extern char stack[], stack_top[];
+/* Stack above the stack pointer that's safe to read when its real bounds
+ * are unknown: an AP's boot stack is this big */
+#define STACK_WINDOW 16384
+
+/* How far above the stack pointer to look for an OCaml return address */
+#define PROFILE_SCAN 256
+
+void profile_start()
+{
+	if(samples == NULL) {
+		samples = malloc(PROFILE_SAMPLES * sizeof(sample_t));
+	}
+	sample_head = 0;
+	samples_dropped = 0;
+	profile_enabled = 1;
+}
+
+void profile_stop()
+{
+	profile_enabled = 0;
+}
+
+static int is_text(unsigned long addr)
+{
+	return addr >= (unsigned long)_stext && addr < (unsigned long)_etext;
+}
+
+/* caml_frame_descriptors lookup that gives up rather than loops when the
+ * address isn't there */
+static frame_descr *caml_frame(unsigned long retaddr)
+{
+	frame_descr *d;
+	uintnat h;
+
+	if(caml_frame_descriptors == NULL || !is_text(retaddr)) {
+		return NULL;
+	}
+	h = Hash_retaddr(retaddr);
+	while((d = caml_frame_descriptors[h]) != NULL) {
+		if(d->retaddr == retaddr) {
+			return d;
+		}
+		h = (h + 1) & caml_frame_descriptors_mask;
+	}
+	return NULL;
+}
+
+/* Walk OCaml frames from the return address at p, as caml_oldify_local_roots
+ * does from caml_bottom_of_stack */
+static int walk_caml(unsigned long *pc, int n, unsigned long p, unsigned long top)
+{
+	unsigned long retaddr = *(unsigned long *)p;
+	char *sp = (char *)p + 4;
+	struct caml_context *context;
+	frame_descr *d;
+
+	while(n < PROFILE_DEPTH && (d = caml_frame(retaddr)) != NULL) {
+		if(d->frame_size == 0xFFFF) {
+			/* An OCaml callback from C: carry on in the OCaml code that
+			 * called that C code */
+			context = Callback_link(sp);
+			if((unsigned long)(context + 1) > top) {
+				break;
+			}
+			sp = context->bottom_of_stack;
+			retaddr = context->last_retaddr;
+			if(sp == NULL || (unsigned long)sp > top) {
+				break;
+			}
+			continue;
+		}
+		pc[n++] = retaddr;
+		sp += d->frame_size & 0xFFFC;
+		if((unsigned long)sp > top) {
+			break;
+		}
+		retaddr = Saved_return_address(sp);
+	}
+	return n;
+}
+
+/* Stack from pc, with the stack pointer and frame pointer as they are
+ * there */
+static int walk(unsigned long *pc, unsigned long eip, unsigned long sp, unsigned long fp)
+{
+	real_thread_t *t = this_cpu()->running;
+	unsigned long top, p;
+	int n = 0;
+
+	if(t != NULL && t->stack != NULL) {
+		top = (unsigned long)t->stack + t->stack_size;
+	} else if(sp >= (unsigned long)stack && sp < (unsigned long)stack_top) {
+		top = (unsigned long)stack_top;
+	} else {
+		top = sp + STACK_WINDOW;
+	}
+
+	pc[n++] = eip;
+	/* Frame pointers, for as long as they point up the stack at code */
+	while(n < PROFILE_DEPTH && fp >= sp && fp + 8 <= top && !(fp & 3)) {
+		p = fp + 4;
+		if(caml_frame(*(unsigned long *)p) != NULL) {
+			return walk_caml(pc, n, p, top);
+		}
+		if(!is_text(*(unsigned long *)p)) {
+			break;
+		}
+		pc[n++] = *(unsigned long *)p;
+		sp = fp + 8;
+		fp = *(unsigned long *)fp;
+	}
+	/* Interrupted in, or lost in, code without frame pointers */
+	for(p = sp; p < sp + PROFILE_SCAN * 4 && p + 4 <= top; p += 4) {
+		if(caml_frame(*(unsigned long *)p) != NULL) {
+			return walk_caml(pc, n, p, top);
+		}
+	}
+	return n;
+}
+
+void profile_sample(irq_regs_t *regs)
+{
+	unsigned long slot = atomic_fetch_add(&sample_head, 1);
+	sample_t *sample;
+
+	if(samples == NULL || slot >= PROFILE_SAMPLES) {
+		atomic_fetch_add(&samples_dropped, 1);
+		return;
+	}
+	sample = &samples[slot];
+	sample->thread = this_cpu()->running ? this_cpu()->running->id : 0;
+	sample->depth = walk(sample->pc, regs->eip, (unsigned long)(regs + 1), regs->ebp);
+}
+
+int profile_backtrace(unsigned long *pc)
+{
+	unsigned long fp = (unsigned long)__builtin_frame_address(0);
+
+	/* From our return address, with the caller's stack and frame pointer */
+	return walk(pc, *(unsigned long *)(fp + 4), fp + 8, *(unsigned long *)fp);
+}
+
+static int sample_compare(sample_t *a, sample_t *b)
+{
+	unsigned long i, x, y;
+
+	if(a->thread != b->thread) {
+		return a->thread < b->thread ? -1 : 1;
+	}
+	/* Root first, so stacks sharing callers sort together */
+	for(i = 1; i <= a->depth && i <= b->depth; i++) {
+		x = a->pc[a->depth - i];
+		y = b->pc[b->depth - i];
+		if(x != y) {
+			return x < y ? -1 : 1;
+		}
+	}
+	if(a->depth != b->depth) {
+		return a->depth < b->depth ? -1 : 1;
+	}
+	return 0;
+}
+
+/* Shell sort on pointers, there's no qsort in libc */
+static void sort_samples(sample_t **s, unsigned long count)
+{
+	unsigned long gap, i, j;
+	sample_t *x;
+
+	for(gap = 1; gap < count / 3; gap = gap * 3 + 1);
+	for(; gap > 0; gap /= 3) {
+		for(i = gap; i < count; i++) {
+			x = s[i];
+			for(j = i; j >= gap && sample_compare(s[j - gap], x) > 0; j -= gap) {
+				s[j] = s[j - gap];
+			}
+			s[j] = x;
+		}
+	}
+}
+
+/* Function containing pc, or pc itself if it has no symbol. Return
+ * addresses are looked up one byte back, in case the call was the last
+ * instruction of its function */
+static unsigned long function_of(unsigned long pc, int retaddr)
+{
+	unsigned long offset;
+
+	if(ksym_lookup(pc - retaddr, &offset) == NULL) {
+		return pc;
+	}
+	return pc - retaddr - offset;
+}
+
+static void print_frame(unsigned long addr)
+{
+	const char *name = ksym_lookup(addr, NULL);
+
+	if(name != NULL) {
+		dprintf(";%s", name);
+	} else {
+		dprintf(";0x%x", addr);
+	}
+}
+
+void profile_dump()
+{
+	sample_t **sorted;
+	unsigned long i, j, n, count;
+
+	profile_stop();
+	n = sample_head < PROFILE_SAMPLES ? sample_head : PROFILE_SAMPLES;
+	if(samples == NULL || n == 0) {
+		dprintf("profile: no samples\r\n");
+		return;
+	}
+
+	/* Down to functions, so samples anywhere in one are the same frame */
+	sorted = malloc(n * sizeof(sample_t *));
+	for(i = 0; i < n; i++) {
+		for(j = 0; j < samples[i].depth; j++) {
+			samples[i].pc[j] = function_of(samples[i].pc[j], j > 0);
+		}
+		sorted[i] = &samples[i];
+	}
+	sort_samples(sorted, n);
+
+	dprintf("profile-begin %u samples, %u dropped\r\n", n, samples_dropped);
+	for(i = 0; i < n; i += count) {
+		for(count = 1; i + count < n && sample_compare(sorted[i], sorted[i + count]) == 0; count++);
+		dprintf("thread %u", sorted[i]->thread);
+		for(j = sorted[i]->depth; j > 0; j--) {
+			print_frame(sorted[i]->pc[j - 1]);
+		}
+		dprintf(" %u\r\n", count);
+	}
+	dprintf("profile-end\r\n");
+	free(sorted);
+	/* The samples have been rewritten, don't dump them twice */
+	sample_head = 0;
+}
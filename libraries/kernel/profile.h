@@ -0,0 +1,46 @@
+#ifndef PROFILE_HEADER
+#define PROFILE_HEADER
+
+/* Sampling profiler
+ *
+ * While profiling is on, every timer tick (IRQ0 on the boot CPU, the tick
+ * IPI on the others) records the interrupted thread and call stack. Only
+ * the PIT is involved, so it works the same under emulators without
+ * performance counters. With the tick stopped for tickless idle an idle
+ * CPU takes no samples.
+ *
+ * Stacks are unwound through C frames by the frame pointer chain while it
+ * looks sound, and through OCaml frames with the frametable, the way the
+ * GC finds its roots. OCaml code keeps no frame pointer, so from an
+ * interrupted OCaml function the walk starts at the nearest return address
+ * above the stack pointer that has a frame descriptor.
+ *
+ * profile_dump prints the samples as folded stacks, root first and named
+ * from the kernel's symbol table (ksyms.h), between "profile-begin" and
+ * "profile-end" lines; the lines in between go straight into
+ * flamegraph.pl. */
+
+/* Samples kept, later ones are counted as dropped */
+#define PROFILE_SAMPLES		4096
+#define PROFILE_DEPTH		32
+
+/* Registers as pushed by pusha in the IRQ stubs, then the interrupt frame */
+typedef struct irq_regs {
+	unsigned long edi, esi, ebp, esp, ebx, edx, ecx, eax;
+	unsigned long eip, cs, eflags;
+} irq_regs_t;
+
+extern volatile int profile_enabled;
+
+extern void profile_start();
+extern void profile_stop();
+extern void profile_dump();
+
+/* Called from the tick stubs with interrupts disabled */
+extern void profile_sample(irq_regs_t *);
+
+/* The caller's own stack, unwound the same way into pc[PROFILE_DEPTH], leaf
+ * first. Returns the depth. Call with interrupts disabled */
+extern int profile_backtrace(unsigned long *pc);
+
+#endif
@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include "slab.h"
+#include "pmm.h"
+
+/* 4MB, and the fewest objects a slab that size has to hold */
+#define SLAB_MAX_PAGES	1024
+#define SLAB_MIN_OBJECTS	8
+
+typedef struct slab {
+	link_t link;
+	slab_cache_t *cache;
+	/* First free object, which holds the next */
+	void *free;
+	unsigned long in_use;
+} slab_t;
+
+static LIST_INITIALIZE(all_caches);
+static spinlock_t caches_lock = SPINLOCK_INITIALIZER;
+
+static inline unsigned long align_up(unsigned long n, unsigned long align)
+{
+	return (n + align - 1) & ~(align - 1);
+}
+
+static inline unsigned long slab_bytes(slab_cache_t *cache)
+{
+	return cache->stats.slab_pages * PAGE_SIZE;
+}
+
+/* Slabs are aligned to their size, so the header is below any object */
+static inline slab_t *slab_of(slab_cache_t *cache, void *obj)
+{
+	return (slab_t *)((unsigned long)obj & ~(slab_bytes(cache) - 1));
+}
+
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align)
+{
+	return slab_cache_create_ex(name, size, align, 0);
+}
+
+slab_cache_t *slab_cache_create_ex(const char *name, size_t size, size_t align,
+	unsigned long limit)
+{
+	slab_cache_t *cache;
+	unsigned long pages = 1, first;
+
+	if(align == 0) {
+		align = SLAB_CACHE_LINE;
+	}
+	if(align & (align - 1)) {
+		return NULL;
+	}
+	/* Free objects hold the free list link */
+	if(size < sizeof(void *)) {
+		size = sizeof(void *);
+	}
+	size = align_up(size, align);
+	first = align_up(sizeof(slab_t), align);
+	while(pages < SLAB_MAX_PAGES && (first > pages * PAGE_SIZE ||
+		(pages * PAGE_SIZE - first) / size < SLAB_MIN_OBJECTS)) {
+		pages *= 2;
+	}
+	if(first > pages * PAGE_SIZE || (pages * PAGE_SIZE - first) / size < SLAB_MIN_OBJECTS) {
+		return NULL;
+	}
+
+	cache = malloc(sizeof(slab_cache_t));
+	if(cache == NULL) {
+		return NULL;
+	}
+	cache->name = name;
+	link_initialize(&cache->link);
+	spin_init(&cache->lock);
+	cache->align = align;
+	cache->limit = limit;
+	cache->first = first;
+	list_initialize(&cache->partial);
+	list_initialize(&cache->full);
+	cache->spare = NULL;
+	memset(&cache->stats, 0, sizeof(slab_stats_t));
+	cache->stats.size = size;
+	cache->stats.per_slab = (pages * PAGE_SIZE - first) / size;
+	cache->stats.slab_pages = pages;
+
+	long istate = spin_lock_irqsave(&caches_lock);
+	list_append(&cache->link, &all_caches);
+	spin_unlock_irqrestore(&caches_lock, istate);
+	return cache;
+}
+
+/* A new slab with every object chained in address order, with the cache's
+ * lock held */
+static slab_t *slab_grow(slab_cache_t *cache)
+{
+	slab_t *slab;
+	char *obj;
+	unsigned long i;
+
+	slab = (slab_t *)pmm_alloc_contig(cache->stats.slab_pages, slab_bytes(cache), cache->limit, 0);
+	if(slab == NULL) {
+		return NULL;
+	}
+	link_initialize(&slab->link);
+	slab->cache = cache;
+	slab->in_use = 0;
+	obj = (char *)slab + cache->first;
+	slab->free = obj;
+	for(i = 1; i < cache->stats.per_slab; i++, obj += cache->stats.size) {
+		*(void **)obj = obj + cache->stats.size;
+	}
+	*(void **)obj = NULL;
+	cache->stats.slabs++;
+	cache->stats.grows++;
+	return slab;
+}
+
+static void slab_shrink(slab_cache_t *cache, slab_t *slab)
+{
+	pmm_free((unsigned long)slab, cache->stats.slab_pages);
+	cache->stats.slabs--;
+	cache->stats.shrinks++;
+}
+
+void slab_cache_destroy(slab_cache_t *cache)
+{
+	long istate = spin_lock_irqsave(&cache->lock);
+	if(cache->stats.in_use != 0) {
+		spin_unlock_irqrestore(&cache->lock, istate);
+		dprintf("slab: destroying %s with %u objects in use\r\n", cache->name, cache->stats.in_use);
+		return;
+	}
+	/* Nothing in use means the spare is the only slab left */
+	if(cache->spare != NULL) {
+		slab_shrink(cache, cache->spare);
+	}
+	spin_unlock_irqrestore(&cache->lock, istate);
+
+	istate = spin_lock_irqsave(&caches_lock);
+	list_remove(&cache->link);
+	spin_unlock_irqrestore(&caches_lock, istate);
+	free(cache);
+}
+
+void *slab_alloc(slab_cache_t *cache)
+{
+	slab_t *slab;
+	void *obj;
+
+	long istate = spin_lock_irqsave(&cache->lock);
+	if(!list_empty(&cache->partial)) {
+		slab = list_get_instance(cache->partial.next, slab_t, link);
+	} else {
+		if(cache->spare != NULL) {
+			slab = cache->spare;
+			cache->spare = NULL;
+		} else if((slab = slab_grow(cache)) == NULL) {
+			spin_unlock_irqrestore(&cache->lock, istate);
+			return NULL;
+		}
+		list_prepend(&slab->link, &cache->partial);
+	}
+
+	obj = slab->free;
+	slab->free = *(void **)obj;
+	slab->in_use++;
+	if(slab->free == NULL) {
+		list_remove(&slab->link);
+		list_append(&slab->link, &cache->full);
+	}
+
+	cache->stats.allocs++;
+	if(++cache->stats.in_use > cache->stats.peak) {
+		cache->stats.peak = cache->stats.in_use;
+	}
+	spin_unlock_irqrestore(&cache->lock, istate);
+	return obj;
+}
+
+void slab_free(slab_cache_t *cache, void *obj)
+{
+	slab_t *slab;
+
+	if(obj == NULL) {
+		return;
+	}
+	slab = slab_of(cache, obj);
+	if(slab->cache != cache) {
+		dprintf("slab: freeing 0x%x to %s, which it isn't from\r\n", obj, cache->name);
+		return;
+	}
+
+	long istate = spin_lock_irqsave(&cache->lock);
+	if(slab->free == NULL) {
+		/* Was full, and is now where the next allocation comes from */
+		list_remove(&slab->link);
+		list_prepend(&slab->link, &cache->partial);
+	}
+	*(void **)obj = slab->free;
+	slab->free = obj;
+	slab->in_use--;
+	cache->stats.in_use--;
+	cache->stats.frees++;
+
+	if(slab->in_use == 0) {
+		list_remove(&slab->link);
+		if(cache->spare == NULL) {
+			cache->spare = slab;
+		} else {
+			slab_shrink(cache, slab);
+		}
+	}
+	spin_unlock_irqrestore(&cache->lock, istate);
+}
+
+void slab_cache_stats(slab_cache_t *cache, slab_stats_t *stats)
+{
+	long istate = spin_lock_irqsave(&cache->lock);
+	*stats = cache->stats;
+	spin_unlock_irqrestore(&cache->lock, istate);
+}
+
+void slab_report()
+{
+	link_t *cur;
+	slab_cache_t *cache;
+	slab_stats_t stats;
+
+	long istate = spin_lock_irqsave(&caches_lock);
+	for(cur = all_caches.next; cur != &all_caches; cur = cur->next) {
+		cache = list_get_instance(cur, slab_cache_t, link);
+		slab_cache_stats(cache, &stats);
+		dprintf("slab: %s: %u byte objects, %u per %u KB slab, %u slabs, %u in use (peak %u), "
+			"%u allocs, %u frees, %u grows, %u shrinks\r\n",
+			cache->name, stats.size, stats.per_slab, stats.slab_pages * (PAGE_SIZE / 1024),
+			stats.slabs, stats.in_use, stats.peak, stats.allocs, stats.frees,
+			stats.grows, stats.shrinks);
+	}
+	spin_unlock_irqrestore(&caches_lock, istate);
+}
@@ -0,0 +1,73 @@
+#ifndef SLAB_HEADER
+#define SLAB_HEADER
+
+#include <stddef.h>
+#include <list.h>
+#include <spinlock.h>
+
+/* Object caches
+ *
+ * A cache hands out objects of one size from slabs: runs of pages straight
+ * from pmm.c, aligned to their own size, with a small header at the front
+ * and the objects packed behind it. Each object is aligned to the cache's
+ * alignment, a cache line unless asked otherwise, so neighbours never share
+ * a line. Free objects are chained through their first word.
+ *
+ * Allocation takes from a partly used slab and free finds an object's slab
+ * by masking its address, so both are constant time unless a slab has to
+ * come from or go back to the page allocator. One empty slab per cache is
+ * kept back so that alloc/free cycles at a slab boundary don't do that
+ * every time. Safe from interrupt handlers. */
+
+#define SLAB_CACHE_LINE	64
+
+typedef struct slab_stats {
+	/* Object size once aligned, objects per slab, pages per slab */
+	size_t size;
+	unsigned long per_slab;
+	unsigned long slab_pages;
+	unsigned long slabs;
+	unsigned long in_use;
+	unsigned long peak;
+	unsigned long allocs;
+	unsigned long frees;
+	/* Slabs taken from and given back to the page allocator */
+	unsigned long grows;
+	unsigned long shrinks;
+} slab_stats_t;
+
+typedef struct slab_cache {
+	const char *name;
+	link_t link;
+	spinlock_t lock;
+	size_t align;
+	/* Slabs end at or below this physical address, 0 for anywhere */
+	unsigned long limit;
+	/* Offset of the first object from the slab's start */
+	unsigned long first;
+	/* Slabs with free objects, full ones, and the spare empty one */
+	link_t partial;
+	link_t full;
+	struct slab *spare;
+	slab_stats_t stats;
+} slab_cache_t;
+
+/* size byte objects aligned to align (a power of two, 0 for a cache line).
+ * NULL if the descriptor can't be allocated or an object wouldn't fit
+ * eight to a 4MB slab, malloc is better for those */
+extern slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align);
+/* Same, with slabs from RAM below limit (0 for anywhere), for devices that
+ * can't reach all of it */
+extern slab_cache_t *slab_cache_create_ex(const char *name, size_t size, size_t align,
+	unsigned long limit);
+/* Every object must have been freed */
+extern void slab_cache_destroy(slab_cache_t *);
+/* NULL if out of memory. Not zeroed */
+extern void *slab_alloc(slab_cache_t *);
+extern void slab_free(slab_cache_t *, void *);
+
+extern void slab_cache_stats(slab_cache_t *, slab_stats_t *);
+/* Stats of every cache over serial */
+extern void slab_report();
+
+#endif
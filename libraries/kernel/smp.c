@@ -0,0 +1,489 @@
+#include "smp.h"
+#include "idt.h"
+#include "ioapic.h"
+#include "paging.h"
+
+#include <asm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Application processor bring-up
+ *
+ * CPUs are found through the Intel MultiProcessor tables, then each AP is
+ * sent INIT-SIPI-SIPI with the vector pointing at a copy of ap_trampoline
+ * (ap_boot.S) in low memory. The trampoline switches to protected mode with
+ * the BSP's GDT and calls smp_ap_main on a freshly allocated stack, which
+ * becomes that CPU's idle thread. */
+
+cpu_t cpus[MAX_CPUS];
+unsigned int cpu_count = 1;
+unsigned char apic_to_cpu[256];
+volatile unsigned long *lapic_base = NULL;
+
+extern void ipi_resched(), ipi_tick(), spurious_irq();
+
+extern char ap_trampoline[], ap_trampoline_end[];
+extern char ap_boot_gdt[], ap_boot_stack[], ap_boot_entry[];
+
+/* Stack each AP starts on, and keeps as its idle thread's stack */
+#define AP_STACK_SIZE 16384
+
+/* Whoever bumps this first, the AP starting up or smp_boot_ap giving up on
+ * it, decides whether it joins. Reset before each AP is started */
+static volatile unsigned long ap_claim;
+
+struct mp_float {
+	char signature[4];
+	unsigned long config;
+	unsigned char length;
+	unsigned char revision;
+	unsigned char checksum;
+	unsigned char features[5];
+} __attribute__ ((packed));
+
+struct mp_config {
+	char signature[4];
+	unsigned short length;
+	unsigned char revision;
+	unsigned char checksum;
+	char oem[8];
+	char product[12];
+	unsigned long oem_table;
+	unsigned short oem_table_size;
+	unsigned short entries;
+	unsigned long lapic;
+	unsigned short ext_length;
+	unsigned char ext_checksum;
+	unsigned char reserved;
+} __attribute__ ((packed));
+
+struct mp_processor {
+	unsigned char type;
+	unsigned char apic_id;
+	unsigned char apic_version;
+	unsigned char flags;
+	unsigned long signature;
+	unsigned long features;
+	unsigned long reserved[2];
+} __attribute__ ((packed));
+
+struct mp_bus {
+	unsigned char type;
+	unsigned char id;
+	char name[6];
+} __attribute__ ((packed));
+
+struct mp_ioapic {
+	unsigned char type;
+	unsigned char id;
+	unsigned char version;
+	unsigned char flags;
+	unsigned long address;
+} __attribute__ ((packed));
+
+struct mp_interrupt {
+	unsigned char type;
+	unsigned char int_type;
+	unsigned short flags;
+	unsigned char src_bus;
+	unsigned char src_irq;
+	unsigned char dst_ioapic;
+	unsigned char dst_pin;
+} __attribute__ ((packed));
+
+#define MP_PROCESSOR		0
+#define MP_BUS				1
+#define MP_IOAPIC			2
+#define MP_INTERRUPT		3
+#define MP_PROCESSOR_ENABLED	1
+#define MP_IOAPIC_ENABLED	1
+#define MP_INT_VECTORED		0
+/* features[1]: the PICs are behind the IMCR, which has to be switched over */
+#define MP_IMCR				0x80
+
+/* The only delay we have before the PIT is set up: port 0x80 writes take
+ * about a microsecond on real hardware (and nothing under an emulator,
+ * which doesn't need the delay anyway) */
+static void udelay(unsigned int us)
+{
+	while(us--) {
+		out8(0x80, 0);
+	}
+}
+
+static int checksum(unsigned char *p, unsigned int length)
+{
+	unsigned char sum = 0;
+	
+	while(length--) {
+		sum += *p++;
+	}
+	return sum == 0;
+}
+
+static struct mp_float *mp_scan(unsigned long base, unsigned long length)
+{
+	unsigned long p;
+	
+	for(p = base; p < base + length; p += 16) {
+		if(memcmp((void *)p, "_MP_", 4) == 0 && checksum((unsigned char *)p, 16)) {
+			return (struct mp_float *)p;
+		}
+	}
+	return NULL;
+}
+
+unsigned long bios_ebda(void)
+{
+	static int known = 0;
+	static unsigned long ebda = 0;
+	volatile unsigned short *segment;
+	
+	if(!known && !paging_enabled) {
+		/* Through a register, or gcc sees a constant pointer to no object
+		 * and warns about the access */
+		asm("" : "=r"(segment) : "0"(0x40E));
+		ebda = (unsigned long)*segment << 4;
+		known = 1;
+	}
+	return ebda;
+}
+
+static struct mp_float *mp_find(void)
+{
+	struct mp_float *mp = NULL;
+	unsigned long ebda = bios_ebda();
+	
+	if(ebda) {
+		mp = mp_scan(ebda, 1024);
+	}
+	if(mp == NULL) {
+		mp = mp_scan(0x9FC00, 1024);
+	}
+	if(mp == NULL) {
+		mp = mp_scan(0xF0000, 0x10000);
+	}
+	return mp;
+}
+
+static void add_cpu(unsigned char apic_id)
+{
+	cpu_t *cpu;
+	
+	if(cpu_count == MAX_CPUS) {
+		dprintf("smp: ignoring CPU %d, MAX_CPUS reached\r\n", apic_id);
+		return;
+	}
+	cpu = &cpus[cpu_count];
+	cpu->index = cpu_count++;
+	cpu->apic_id = apic_id;
+	apic_to_cpu[apic_id] = cpu->index;
+}
+
+/* Fill in cpus[1..] from the MP configuration table, returns the number of
+ * APs found */
+static int mp_parse(void)
+{
+	struct mp_float *mp = mp_find();
+	struct mp_config *config;
+	unsigned char *entry;
+	int i;
+	
+	if(mp == NULL) {
+		return 0;
+	}
+	if(mp->features[0] != 0) {
+		/* One of the default configurations: two CPUs, APIC IDs 0 and 1 */
+		add_cpu(cpus[0].apic_id == 0 ? 1 : 0);
+		return cpu_count - 1;
+	}
+	
+	config = (struct mp_config *)mp->config;
+	if(memcmp(config->signature, "PCMP", 4) != 0 || !checksum((unsigned char *)config, config->length)) {
+		dprintf("smp: bad MP configuration table\r\n");
+		return 0;
+	}
+	
+	entry = (unsigned char *)(config + 1);
+	for(i = 0; i < config->entries; i++) {
+		if(*entry == MP_PROCESSOR) {
+			struct mp_processor *cpu = (struct mp_processor *)entry;
+			if((cpu->flags & MP_PROCESSOR_ENABLED) && cpu->apic_id != cpus[0].apic_id) {
+				add_cpu(cpu->apic_id);
+			}
+			entry += sizeof(struct mp_processor);
+		} else {
+			/* Buses, IO APICs and interrupt assignments are all 8 bytes */
+			entry += 8;
+		}
+	}
+	return cpu_count - 1;
+}
+
+static struct mp_config *mp_config_find(struct mp_float *mp)
+{
+	struct mp_config *config;
+	
+	if(mp == NULL || mp->features[0] != 0) {
+		return NULL;
+	}
+	config = (struct mp_config *)mp->config;
+	if(memcmp(config->signature, "PCMP", 4) != 0 || !checksum((unsigned char *)config, config->length)) {
+		return NULL;
+	}
+	return config;
+}
+
+int mp_parse_ioapics()
+{
+	struct mp_float *mp = mp_find();
+	struct mp_config *config = mp_config_find(mp);
+	unsigned char isa_bus[256];
+	unsigned char *entry;
+	int i, found = 0;
+	
+	if(config == NULL) {
+		/* A default configuration has its IO APIC at the usual place,
+		 * pins wired straight to ISA IRQs */
+		if(mp != NULL && mp->features[0] != 0) {
+			ioapic_add(1, 0xFEC00000, 0);
+			found = 1;
+		}
+		goto imcr;
+	}
+	
+	memset(isa_bus, 0, sizeof(isa_bus));
+	entry = (unsigned char *)(config + 1);
+	for(i = 0; i < config->entries; i++) {
+		if(*entry == MP_PROCESSOR) {
+			entry += sizeof(struct mp_processor);
+			continue;
+		}
+		if(*entry == MP_BUS) {
+			struct mp_bus *bus = (struct mp_bus *)entry;
+			isa_bus[bus->id] = memcmp(bus->name, "ISA", 3) == 0;
+		} else if(*entry == MP_IOAPIC) {
+			struct mp_ioapic *io = (struct mp_ioapic *)entry;
+			if(io->flags & MP_IOAPIC_ENABLED) {
+				ioapic_add(io->id, io->address, -1);
+				found++;
+			}
+		} else if(*entry == MP_INTERRUPT) {
+			/* Buses come first, IO APICs before their interrupts */
+			struct mp_interrupt *irq = (struct mp_interrupt *)entry;
+			int gsi = ioapic_gsi(irq->dst_ioapic, irq->dst_pin);
+			if(irq->int_type == MP_INT_VECTORED && isa_bus[irq->src_bus] && gsi >= 0) {
+				ioapic_isa_override(irq->src_irq, gsi, irq->flags);
+			}
+		}
+		entry += 8;
+	}
+	
+imcr:
+	if(found && (mp->features[1] & MP_IMCR)) {
+		/* Route the INTR line through the APIC rather than straight from
+		 * the PIC to the CPU */
+		out8(0x22, 0x70);
+		out8(0x23, 0x01);
+	}
+	return found;
+}
+
+static void lapic_enable(void)
+{
+	/* Software enable, spurious interrupts to SPURIOUS_VECTOR */
+	lapic_write(LAPIC_SVR, lapic_read(LAPIC_SVR) | 0x100 | SPURIOUS_VECTOR);
+}
+
+static void lapic_icr(unsigned char apic_id, unsigned long command)
+{
+	lapic_write(LAPIC_ICR_HI, (unsigned long)apic_id << 24);
+	lapic_write(LAPIC_ICR_LO, command);
+	/* Wait for delivery status to go idle */
+	while(lapic_read(LAPIC_ICR_LO) & 0x1000) {
+		asm volatile("pause");
+	}
+}
+
+void smp_send_ipi(cpu_t *cpu, unsigned char vector)
+{
+	long istate = interrupts_disable();
+	/* Fixed delivery, level assert */
+	lapic_icr(cpu->apic_id, 0x4000 | vector);
+	interrupts_restore(istate);
+}
+
+/* Called on the BSP from timer_tick: the PIT only interrupts us, so pass the
+ * tick on to everyone else */
+void smp_broadcast_tick()
+{
+	unsigned int i;
+	
+	for(i = 1; i < cpu_count; i++) {
+		if(cpus[i].online) {
+			smp_send_ipi(&cpus[i], IPI_TICK);
+		}
+	}
+}
+
+/* Wake a halted CPU so that it can steal work from a busy one */
+void smp_kick_idle()
+{
+	cpu_t *self = this_cpu();
+	unsigned int i;
+	
+	for(i = 0; i < cpu_count; i++) {
+		cpu_t *cpu = &cpus[i];
+		if(cpu != self && cpu->online && cpu->running == cpu->idle && cpu->nr_ready == 0) {
+			smp_send_ipi(cpu, IPI_RESCHED);
+			return;
+		}
+	}
+}
+
+/* Every CPU is sitting in its idle thread with nothing queued */
+int smp_all_idle()
+{
+	unsigned int i;
+	
+	for(i = 0; i < cpu_count; i++) {
+		cpu_t *cpu = &cpus[i];
+		if(cpu->online && (cpu->running != cpu->idle || cpu->nr_ready != 0)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void smp_resched_ipi()
+{
+	lapic_eoi();
+	thread_resched();
+}
+
+void smp_tick_ipi()
+{
+	lapic_eoi();
+	thread_tick();
+}
+
+/* First C code run by an AP, on its boot stack with interrupts disabled */
+static void smp_ap_main(void)
+{
+	/* Too late, smp_boot_ap has given up on us and is sending INIT */
+	if(atomic_fetch_add(&ap_claim, 1) != 0) {
+		for(;;) {
+			asm volatile("cli; hlt");
+		}
+	}
+	/* Share the BSP's page directory, the VMM's window is only there */
+	if(paging_enabled) {
+		paging_load();
+	}
+	idt_load();
+	lapic_enable();
+	/* Never returns, this context is the CPU's idle thread from now on */
+	thread_cpu_start(this_cpu());
+}
+
+static int smp_boot_ap(cpu_t *cpu)
+{
+	char *trampoline = (char *)AP_TRAMPOLINE;
+	char *stack = malloc(AP_STACK_SIZE);
+	int timeout;
+	
+	if(stack == NULL) {
+		dprintf("smp: no stack for CPU %d (APIC %d)\r\n", cpu->index, cpu->apic_id);
+		return 0;
+	}
+	ap_claim = 0;
+	
+	/* Parameters for the trampoline live inside its own copy */
+	*(unsigned long *)(trampoline + (ap_boot_stack - ap_trampoline)) = (unsigned long)(stack + AP_STACK_SIZE);
+	*(unsigned long *)(trampoline + (ap_boot_entry - ap_trampoline)) = (unsigned long)smp_ap_main;
+	
+	/* INIT, then two STARTUPs as the MP spec asks */
+	lapic_icr(cpu->apic_id, 0x4500);
+	udelay(10000);
+	lapic_icr(cpu->apic_id, 0x4600 | (AP_TRAMPOLINE >> 12));
+	udelay(200);
+	if(!cpu->online) {
+		lapic_icr(cpu->apic_id, 0x4600 | (AP_TRAMPOLINE >> 12));
+	}
+	
+	for(timeout = 0; timeout < 100000 && !cpu->online; timeout++) {
+		udelay(1);
+	}
+	if(!cpu->online && atomic_fetch_add(&ap_claim, 1) == 0) {
+		/* It never reached smp_ap_main, and won't now. INIT leaves it
+		 * waiting for a STARTUP that never comes, so the stack is free */
+		lapic_icr(cpu->apic_id, 0x4500);
+		dprintf("smp: CPU %d (APIC %d) did not start\r\n", cpu->index, cpu->apic_id);
+		free(stack);
+		return 0;
+	}
+	/* Claimed by the AP, which is nearly done */
+	while(!cpu->online) {
+		asm volatile("pause");
+	}
+	return 1;
+}
+
+int lapic_init()
+{
+	unsigned long eax, ebx, ecx, edx, lo, hi;
+	
+	if(lapic_base != NULL) {
+		return 1;
+	}
+	asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+	if(!(edx & (1 << 9))) {
+		return 0;
+	}
+	asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(0x1B));
+	lapic_base = (volatile unsigned long *)(lo & 0xFFFFF000);
+	
+	set_vector(IPI_RESCHED, (interrupt_handler)ipi_resched, interrupt);
+	set_vector(IPI_TICK, (interrupt_handler)ipi_tick, interrupt);
+	set_vector(SPURIOUS_VECTOR, (interrupt_handler)spurious_irq, interrupt);
+	lapic_enable();
+	
+	cpus[0].apic_id = lapic_read(LAPIC_ID) >> 24;
+	apic_to_cpu[cpus[0].apic_id] = 0;
+	cpus[0].online = 1;
+	return 1;
+}
+
+void smp_init()
+{
+	unsigned int i, found, n = 1;
+	cpu_t *cpu;
+	
+	/* Need a local APIC for any of this */
+	if(!lapic_init()) {
+		return;
+	}
+	
+	if(mp_parse() == 0) {
+		return;
+	}
+	
+	/* Copy the trampoline down, with our GDT for it to load */
+	memcpy((void *)AP_TRAMPOLINE, ap_trampoline, ap_trampoline_end - ap_trampoline);
+	asm volatile("sgdt %0" : "=m"(*(char (*)[6])(AP_TRAMPOLINE + (ap_boot_gdt - ap_trampoline))));
+	
+	/* Started APs are packed into cpus[1..n), a slot whose AP failed goes
+	 * to the next one. A failed AP is parked before it touches its slot,
+	 * and stays that way */
+	found = cpu_count;
+	for(i = 1; i < found; i++) {
+		cpu = &cpus[n];
+		cpu->apic_id = cpus[i].apic_id;
+		cpu->index = n;
+		apic_to_cpu[cpu->apic_id] = n;
+		n += smp_boot_ap(cpu);
+	}
+	cpu_count = n;
+	dprintf("smp: %d of %d application processors started\r\n", n - 1, found - 1);
+}
@@ -0,0 +1,110 @@
+#ifndef SMP_HEADER
+#define SMP_HEADER
+
+/* Real mode entry point for application processors, must be page aligned
+ * and below 1MB; SIPI vector is AP_TRAMPOLINE >> 12 */
+#define AP_TRAMPOLINE	0x7000
+
+#define MAX_CPUS		16
+
+/* Local APIC registers, as offsets from lapic_base */
+#define LAPIC_ID		0x020
+#define LAPIC_EOI		0x0B0
+#define LAPIC_SVR		0x0F0
+#define LAPIC_ISR		0x100
+#define LAPIC_ICR_LO	0x300
+#define LAPIC_ICR_HI	0x310
+
+/* Vectors used for inter-processor interrupts */
+#define IPI_RESCHED		0xF0
+#define IPI_TICK		0xF1
+#define SPURIOUS_VECTOR	0xFF
+
+#ifndef __ASSEMBLER__
+
+#include <threads.h>
+#include <spinlock.h>
+
+typedef struct cpu {
+	unsigned int index;
+	unsigned int apic_id;
+	volatile int online;
+	
+	/* Everything below is protected by lock */
+	spinlock_t lock;
+	real_thread_t *running;
+	real_thread_t *idle;
+	/* Thread switched away from, finished off by finish_switch */
+	real_thread_t *previous;
+	/* Ready threads, one FIFO per priority level, see threads.c */
+	link_t run_queues[THREAD_PRIORITIES];
+	unsigned long ready_bitmap;
+	unsigned long nr_ready;
+	/* Set when running should give up the CPU as soon as it can */
+	int need_resched;
+	/* Thread whose context is loaded in this CPU's FPU, or NULL */
+	real_thread_t *fpu_owner;
+	/* How far this CPU's TLB has caught up with unmaps, see vmm.c */
+	volatile unsigned long tlb_gen;
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern unsigned int cpu_count;
+extern unsigned char apic_to_cpu[256];
+extern volatile unsigned long *lapic_base;
+
+static inline unsigned long lapic_read(unsigned int reg)
+{
+	return lapic_base[reg / 4];
+}
+
+static inline void lapic_write(unsigned int reg, unsigned long value)
+{
+	lapic_base[reg / 4] = value;
+}
+
+static inline void lapic_eoi(void)
+{
+	lapic_write(LAPIC_EOI, 0);
+}
+
+/* Whether vector is being serviced, i.e. still waiting for its EOI */
+static inline int lapic_in_service(unsigned char vector)
+{
+	return (lapic_read(LAPIC_ISR + (vector / 32) * 0x10) >> (vector % 32)) & 1;
+}
+
+/* The CPU we're running on. Callers must have interrupts disabled, or they
+ * could be migrated before they use the result */
+static inline cpu_t *this_cpu(void)
+{
+	if(cpu_count == 1) {
+		return &cpus[0];
+	}
+	return &cpus[apic_to_cpu[lapic_read(LAPIC_ID) >> 24]];
+}
+
+/* Linear address of the EBDA from the BIOS data area, 0 if there is none.
+ * Page zero is unmapped once paging is on, so it's read by the first call,
+ * which ioapic_init makes before vmm_init */
+extern unsigned long bios_ebda(void);
+/* Find and enable the boot CPU's local APIC, returns 0 if it has none.
+ * Safe to call more than once */
+extern int lapic_init();
+/* Report the MP table's IO APICs and ISA interrupt assignments to ioapic.c,
+ * returns the number of IO APICs */
+extern int mp_parse_ioapics();
+/* Start every processor the MP table lists; call after thread_init. Those
+ * that fail to start are parked for good and left out of cpu_count */
+extern void smp_init();
+extern void smp_send_ipi(cpu_t *cpu, unsigned char vector);
+extern void smp_broadcast_tick();
+extern void smp_kick_idle();
+extern int smp_all_idle();
+
+/* threads.c: turn the calling AP's boot context into its idle thread */
+extern void thread_cpu_start(cpu_t *cpu) __attribute__ ((noreturn));
+
+#endif
+
+#endif
@@ -4,47 +4,21 @@
 #include <stdio.h>
 #include <asm.h>
 #include <multiboot.h>
+#include <stdlib.h>
+#include "paging.h"
+#include "idt.h"
+#include "ioapic.h"
+#include "smp.h"
+#include "ksyms.h"
+#include "pmm.h"
+#include <vmm.h>
+#include "dma.h"
+#include <threads.h>
 
 extern void caml_startup(char **args);
 
 extern void idt_init();
 
-static unsigned int __attribute__((section(".bss.pagealigned"),used)) page_dir[1024];
-static unsigned int __attribute__((section(".bss.pagealigned"))) first_page_table[1024];
-static unsigned int __attribute__((section(".bss.pagealigned"))) last_page_table[1024];
-
-static void paging_init(void)
-{
-	int i;
-	// build a simple pagedir
-	// very first and last pages are unmapped
-	// everything else has a 1:1 mapping with physical memory using 4MB pages
-	for(i = 1; i < 1024; i++) {
-		first_page_table[i] = (i * 0x1000) | 0x103;
-	}
-	first_page_table[0] = 0;
-	for(i = 1; i < 1024; i++) {
-		last_page_table[i] = 0xFFC00000 + (i * 0x1000) | 0x103;
-	}
-	last_page_table[1023] = 0;
-	for(i = 1; i < 1023; i++) {
-		page_dir[i] = (i * 0x400000) | 0x183;
-	}
-	page_dir[0] = (unsigned int)first_page_table | 0x103;
-	page_dir[1023] = (unsigned int)last_page_table | 0x103;
-	__asm__ volatile(
-		"movl	$page_dir, %%eax\n\t"
-		"mov	%%eax, %%cr3\n\t"
-		
-		"movl	%%cr4, %%eax\n\t"
-		"bts	$4, %%eax\n\t"
-		"movl	%%eax, %%cr4\n\t"
-		
-		"mov	%%cr0, %%eax\n\t"
-		"bts	$31, %%eax\n\t"
-		"mov	%%eax, %%cr0\n\t" ::: "eax");
-}
-
 static unsigned long mem_start;
 
 void __startup(multiboot_info_t *multiboot, int magic)
@@ -55,33 +29,78 @@ void __startup(multiboot_info_t *multiboot, int magic)
 	//dprintf("Welcome to Snowflake Serial Debugging!\r\n");
 	
 	mem_start = (unsigned long)&end;
+	// the loader may have put the symbol table after us, keep the heap clear of it
+	if (magic == MULTIBOOT_BOOTLOADER_MAGIC) {
+		mem_start = ksyms_init(multiboot, mem_start);
+	}
+	// hand the RAM the loader found to the page allocator, the heap starts past its bitmap
+	mem_start = pmm_init(magic == MULTIBOOT_BOOTLOADER_MAGIC ? multiboot : NULL, mem_start);
 	
 	// set up exception and irq handlers
 	idt_init();
-	//paging_init();
+	
+	// deliver IRQs through the IO APIC if there is one, else keep the PICs
+	ioapic_init();
+	
+	// turn paging on and page the space above RAM in and out for large
+	// allocations; page zero goes away, so this comes after the EBDA scan
+	vmm_init();
+	
+	// buffers for devices that can only reach the first 16MB
+	dma_init();
 	
 	unmask_irq(0);
 	update_mask();
 	
+	// we become the kernel thread; time slices start once interrupts are on
+	thread_init();
+	// start the other CPUs, each comes up on a run queue of its own
+	smp_init();
+	thread_preempt_init(PREEMPT_HZ, PREEMPT_QUANTUM);
+	
 	caml_startup(argv);
 	
 	// caml_startup has finished initialising the OS
 	//dprintf("INFO: Startup completed. Exiting startup thread...\r\n");
 }
 
-// simplistic handing out of memory to malloc()
+// hand out memory to malloc() from the pages right after the kernel
 extern char *sbrk(int);
 
 char *sbrk(int incr){
   static char *heap_end;
+  // end of the pages claimed from the page allocator
+  static unsigned long heap_top;
   char *prev_heap_end;
+  unsigned long new_top;
 
   if ( heap_end == 0 ) {
 	heap_end = (char *)mem_start;
+	heap_top = mem_start;
   }
   prev_heap_end = heap_end;
 
+  if ( incr < 0 && (unsigned long)-incr > (unsigned long)heap_end - mem_start ) {
+	return (char *)-1;
+  }
+  if ( incr > 0 && (unsigned long)heap_end + incr + PAGE_SIZE < (unsigned long)heap_end ) {
+	return (char *)-1;
+  }
+  new_top = ((unsigned long)heap_end + incr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+  if ( new_top > heap_top ) {
+	// the page allocator hands out from the top down, so these are the last to go
+	if ( pmm_claim(heap_top, (new_top - heap_top) / PAGE_SIZE) != 0 ) {
+		dprintf("sbrk: out of memory growing the heap by %d bytes, %u KB free\r\n",
+			incr, pmm_free_pages() * (PAGE_SIZE / 1024));
+		return (char *)-1;
+	}
+	heap_top = new_top;
+  } else if ( new_top < heap_top ) {
+	// malloc trimmed the top of the heap
+	pmm_free(new_top, (heap_top - new_top) / PAGE_SIZE);
+	heap_top = new_top;
+  }
+
   heap_end += incr;
-  // FIXME: require check to see if physical memory is exhausted
   return prev_heap_end;
 }
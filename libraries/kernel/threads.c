@@ -4,52 +4,442 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <trace.h>
 #include "threads.h"
+#include "idt.h"
+#include "timer.h"
+#include "paging.h"
+#include <vmm.h>
+#include "smp.h"
+#include "workqueue.h"
+#include "slab.h"
 
 extern void _thread_switch_stacks(unsigned long *new_esp, unsigned long **old_esp);
 
 static void *do_idle(void *);
 static void *do_reaper(void *);
 
-static unsigned long next_id = 0;
+static volatile unsigned long next_id = 0;
 
+/* all_threads is shared by every CPU, so is the zombie list */
+static spinlock_t threads_lock = SPINLOCK_INITIALIZER;
 static LIST_INITIALIZE(all_threads);
-static LIST_INITIALIZE(run_queue);
+static spinlock_t zombie_lock = SPINLOCK_INITIALIZER;
 static LIST_INITIALIZE(zombie_list);
-static real_thread_t *current;
+
+/* Thread structures, each on its own cache lines */
+static slab_cache_t *thread_cache;
+
+/* The thread running on this CPU. Only stable with interrupts disabled,
+ * otherwise we could be moved to another CPU right after reading it */
+#define current (this_cpu()->running)
+
+/* Time slice handed out on each switch, 0 while preemption is off */
+static unsigned long thread_quantum = 0;
+
+/* CPU has FXSAVE/FXRSTOR (and maybe SSE), otherwise fall back to FNSAVE */
+static int fpu_fxsr = 0;
 
 static real_thread_t kernel_thread;
-static thread_t idle_thread;
 /* Reaper: Slayer of dead threads */
 static thread_t reaper_thread;
 
+/* Locking
+ *
+ * Each CPU's run queues, current thread and FPU owner are protected by
+ * cpu->lock, each mutex/cond waitqueue by its own lock. Locks are always
+ * taken with interrupts disabled, and in the order waitqueue, then CPU;
+ * threads_lock also comes before any CPU's lock.
+ * schedule holds cpu->lock across the stack switch; finish_switch drops it
+ * on the other side, which is also when the previous thread's on_cpu is
+ * cleared. Until then nobody may run that thread on another CPU. */
+
+static inline void *fpu_state(real_thread_t *thread);
+
+/* Ready threads, one FIFO per priority level per CPU. Bit n of
+ * cpu->ready_bitmap is set whenever run_queues[n] is non-empty, so picking
+ * the next thread is a bsr and a list_remove regardless of how many threads
+ * are ready. All of these need cpu->lock */
+
+static inline void run_queue_append(cpu_t *cpu, real_thread_t *thread)
+{
+	list_append(&thread->run_link, &cpu->run_queues[thread->priority]);
+	cpu->ready_bitmap |= 1UL << thread->priority;
+	cpu->nr_ready++;
+	thread->on_rq = 1;
+	thread->cpu = cpu;
+}
+
+static inline void run_queue_remove(cpu_t *cpu, real_thread_t *thread)
+{
+	list_remove(&thread->run_link);
+	if(list_empty(&cpu->run_queues[thread->priority])) {
+		cpu->ready_bitmap &= ~(1UL << thread->priority);
+	}
+	cpu->nr_ready--;
+	thread->on_rq = 0;
+}
+
+/* Highest priority with a ready thread, -1 if there are none */
+static inline int run_queue_top(cpu_t *cpu)
+{
+	unsigned long top;
+	
+	if(cpu->ready_bitmap == 0) {
+		return -1;
+	}
+	asm("bsrl %1, %0" : "=r"(top) : "rm"(cpu->ready_bitmap));
+	return top;
+}
+
+static real_thread_t *run_queue_pick(cpu_t *cpu)
+{
+	real_thread_t *thread;
+	int top = run_queue_top(cpu);
+	
+	if(top < 0) {
+		return NULL;
+	}
+	thread = list_get_instance(cpu->run_queues[top].next, real_thread_t, run_link);
+	run_queue_remove(cpu, thread);
+	return thread;
+}
+
+/* Work stealing
+ *
+ * Called by schedule when this CPU has nothing of its own to run. Takes the
+ * most urgent thread from the first other CPU that has one to spare,
+ * skipping threads still on their old CPU's stack (on_cpu) and threads whose
+ * FPU state is live in that CPU's registers. Victims' locks are only tried,
+ * never waited on, so two CPUs stealing from each other can't deadlock. */
+static real_thread_t *steal(cpu_t *cpu)
+{
+	unsigned int i;
+	int priority;
+	link_t *link;
+	
+	for(i = 1; i < cpu_count; i++) {
+		cpu_t *victim = &cpus[(cpu->index + i) % cpu_count];
+		real_thread_t *thread = NULL;
+		
+		if(!victim->online || victim->nr_ready == 0 || !spin_trylock(&victim->lock)) {
+			continue;
+		}
+		for(priority = PRIORITY_MAX; priority >= PRIORITY_MIN && thread == NULL; priority--) {
+			if(!(victim->ready_bitmap & (1UL << priority))) {
+				continue;
+			}
+			for(link = victim->run_queues[priority].next; link != &victim->run_queues[priority]; link = link->next) {
+				real_thread_t *t = list_get_instance(link, real_thread_t, run_link);
+				if(!t->on_cpu && t != victim->fpu_owner) {
+					thread = t;
+					break;
+				}
+			}
+		}
+		if(thread != NULL) {
+			run_queue_remove(victim, thread);
+		}
+		spin_unlock(&victim->lock);
+		if(thread != NULL) {
+			return thread;
+		}
+	}
+	return NULL;
+}
+
+/* Lock the run queue of the CPU thread last ran on. The thread can be stolen
+ * while we wait for the lock, so check it's still the right one after */
+static cpu_t *thread_cpu_lock(real_thread_t *thread)
+{
+	cpu_t *cpu;
+	
+	while(1) {
+		cpu = thread->cpu;
+		spin_lock(&cpu->lock);
+		if(cpu == thread->cpu) {
+			return cpu;
+		}
+		spin_unlock(&cpu->lock);
+	}
+}
+
+/* Put a blocked thread back on the run queue of the CPU it last ran on, and
+ * poke whichever CPU ought to run it. Called with interrupts disabled */
+static void make_runnable(real_thread_t *thread)
+{
+	cpu_t *self = this_cpu();
+	cpu_t *cpu = thread_cpu_lock(thread);
+	int kick = 0, kick_idle = 0;
+	
+	if(thread->status != BLOCKED) {
+		/* Already woken */
+		spin_unlock(&cpu->lock);
+		return;
+	}
+	thread->status = RUNNABLE;
+	/* wake_first, wake_all and timeouts all end up here */
+	trace(TRACE_WAKE, thread->id, self->running ? self->running->id : 0);
+	thread->wakeups++;
+	if(thread->blocked_at != 0) {
+		thread->blocked_cycles += rdtsc() - thread->blocked_at;
+		thread->blocked_at = 0;
+	}
+	run_queue_append(cpu, thread);
+	if(thread->priority > cpu->running->priority) {
+		cpu->need_resched = 1;
+		kick = cpu != self;
+	} else if(cpu_count > 1) {
+		/* Queued behind something, maybe an idle CPU can take it */
+		kick_idle = 1;
+	}
+	spin_unlock(&cpu->lock);
+	
+	if(kick) {
+		smp_send_ipi(cpu, IPI_RESCHED);
+	} else if(kick_idle) {
+		smp_kick_idle();
+	}
+	if(timer_tick_stopped && self != &cpus[0]) {
+		/* Something has work now, get the boot CPU ticking again */
+		smp_send_ipi(&cpus[0], IPI_RESCHED);
+	}
+}
+
+/* Lazy FPU switching
+ *
+ * Rather than saving the x87/SSE state on every switch, schedule sets CR0.TS
+ * whenever the incoming thread isn't the one whose state is in the FPU. The
+ * first FPU instruction it executes then raises #NM (exception 7), and
+ * thread_fpu_trap saves the owner's state and loads the new thread's. Threads
+ * that never touch the FPU never pay for it. Each CPU has its own owner; a
+ * thread is never stolen while it owns a CPU's FPU. */
+
+static inline void *fpu_state(real_thread_t *thread)
+{
+	return (void *)(((unsigned long)thread->fpu_area + 15) & ~15UL);
+}
+
+static inline void fpu_set_ts(void)
+{
+	unsigned long cr0;
+	asm volatile("mov %%cr0, %0" : "=r"(cr0));
+	if(!(cr0 & 8)) {
+		asm volatile("mov %0, %%cr0" :: "r"(cr0 | 8));
+	}
+}
+
+/* Run on every CPU as it starts scheduling */
+static void fpu_init(void)
+{
+	unsigned long eax, ebx, ecx, edx, cr4;
+	
+	asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+	if(edx & (1 << 24)) {
+		fpu_fxsr = 1;
+		/* Let FXSAVE/FXRSTOR cover the SSE registers too (OSFXSR), and
+		 * report SIMD exceptions as #XM rather than #UD (OSXMMEXCPT) */
+		asm volatile("mov %%cr4, %0" : "=r"(cr4));
+		cr4 |= 1 << 9;
+		if(edx & (1 << 25)) {
+			cr4 |= 1 << 10;
+		}
+		asm volatile("mov %0, %%cr4" :: "r"(cr4));
+	}
+}
+
+/* Called from the fpu_trap stub with interrupts disabled */
+void thread_fpu_trap()
+{
+	cpu_t *cpu = this_cpu();
+	real_thread_t *owner;
+	
+	if(cpu->running == NULL) {
+		/* Threads aren't running, so TS was never set by us */
+		exception7();
+	}
+	
+	asm volatile("clts");
+	spin_lock(&cpu->lock);
+	owner = cpu->fpu_owner;
+	if(owner == cpu->running) {
+		spin_unlock(&cpu->lock);
+		return;
+	}
+	
+	if(owner != NULL) {
+		if(fpu_fxsr) {
+			asm volatile("fxsave %0" : "=m"(*(char (*)[512])fpu_state(owner)));
+		} else {
+			asm volatile("fnsave %0" : "=m"(*(char (*)[108])fpu_state(owner)));
+		}
+		owner->fpu_valid = 1;
+	}
+	
+	if(cpu->running->fpu_valid) {
+		if(fpu_fxsr) {
+			asm volatile("fxrstor %0" :: "m"(*(char (*)[512])fpu_state(cpu->running)));
+		} else {
+			asm volatile("frstor %0" :: "m"(*(char (*)[108])fpu_state(cpu->running)));
+		}
+	} else {
+		/* First use, start from a clean FPU */
+		asm volatile("fninit");
+		if(fpu_fxsr) {
+			unsigned long mxcsr = 0x1F80;
+			asm volatile("ldmxcsr %0" :: "m"(mxcsr));
+		}
+	}
+	cpu->fpu_owner = cpu->running;
+	spin_unlock(&cpu->lock);
+}
+
+/* CPU accounting
+ *
+ * schedule stamps the TSC on every real switch: the outgoing thread is
+ * charged for the time since it was switched in, and if it blocked, the time
+ * until make_runnable is charged to blocked_cycles. Everything is updated
+ * under the lock of the thread's CPU. TSCs on different CPUs are assumed to
+ * be close enough to compare. */
+
+static void thread_stats_init(real_thread_t *thread)
+{
+	thread->run_cycles = 0;
+	thread->blocked_cycles = 0;
+	thread->switched_at = rdtsc();
+	thread->blocked_at = 0;
+	thread->top_cycles = 0;
+	thread->switches = 0;
+	thread->wakeups = 0;
+}
+
+/* Called with the thread's CPU locked */
+static void thread_stats_fill(real_thread_t *thread, thread_stats_t *stats)
+{
+	unsigned long long now = rdtsc();
+	
+	stats->id = thread->id;
+	stats->status = thread->status;
+	stats->priority = thread->priority;
+	stats->run_cycles = thread->run_cycles;
+	if(thread->on_cpu && thread->cpu->running == thread) {
+		/* Count the slice in progress */
+		stats->run_cycles += now - thread->switched_at;
+	}
+	stats->blocked_cycles = thread->blocked_cycles;
+	if(thread->blocked_at != 0) {
+		stats->blocked_cycles += now - thread->blocked_at;
+	}
+	stats->switches = thread->switches;
+	stats->wakeups = thread->wakeups;
+}
+
 void thread_init() {
+	cpu_t *cpu = &cpus[0];
+	thread_t idle;
+	int i, j;
+	
+	for(i = 0; i < MAX_CPUS; i++) {
+		cpus[i].index = i;
+		spin_init(&cpus[i].lock);
+		for(j = 0; j < THREAD_PRIORITIES; j++) {
+			list_initialize(&cpus[i].run_queues[j]);
+		}
+	}
+	
+	thread_cache = slab_cache_create("threads", sizeof(real_thread_t), 0);
+	
 	/* Kernel thread is special, it already has a stack and is currently running */
-	kernel_thread.id = next_id++;
+	kernel_thread.id = atomic_fetch_add(&next_id, 1);
 	kernel_thread.status = RUNNABLE;
+	kernel_thread.quantum = thread_quantum;
+	kernel_thread.preempt_count = 0;
+	kernel_thread.priority = PRIORITY_DEFAULT;
+	kernel_thread.base_priority = PRIORITY_DEFAULT;
+	list_initialize(&kernel_thread.held_mutexes);
+	kernel_thread.blocked_on = NULL;
+	kernel_thread.blocked_node = NULL;
+	kernel_thread.fpu_valid = 0;
+	kernel_thread.stack = NULL;
+	kernel_thread.stack_guard = NULL;
+	kernel_thread.stack_painted = 0;
+	kernel_thread.cpu = cpu;
+	kernel_thread.on_cpu = 1;
+	kernel_thread.on_rq = 0;
+	thread_stats_init(&kernel_thread);
 	link_initialize(&kernel_thread.run_link);
 	link_initialize(&kernel_thread.global_link);
 	list_insert_prev(&kernel_thread.global_link, &all_threads);
 	kernel_thread.slot = NULL;
-	current = &kernel_thread;
+	kernel_thread.malloc_tag = 0;
+	cpu->running = &kernel_thread;
 	
-	thread_create(&idle_thread, do_idle, NULL);
-	thread_create(&reaper_thread, do_reaper, NULL);
+	/* stage1 did fninit for us, so the FPU is already the kernel thread's */
+	fpu_init();
+	cpu->fpu_owner = &kernel_thread;
+	
+	/* Nothing runs without these, so running out of memory here is fatal */
+	if(thread_create(&idle, do_idle, NULL) != 0) {
+		dprintf("threads: no memory for the idle thread\r\n");
+		exit(-1);
+	}
+	/* Idle only ever runs when the bitmap is empty, keep it off the queues */
+	long istate = interrupts_disable();
+	spin_lock(&cpu->lock);
+	run_queue_remove(cpu, idle);
+	idle->priority = PRIORITY_MIN;
+	idle->base_priority = PRIORITY_MIN;
+	cpu->idle = idle;
+	spin_unlock(&cpu->lock);
+	interrupts_restore(istate);
+	cpu->online = 1;
+	if(thread_create(&reaper_thread, do_reaper, NULL) != 0) {
+		dprintf("threads: no memory for the reaper thread\r\n");
+		exit(-1);
+	}
+	workqueue_init();
+}
+
+/* Runs on the new thread's stack straight after the switch, with cpu->lock
+ * still held by schedule. The previous thread is now safe to run elsewhere */
+static void finish_switch(void)
+{
+	cpu_t *cpu = this_cpu();
+	real_thread_t *previous = cpu->previous;
+	
+	previous->on_cpu = 0;
+	spin_unlock(&cpu->lock);
+	
+	if(previous->status == EXITED || previous->status == KILLED) {
+		/* Nobody is on its stack any more, hand it to Reaper */
+		spin_lock(&zombie_lock);
+		list_append(&previous->run_link, &zombie_list);
+		spin_unlock(&zombie_lock);
+		make_runnable(reaper_thread);
+	}
 }
 
 static void schedule(void)
 {
 	/* Save the current state of IF and disable interrupts */
 	long intr_state = interrupts_disable();
-	real_thread_t *previous = current;
+	cpu_t *cpu = this_cpu();
+	real_thread_t *previous, *next;
+	unsigned long long now;
+	
+	spin_lock(&cpu->lock);
+	previous = cpu->running;
 	
 	/* Possibly put the thread back on the run queue
 	 * The idle thread is special, it never goes on the run queue */
-	if(current != idle_thread) {
-		switch(current->status) {
+	if(previous != cpu->idle) {
+		switch(previous->status) {
 		case RUNNABLE:
-			/* Place on the end of the run queue */
-			list_append(&current->run_link, &run_queue);
+			/* Place on the end of its priority's run queue, unless it was
+			 * woken between blocking and getting here and already is */
+			if(!previous->on_rq) {
+				run_queue_append(cpu, previous);
+			}
 			break;
 		case BLOCKED:
 			/* Nothing */
@@ -58,40 +448,37 @@ static void schedule(void)
 		case EXITED:
 			/* The thread is dead but cannot be freed here because 
 			 * we're currently running on it's stack
-			 * Prepare it for deletion and wake Reaper */
-			list_append(&current->run_link, &zombie_list);
-			if(reaper_thread->status == BLOCKED) {
-				reaper_thread->status = RUNNABLE;
-				list_append(&reaper_thread->run_link, &run_queue);
-			}
+			 * finish_switch passes it on to Reaper */
 			break;
 		default:
-			dprintf("schedule: Aiee! invalid thread state %u in %u/%x\r\n", current->status, current->id, (long)current);
+			dprintf("schedule: Aiee! invalid thread state %u in %u/%x\r\n", previous->status, previous->id, (long)previous);
 			assert(0);
 		}
 	}
 	
-	/* Pick a new thread to run */
-	if(list_empty(&run_queue)) {
+	/* Pick a new thread to run: our own, someone else's, or idle */
+	next = run_queue_pick(cpu);
+	if(next == NULL && cpu_count > 1) {
+		next = steal(cpu);
+	}
+	if(next == NULL) {
 		/* Nothing to run, schedule the idle thread */
 		#ifdef DEBUG_SCHEDULER
 		dprintf("thread = idle\r\n");
 		#endif
-		current = idle_thread;
-	} else {
-		/* Pull it from the front of the run queue */
-		current = list_get_instance(run_queue.next, real_thread_t, run_link);
-		list_remove(&current->run_link);
-		#ifdef DEBUG_SCHEDULER
-		dprintf("thread = other\r\n");
-		#endif
+		next = cpu->idle;
 	}
 	
-	if(previous == current) {
+	/* Fresh time slice, whether or not we actually switch */
+	next->quantum = thread_quantum;
+	cpu->need_resched = 0;
+	
+	if(previous == next) {
 		/* Nothing to do, early return now to avoid the stack switch code */
 		#ifdef DEBUG_SCHEDULER
 		dprintf("return to self\r\n");
 		#endif
+		spin_unlock(&cpu->lock);
 		interrupts_restore(intr_state);
 		return;
 	}
@@ -99,10 +486,29 @@ static void schedule(void)
 	#ifdef DEBUG_SCHEDULER
 	dprintf("return to selected\r\n");
 	#endif
+	now = rdtsc();
+	previous->run_cycles += now - previous->switched_at;
+	if(previous->status == BLOCKED) {
+		previous->blocked_at = now;
+	}
+	next->switched_at = now;
+	next->switches++;
+	trace(TRACE_SWITCH, previous->id, next->id);
+	next->on_cpu = 1;
+	next->cpu = cpu;
+	cpu->running = next;
+	cpu->previous = previous;
+	/* Trap the first FPU instruction unless the state is already loaded */
+	if(next == cpu->fpu_owner) {
+		asm volatile("clts");
+	} else {
+		fpu_set_ts();
+	}
 	/* MAGIC! */
-	_thread_switch_stacks(current->esp, &previous->esp);
-	/* Now we're running on current's stack, so local variable have changed
+	_thread_switch_stacks(next->esp, &previous->esp);
+	/* Now we're running on next's stack, so local variable have changed
 	 * intr_state now holds the IF state for this thread, not the previous thread */
+	finish_switch();
 	interrupts_restore(intr_state);
 }
 
@@ -115,29 +521,369 @@ void thread_exit(void *retval) {
 	dprintf("t %d:%x exited\r\n", current->id, current->stack);
 #endif
 	/* Signal schedule that this thread has exited */
+	interrupts_disable();
 	current->status = EXITED;
 	schedule();
 	/* Can't reach here */
 	assert(0);
 }
 
-#define STACK_SIZE 16384
+/* Stack pool
+ *
+ * Stacks are rounded up to a power of two between STACK_SIZE_MIN and
+ * STACK_SIZE_MAX bytes, and the reaper hands them back to a free list per
+ * size class instead of to free(). thread_create pops one from the pool when
+ * it can, so short-lived threads don't go through malloc at all. Stacks are
+ * not cleared, only the initial frame for _thread_switch_stacks is written.
+ * Sizes above STACK_SIZE_MAX are allocated and freed directly. */
+
+#define STACK_CLASS_MIN 12	/* 4 KB */
+#define STACK_CLASS_MAX 16	/* 64 KB */
+#define STACK_CLASSES (STACK_CLASS_MAX - STACK_CLASS_MIN + 1)
+/* Free stacks kept per size class before the rest go back to malloc */
+#define STACK_POOL_DEPTH 8
+
+struct free_stack {
+	struct free_stack *next;
+};
+
+static spinlock_t stack_pool_lock = SPINLOCK_INITIALIZER;
+static struct free_stack *stack_pool[STACK_CLASSES];
+static unsigned int stack_pool_count[STACK_CLASSES];
+
+/* Size class index for a (rounded) size, -1 if it isn't pooled */
+static int stack_class(size_t size)
+{
+	int shift;
+	
+	for(shift = STACK_CLASS_MIN; shift <= STACK_CLASS_MAX; shift++) {
+		if(size == (1UL << shift)) {
+			return shift - STACK_CLASS_MIN;
+		}
+	}
+	return -1;
+}
+
+static size_t stack_round(size_t size)
+{
+	size_t rounded = STACK_SIZE_MIN;
+	
+	if(size > STACK_SIZE_MAX) {
+		/* Unpooled, just keep it word aligned */
+		return (size + sizeof(unsigned long) - 1) & ~(sizeof(unsigned long) - 1);
+	}
+	while(rounded < size) {
+		rounded <<= 1;
+	}
+	return rounded;
+}
+
+static unsigned long *stack_alloc(size_t size)
+{
+	int class = stack_class(size);
+	struct free_stack *stack = NULL;
+	
+	if(class >= 0) {
+		long istate = spin_lock_irqsave(&stack_pool_lock);
+		if((stack = stack_pool[class]) != NULL) {
+			stack_pool[class] = stack->next;
+			stack_pool_count[class]--;
+		}
+		spin_unlock_irqrestore(&stack_pool_lock, istate);
+	}
+	if(stack == NULL) {
+		stack = malloc(size);
+	}
+	return (unsigned long *)stack;
+}
+
+/* Called by the reaper with interrupts disabled */
+static void stack_release(unsigned long *stack, size_t size)
+{
+	int class = stack_class(size);
+	
+	spin_lock(&stack_pool_lock);
+	if(class >= 0 && stack_pool_count[class] < STACK_POOL_DEPTH) {
+		((struct free_stack *)stack)->next = stack_pool[class];
+		stack_pool[class] = (struct free_stack *)stack;
+		stack_pool_count[class]++;
+		stack = NULL;
+	}
+	spin_unlock(&stack_pool_lock);
+	if(stack != NULL) {
+		free(stack);
+	}
+}
+
+/* Stack checking
+ *
+ * With watermarks on, new stacks are filled with STACK_CANARY so that
+ * thread_stack_high_watermark can tell how deep the thread has ever gone.
+ * With guards on (which turns paging on), each stack gets an extra page
+ * below it that is marked not present; running off the end faults, and the
+ * #PF/#DF handlers use thread_find_guard to name the culprit. Guarded stacks
+ * bypass the pool. Both only affect threads created afterwards. */
+
+#define STACK_CANARY 0x57ACCA7E
+
+static int stack_watermarks = 0;
+static int stack_guards = 0;
+
+void thread_stack_watermarks(int enable)
+{
+	stack_watermarks = enable;
+}
+
+void thread_stack_guards(int enable)
+{
+	if(enable) {
+		paging_init();
+	}
+	stack_guards = enable;
+}
+
+size_t thread_stack_high_watermark(thread_t t)
+{
+	unsigned long *p = t->stack;
+	unsigned long *top = t->stack + t->stack_size / sizeof(unsigned long);
+	
+	if(!t->stack_painted) {
+		return 0;
+	}
+	while(p < top && *p == STACK_CANARY) {
+		p++;
+	}
+	return (top - p) * sizeof(unsigned long);
+}
+
+void thread_stack_report()
+{
+	link_t *link;
+	thread_t t;
+	long istate = spin_lock_irqsave(&threads_lock);
+	
+	for(link = all_threads.next; link != &all_threads; link = link->next) {
+		t = list_get_instance(link, real_thread_t, global_link);
+		if(t->stack == NULL) {
+			/* The kernel thread runs on the boot stack, APs' idle
+			 * threads on the stacks smp_init gave them */
+			continue;
+		}
+		if(t->stack_painted) {
+			dprintf("t %d: %u/%u bytes of stack used\r\n", t->id, thread_stack_high_watermark(t), t->stack_size);
+		} else {
+			dprintf("t %d: %u bytes of stack, not painted\r\n", t->id, t->stack_size);
+		}
+	}
+	spin_unlock_irqrestore(&threads_lock, istate);
+}
+
+/* Thread whose guard page contains addr, NULL if none. Called from the fault
+ * handlers, so it doesn't take any locks */
+thread_t thread_find_guard(unsigned long addr)
+{
+	link_t *link;
+	thread_t t;
+	
+	for(link = all_threads.next; link != &all_threads; link = link->next) {
+		t = list_get_instance(link, real_thread_t, global_link);
+		if(t->stack_guard != NULL && addr >= (unsigned long)t->stack_guard
+				&& addr < (unsigned long)t->stack_guard + PAGE_SIZE) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+void thread_get_stats(thread_t t, thread_stats_t *stats)
+{
+	long istate = interrupts_disable();
+	cpu_t *cpu = thread_cpu_lock(t);
+	thread_stats_fill(t, stats);
+	spin_unlock(&cpu->lock);
+	interrupts_restore(istate);
+}
+
+/* Fills in up to max entries and returns how many threads there are, so the
+ * caller can retry with a bigger buffer */
+int thread_get_all_stats(thread_stats_t *stats, int max)
+{
+	link_t *link;
+	thread_t t;
+	cpu_t *cpu;
+	int n = 0;
+	long istate = spin_lock_irqsave(&threads_lock);
+	
+	for(link = all_threads.next; link != &all_threads; link = link->next, n++) {
+		if(n >= max) {
+			continue;
+		}
+		t = list_get_instance(link, real_thread_t, global_link);
+		cpu = thread_cpu_lock(t);
+		thread_stats_fill(t, &stats[n]);
+		spin_unlock(&cpu->lock);
+	}
+	spin_unlock_irqrestore(&threads_lock, istate);
+	return n;
+}
+
+/* top
+ *
+ * Dumps every thread's accounting over serial, with the share of the CPU it
+ * has had since the previous dump. thread_top_every runs the dump from its
+ * own thread, so it never holds anything up but itself. */
+
+static unsigned long long top_last = 0;
+/* Protects top_period and top_running */
+static spinlock_t top_lock = SPINLOCK_INITIALIZER;
+static unsigned long long top_period = 0;
+static int top_running = 0;
+
+void thread_top()
+{
+	link_t *link;
+	thread_t t;
+	cpu_t *cpu;
+	thread_stats_t stats;
+	unsigned long long now, elapsed, ran;
+	long istate = spin_lock_irqsave(&threads_lock);
+	
+	now = rdtsc();
+	elapsed = top_last ? now - top_last : 0;
+	top_last = now;
+	dprintf("top: %u cpus, %u Kcycles since last\r\n", cpu_count, (unsigned long)(elapsed >> 10));
+	for(link = all_threads.next; link != &all_threads; link = link->next) {
+		t = list_get_instance(link, real_thread_t, global_link);
+		cpu = thread_cpu_lock(t);
+		thread_stats_fill(t, &stats);
+		ran = stats.run_cycles - t->top_cycles;
+		t->top_cycles = stats.run_cycles;
+		spin_unlock(&cpu->lock);
+		/* No 64-bit printf, so cycles go out in units of 1024 */
+		dprintf("t %d: %c pri %u cpu %u%% run %u blocked %u Kcycles, %u switches, %u wakeups\r\n",
+			stats.id, stats.status == RUNNABLE ? 'R' : (stats.status == BLOCKED ? 'B' : 'X'), stats.priority,
+			elapsed ? (unsigned long)(ran * 100 / elapsed) : 0,
+			(unsigned long)(stats.run_cycles >> 10), (unsigned long)(stats.blocked_cycles >> 10),
+			stats.switches, stats.wakeups);
+	}
+	spin_unlock_irqrestore(&threads_lock, istate);
+}
+
+static void *do_top(void *a)
+{
+	unsigned long long period;
+	long istate;
+	
+	while(1) {
+		istate = spin_lock_irqsave(&top_lock);
+		if((period = top_period) == 0) {
+			top_running = 0;
+			spin_unlock_irqrestore(&top_lock, istate);
+			return NULL;
+		}
+		spin_unlock_irqrestore(&top_lock, istate);
+		
+		thread_sleep_for(period);
+		if(top_period != 0) {
+			thread_top();
+		}
+	}
+}
+
+/* Dump every ns nanoseconds, 0 to stop */
+void thread_top_every(unsigned long long ns)
+{
+	thread_t thread;
+	int start;
+	
+	long istate = spin_lock_irqsave(&top_lock);
+	top_period = ns;
+	start = ns != 0 && !top_running;
+	if(start) {
+		top_running = 1;
+	}
+	spin_unlock_irqrestore(&top_lock, istate);
+	if(start && thread_create(&thread, do_top, NULL) != 0) {
+		istate = spin_lock_irqsave(&top_lock);
+		top_running = 0;
+		spin_unlock_irqrestore(&top_lock, istate);
+	}
+}
+
+static unsigned long *stack_alloc_guarded(size_t size, void **guard)
+{
+	*guard = memalign(PAGE_SIZE, size + PAGE_SIZE);
+	if(*guard == NULL) {
+		return NULL;
+	}
+	page_set_present((unsigned long)*guard, 0);
+	return (unsigned long *)((char *)*guard + PAGE_SIZE);
+}
+
+static void stack_free_guarded(void *guard)
+{
+	page_set_present((unsigned long)guard, 1);
+	free(guard);
+}
 
 static void thread_entry_trampoline(void *(*closure)(void *), void *arg)
 {
+	/* First time on this stack, finish what schedule started */
+	finish_switch();
 	interrupts_enable();
 	thread_exit(closure(arg));
 }
 
-void thread_create(thread_t *thread, void *(*closure)(void *), void *arg) {
-	*thread = malloc(sizeof(real_thread_t));
-	(*thread)->id = next_id++;
-	(*thread)->status = RUNNABLE;
+int thread_create(thread_t *thread, void *(*closure)(void *), void *arg) {
+	return thread_create_ex(thread, closure, arg, STACK_SIZE);
+}
+
+int thread_create_ex(thread_t *thread, void *(*closure)(void *), void *arg, size_t stack_size) {
+	stack_size = stack_round(stack_size);
+	
+	*thread = slab_alloc(thread_cache);
+	if(*thread == NULL) {
+		return -1;
+	}
+	(*thread)->id = atomic_fetch_add(&next_id, 1);
+	/* make_runnable below puts it on the queue */
+	(*thread)->status = BLOCKED;
 	(*thread)->slot = NULL;
-	(*thread)->stack = (unsigned long *)malloc(STACK_SIZE * sizeof(unsigned long));
-	(*thread)->esp = (*thread)->stack + STACK_SIZE;
+	(*thread)->malloc_tag = 0;
+	(*thread)->quantum = thread_quantum;
+	(*thread)->preempt_count = 0;
+	(*thread)->priority = PRIORITY_DEFAULT;
+	(*thread)->base_priority = PRIORITY_DEFAULT;
+	list_initialize(&(*thread)->held_mutexes);
+	(*thread)->blocked_on = NULL;
+	(*thread)->blocked_node = NULL;
+	(*thread)->fpu_valid = 0;
+	(*thread)->on_cpu = 0;
+	(*thread)->on_rq = 0;
+	thread_stats_init(*thread);
+	if(stack_guards) {
+		/* Guard page wants the stack page aligned, round to whole pages */
+		stack_size = (stack_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+		(*thread)->stack = stack_alloc_guarded(stack_size, &(*thread)->stack_guard);
+	} else {
+		(*thread)->stack = stack_alloc(stack_size);
+		(*thread)->stack_guard = NULL;
+	}
+	if((*thread)->stack == NULL) {
+		slab_free(thread_cache, *thread);
+		*thread = NULL;
+		return -1;
+	}
+	(*thread)->stack_size = stack_size;
+	(*thread)->esp = (*thread)->stack + stack_size / sizeof(unsigned long);
 	
-	memset((*thread)->stack, 0, STACK_SIZE * sizeof(unsigned long));
+	(*thread)->stack_painted = stack_watermarks;
+	if(stack_watermarks) {
+		unsigned long *p;
+		for(p = (*thread)->stack; p < (*thread)->esp; p++) {
+			*p = STACK_CANARY;
+		}
+	}
 	
 	link_initialize(&(*thread)->run_link);
 	link_initialize(&(*thread)->global_link);
@@ -153,72 +899,362 @@ void thread_create(thread_t *thread, void *(*closure)(void *), void *arg) {
 	*--(*thread)->esp = 0;                                       /* EDI */
 	
 	long istate = interrupts_disable();
+	/* Start out on the creating CPU, others will steal it if they're idle */
+	(*thread)->cpu = this_cpu();
+	spin_lock(&threads_lock);
 	list_append(&(*thread)->global_link, &all_threads);
-	list_append(&(*thread)->run_link, &run_queue);
+	spin_unlock(&threads_lock);
+	make_runnable(*thread);
 	interrupts_restore(istate);
 #ifdef DEBUG_THREADS
 	dprintf("t %d:%x:%x created\r\n", (*thread)->id, (*thread)->stack, thread);
 #endif
+	return 0;
 }
 
+/* current is only meaningful while we can't migrate, so every access from
+ * thread context is made with interrupts disabled */
+
 thread_t thread_self() {
-	return current;
+	long istate = interrupts_disable();
+	thread_t self = current;
+	interrupts_restore(istate);
+	return self;
 }
 
 void thread_setspecific(void *data) {
+	long istate = interrupts_disable();
 	current->slot = data;
+	interrupts_restore(istate);
 }
 
 void *thread_getspecific() {
-	return current->slot;
+	long istate = interrupts_disable();
+	void *data = current->slot;
+	interrupts_restore(istate);
+	return data;
 }
 
 void thread_sleep()
 {
+	long istate = interrupts_disable();
 	dprintf("thread %d sleeping\r\n", current->id);
 	current->status = BLOCKED;
 	schedule();
+	interrupts_restore(istate);
 }
 
 void thread_wake(thread_t t)
 {
+	long istate = interrupts_disable();
 	dprintf("thread %d being woken up by %d\r\n", t->id, current->id);
-	t->status = RUNNABLE;
-	list_append(&t->run_link, &run_queue);
+	make_runnable(t);
+	interrupts_restore(istate);
+}
+
+static void thread_timeout_wake(void *arg)
+{
+	make_runnable(arg);
+}
+
+/* Block for at least ns nanoseconds, or until thread_wake. The thread sits
+ * on the timer wheel in the meantime, it isn't polled */
+void thread_sleep_for(unsigned long long ns)
+{
+	timeout_t timeout;
+	
+	/* timer_ns_to_ticks needs timer_hz */
+	timer_ensure_started();
+	long istate = interrupts_disable();
+	timeout_init(&timeout, thread_timeout_wake, current);
+	current->status = BLOCKED;
+	timeout_add(&timeout, timer_ticks + timer_ns_to_ticks(ns));
+	schedule();
+	/* Woken early, or make sure the wheel is done with timeout */
+	timeout_cancel(&timeout);
+	interrupts_restore(istate);
+}
+
+/* The priority the thread was given, not counting anything it inherited */
+int thread_get_priority(thread_t t)
+{
+	return t->base_priority;
+}
+
+/* Change the priority the scheduler sees, moving the thread between run
+ * queues if it's on one. Called with interrupts disabled; doesn't reschedule
+ * this CPU, but flags it if it should */
+static void set_effective_priority(thread_t t, unsigned long priority)
+{
+	cpu_t *cpu;
+	int kick = 0;
+	
+	cpu = thread_cpu_lock(t);
+	assert(t != cpu->idle);
+	if(t->on_rq) {
+		/* Move it to the queue for its new level */
+		run_queue_remove(cpu, t);
+		t->priority = priority;
+		run_queue_append(cpu, t);
+	} else {
+		t->priority = priority;
+	}
+	
+	/* Give way straight away if the thread running there is no longer the
+	 * most urgent one */
+	if(cpu->running != cpu->idle && run_queue_top(cpu) > (int)cpu->running->priority) {
+		cpu->need_resched = 1;
+		kick = cpu != this_cpu();
+	}
+	spin_unlock(&cpu->lock);
+	if(kick) {
+		smp_send_ipi(cpu, IPI_RESCHED);
+	}
+}
+
+static unsigned long inherited_priority(thread_t t);
+static void mutex_requeue(thread_t t, unsigned long old);
+
+void thread_set_priority(thread_t t, int priority)
+{
+	unsigned long old, effective = priority;
+	
+	assert(priority >= PRIORITY_MIN && priority <= PRIORITY_MAX);
+	
+	long istate = interrupts_disable();
+	old = t->base_priority;
+	t->base_priority = priority;
+	if(t == current) {
+		effective = inherited_priority(t);
+	} else if(t->priority != old && (int)t->priority > priority) {
+		/* Only the thread itself may walk its held mutexes, so a boost
+		 * above the new level stays until it unlocks */
+		effective = t->priority;
+	}
+	old = t->priority;
+	set_effective_priority(t, effective);
+	if(effective != old && t->blocked_on != NULL) {
+		mutex_requeue(t, old);
+	}
+	thread_resched();
+	interrupts_restore(istate);
+}
+
+/* Preemption
+ *
+ * timer_tick calls thread_tick from the irq0 stub with interrupts off, and
+ * on the other CPUs the IPI_TICK handler does the same. When the running
+ * thread has used up its quantum it is switched out right there, on top of
+ * its interrupt frame; the iret happens when it is next scheduled.
+ *
+ * Sections run with interrupts disabled can never be preempted. Code that
+ * must not be switched out but may take interrupts (anything touching the
+ * OCaml heap from a thread other than the one running caml_startup, for
+ * instance) brackets itself with thread_preempt_disable/enable. */
+
+void thread_preempt_init(unsigned int hz, unsigned int quantum) {
+	long istate = interrupts_disable();
+	/* thread_init must have run, the tick needs a current thread */
+	assert(current != NULL);
+	
+	thread_quantum = quantum;
+	current->quantum = quantum;
+	interrupts_restore(istate);
+	timer_init(hz);
+}
+
+void thread_preempt_disable() {
+	long istate = interrupts_disable();
+	current->preempt_count++;
+	interrupts_restore(istate);
+}
+
+void thread_preempt_enable() {
+	long istate = interrupts_disable();
+	assert(current->preempt_count > 0);
+	if(--current->preempt_count == 0) {
+		thread_resched();
+	}
+	interrupts_restore(istate);
+}
+
+/* Switch now if this CPU has been asked to and the running thread allows it.
+ * Called with interrupts disabled, from the tick, the IPI_RESCHED handler and
+ * the exit of the other IRQ stubs as well as thread context */
+void thread_resched() {
+	cpu_t *cpu = this_cpu();
+	
+	if(cpu->need_resched && cpu->running != cpu->idle && cpu->running->preempt_count == 0) {
+		schedule();
+	}
+}
+
+void thread_tick() {
+	cpu_t *cpu = this_cpu();
+	real_thread_t *thread = cpu->running;
+	
+	vmm_tlb_sync();
+	
+	if(thread == NULL || thread == cpu->idle) {
+		/* Idle yields by itself once the hlt returns */
+		return;
+	}
+	
+	spin_lock(&cpu->lock);
+	/* Without time slicing only priority preempts */
+	if(thread_quantum != 0 && thread->quantum > 0) {
+		thread->quantum--;
+	}
+	if(thread_quantum != 0 && thread->quantum == 0 && cpu->ready_bitmap != 0) {
+		/* Slice used up and someone else can run */
+		cpu->need_resched = 1;
+	} else if(run_queue_top(cpu) > (int)thread->priority) {
+		/* A more urgent thread was woken since the last tick */
+		cpu->need_resched = 1;
+	}
+	spin_unlock(&cpu->lock);
+	
+	thread_resched();
+}
+
+/* Entry point of the application processors once smp_init has brought them
+ * up, with interrupts disabled and on the stack smp_init gave them. That
+ * stack becomes the CPU's idle thread, the way the boot stack is the kernel
+ * thread's */
+void thread_cpu_start(cpu_t *cpu)
+{
+	real_thread_t *idle = slab_alloc(thread_cache);
+	
+	idle->id = atomic_fetch_add(&next_id, 1);
+	idle->status = RUNNABLE;
+	idle->slot = NULL;
+	idle->malloc_tag = 0;
+	idle->quantum = 0;
+	idle->preempt_count = 0;
+	idle->priority = PRIORITY_MIN;
+	idle->base_priority = PRIORITY_MIN;
+	list_initialize(&idle->held_mutexes);
+	idle->blocked_on = NULL;
+	idle->blocked_node = NULL;
+	idle->fpu_valid = 0;
+	idle->stack = NULL;
+	idle->stack_size = 0;
+	idle->stack_guard = NULL;
+	idle->stack_painted = 0;
+	idle->cpu = cpu;
+	idle->on_cpu = 1;
+	idle->on_rq = 0;
+	thread_stats_init(idle);
+	link_initialize(&idle->run_link);
+	link_initialize(&idle->global_link);
+	
+	spin_lock(&threads_lock);
+	list_append(&idle->global_link, &all_threads);
+	spin_unlock(&threads_lock);
+	
+	fpu_init();
+	spin_lock(&cpu->lock);
+	/* ap_boot did fninit, but that state belongs to nobody */
+	cpu->fpu_owner = NULL;
+	cpu->running = idle;
+	cpu->idle = idle;
+	spin_unlock(&cpu->lock);
+	cpu->online = 1;
+	
+	interrupts_enable();
+	do_idle(NULL);
+	/* Can't reach here */
+	assert(0);
 }
 
 static void *do_idle(void *a)
 {
 	while(1) {
+		/* Halted CPUs don't tick, vmm.c wakes them to catch up */
+		interrupts_disable();
+		vmm_tlb_sync();
+		interrupts_enable();
 		thread_yield();
-		asm volatile("hlt");
+		/* Only halt if nothing turned up in the meantime, sti's one
+		 * instruction delay means a wakeup can't slip in before the hlt */
+		interrupts_disable();
+		if(this_cpu()->nr_ready == 0) {
+			if(this_cpu() == &cpus[0] && smp_all_idle()) {
+				/* Nobody to preempt, only wake for timeouts */
+				timer_idle();
+			} else {
+				asm volatile("sti; hlt");
+			}
+		} else {
+			interrupts_enable();
+		}
 	}
 }
 
 static void *do_reaper(void *a)
 {
 	thread_t thread;
+	unsigned int i;
 	
 	interrupts_disable();
 	
 	while(1) {
+		spin_lock(&zombie_lock);
 		while(!list_empty(&zombie_list)) {
 			/* kill each thread off */
 			thread = list_get_instance(zombie_list.next, real_thread_t, run_link);
 			list_remove(&thread->run_link);
+			spin_unlock(&zombie_lock);
+			
+			spin_lock(&threads_lock);
 			list_remove(&thread->global_link);
-			free(thread->stack);
-			free(thread);
+			spin_unlock(&threads_lock);
+			for(i = 0; i < cpu_count; i++) {
+				spin_lock(&cpus[i].lock);
+				if(cpus[i].fpu_owner == thread) {
+					/* Nobody will want that state back */
+					cpus[i].fpu_owner = NULL;
+				}
+				spin_unlock(&cpus[i].lock);
+			}
+			if(thread->stack_guard != NULL) {
+				stack_free_guarded(thread->stack_guard);
+			} else {
+				stack_release(thread->stack, thread->stack_size);
+			}
+			slab_free(thread_cache, thread);
+			spin_lock(&zombie_lock);
 		}
-		/* Now sleep */
+		/* Now sleep. Blocking before dropping zombie_lock means
+		 * finish_switch's wakeup can't be lost */
 		current->status = BLOCKED;
+		spin_unlock(&zombie_lock);
 		schedule();
 	}
 }
 
 /* thread synchronisation primitives */
 
-static void wait_on(link_t *head)
+/* All of these are called with interrupts disabled and the lock protecting
+ * the waitqueue held. wait_on drops it */
+
+/* Queue node at the back, or with by_priority, behind every waiter at least
+ * as urgent */
+static void waitqueue_insert(link_t *head, waitqueue_node_t volatile *node, int by_priority)
+{
+	link_t *link = head;
+	
+	if(by_priority) {
+		for(link = head->next; link != head; link = link->next) {
+			if((list_get_instance(link, waitqueue_node_t, link))->thread->priority < node->thread->priority) {
+				break;
+			}
+		}
+	}
+	list_insert_prev((link_t *)&node->link, link);
+}
+
+static void wait_on_queue(link_t *head, spinlock_t *lock, int by_priority)
 {
 	waitqueue_node_t volatile node;
 	
@@ -227,55 +1263,416 @@ static void wait_on(link_t *head)
 	node.thread = current;
 	
 	/* Add to waiting threads list */
-	list_append((link_t *)&node.link, head);
+	waitqueue_insert(head, &node, by_priority);
+	if(by_priority) {
+		current->blocked_node = (waitqueue_node_t *)&node;
+	}
+	
+	/* Sleep. The waker can only find us once the lock is dropped, and by
+	 * then we are BLOCKED, so make_runnable won't miss us */
+	current->status = BLOCKED;
+	spin_unlock(lock);
+	schedule();
+}
+
+static void wait_on(link_t *head, spinlock_t *lock)
+{
+	wait_on_queue(head, lock, 0);
+}
+
+/* What the wheel needs to pull a waiter off its queue */
+struct wait_timeout {
+	waitqueue_node_t volatile *node;
+	spinlock_t *lock;
+	int expired;
+};
+
+static void wait_timeout_expired(void *arg)
+{
+	struct wait_timeout *wt = arg;
+	thread_t thread;
+	
+	spin_lock(wt->lock);
+	if(wt->node->link.next != NULL) {
+		/* Still queued, so nobody woke it first */
+		thread = wt->node->thread;
+		list_remove((link_t *)&wt->node->link);
+		wt->expired = 1;
+		make_runnable(thread);
+	}
+	spin_unlock(wt->lock);
+}
+
+/* wait_on_queue with a deadline in ticks. Returns -1 if it passed before we
+ * were woken, 0 otherwise */
+static int wait_on_until(link_t *head, spinlock_t *lock, unsigned long long deadline, int by_priority)
+{
+	waitqueue_node_t volatile node;
+	struct wait_timeout wt;
+	timeout_t timeout;
+	
+	if(timer_ticks >= deadline) {
+		spin_unlock(lock);
+		return -1;
+	}
+	
+	link_initialize((link_t *)&node.link);
+	node.thread = current;
+	waitqueue_insert(head, &node, by_priority);
+	if(by_priority) {
+		current->blocked_node = (waitqueue_node_t *)&node;
+	}
+	
+	wt.node = &node;
+	wt.lock = lock;
+	wt.expired = 0;
+	timeout_init(&timeout, wait_timeout_expired, &wt);
+	timeout_add(&timeout, deadline);
 	
-	/* Sleep */
 	current->status = BLOCKED;
+	spin_unlock(lock);
 	schedule();
+	/* node, wt and timeout are on our stack, make sure the wheel is done */
+	timeout_cancel(&timeout);
+	return wt.expired ? -1 : 0;
 }
 
-static void wake_first(link_t *head)
+/* Returns the number of threads woken */
+static int wake_first(link_t *head)
 {
 	waitqueue_node_t *node;
+	thread_t thread;
 	
 	if(list_empty(head)) {
-		return;
+		return 0;
 	}
 	
 	/* Take the first node off the list */
 	node = list_get_instance(head->next, waitqueue_node_t, link);
 	list_remove(&node->link);
+	/* node lives on the waiter's stack, don't touch it once it's woken */
+	thread = node->thread;
 	
 	/* And wake up that thread */
-	assert(node->thread->status == BLOCKED);
-	node->thread->status = RUNNABLE;
-	list_append(&node->thread->run_link, &run_queue);
+	assert(thread->status == BLOCKED);
 #ifdef DEBUG_THREADS	
-	dprintf("w %x woke thread %d\r\n", (long)head, node->thread->id);
+	dprintf("w %x woke thread %d\r\n", (long)head, thread->id);
 #endif
+	make_runnable(thread);
+	return 1;
 }
 
-static void wake_all(link_t *head)
+static int wake_all(link_t *head)
 {
 	waitqueue_node_t *node;
+	thread_t thread;
+	int woken = 0;
 	
 	/* Iterate over and remove every node */
 	while(!list_empty(head)) {
 		/* Take the first node off the list */
 		node = list_get_instance(head->next, waitqueue_node_t, link);
 		list_remove(&node->link);
+		thread = node->thread;
 		
 		/* And wake up that thread */
-		assert(node->thread->status == BLOCKED);
-		node->thread->status = RUNNABLE;
-		list_append(&node->thread->run_link, &run_queue);
+		assert(thread->status == BLOCKED);
+		make_runnable(thread);
+		woken++;
+	}
+	return woken;
+}
+
+/* Lock profiling
+ *
+ * With thread_lock_profiling on, every mutex and cond keeps a lock_stats_t
+ * (see threads.h), timed with rdtsc rather than printed as it happens, so
+ * gathering it barely disturbs what it measures. Stats are updated under
+ * the lock they describe. thread_lock_report dumps them on demand. */
+
+static int lock_profiling = 0;
+static spinlock_t lock_stats_lock = SPINLOCK_INITIALIZER;
+static LIST_INITIALIZE(lock_stats_list);
+
+void thread_lock_profiling(int enable)
+{
+	lock_profiling = enable;
+}
+
+static void lock_stats_init(lock_stats_t *stats, char type, unsigned long id)
+{
+	stats->type = type;
+	stats->id = id;
+	stats->acquisitions = 0;
+	stats->contended = 0;
+	stats->wait_cycles = 0;
+	stats->wait_max = 0;
+	stats->hold_cycles = 0;
+	stats->hold_max = 0;
+	stats->acquired_at = 0;
+	link_initialize(&stats->link);
+	
+	long istate = spin_lock_irqsave(&lock_stats_lock);
+	list_append(&stats->link, &lock_stats_list);
+	spin_unlock_irqrestore(&lock_stats_lock, istate);
+}
+
+static void lock_stats_destroy(lock_stats_t *stats)
+{
+	long istate = spin_lock_irqsave(&lock_stats_lock);
+	list_remove(&stats->link);
+	spin_unlock_irqrestore(&lock_stats_lock, istate);
+}
+
+/* Count an acquisition or wait that blocked since start, 0 if it didn't */
+static void lock_stats_acquired(lock_stats_t *stats, unsigned long long start)
+{
+	unsigned long long now = rdtsc();
+	unsigned long long wait;
+	
+	stats->acquisitions++;
+	if(start != 0) {
+		wait = now - start;
+		stats->contended++;
+		stats->wait_cycles += wait;
+		if(wait > stats->wait_max) {
+			stats->wait_max = wait;
+		}
+	}
+	stats->acquired_at = now;
+}
+
+static void lock_stats_released(lock_stats_t *stats)
+{
+	unsigned long long hold;
+	
+	if(stats->acquired_at == 0) {
+		/* Taken before profiling was turned on */
+		return;
+	}
+	hold = rdtsc() - stats->acquired_at;
+	stats->hold_cycles += hold;
+	if(hold > stats->hold_max) {
+		stats->hold_max = hold;
+	}
+	stats->acquired_at = 0;
+}
+
+void thread_lock_report()
+{
+	link_t *link;
+	lock_stats_t *stats;
+	long istate = spin_lock_irqsave(&lock_stats_lock);
+	
+	for(link = lock_stats_list.next; link != &lock_stats_list; link = link->next) {
+		stats = list_get_instance(link, lock_stats_t, link);
+		if(stats->acquisitions == 0) {
+			continue;
+		}
+		/* No 64-bit printf, so cycles go out in units of 1024 */
+		if(stats->type == 'm') {
+			dprintf("m %d: %u acquired, %u contended, wait %u/%u, hold %u/%u Kcycles total/max\r\n",
+				stats->id, stats->acquisitions, stats->contended,
+				(unsigned long)(stats->wait_cycles >> 10), (unsigned long)(stats->wait_max >> 10),
+				(unsigned long)(stats->hold_cycles >> 10), (unsigned long)(stats->hold_max >> 10));
+		} else {
+			dprintf("c %d: %u waits, %u woken, wait %u/%u Kcycles total/max\r\n",
+				stats->id, stats->acquisitions, stats->contended,
+				(unsigned long)(stats->wait_cycles >> 10), (unsigned long)(stats->wait_max >> 10));
+		}
+	}
+	spin_unlock_irqrestore(&lock_stats_lock, istate);
+}
+
+void thread_lock_reset()
+{
+	link_t *link;
+	lock_stats_t *stats;
+	long istate = spin_lock_irqsave(&lock_stats_lock);
+	
+	for(link = lock_stats_list.next; link != &lock_stats_list; link = link->next) {
+		stats = list_get_instance(link, lock_stats_t, link);
+		stats->acquisitions = 0;
+		stats->contended = 0;
+		stats->wait_cycles = 0;
+		stats->wait_max = 0;
+		stats->hold_cycles = 0;
+		stats->hold_max = 0;
+	}
+	spin_unlock_irqrestore(&lock_stats_lock, istate);
+}
+
+/* Priority inheritance
+ *
+ * Mutex waiters queue in priority order, and a thread blocking on a mutex
+ * lends its priority to the owner, and on to whatever that owner is itself
+ * blocked on, so a low priority thread holding a lock a high priority one
+ * needs can't be held off by everything in between. On unlock the owner
+ * drops back to the highest of its base priority and the first waiters of
+ * the mutexes it still holds. A waiter that times out leaves its boost in
+ * place until the owner unlocks. thread_set_priority on a waiter moves it
+ * in the queue, and a raise is passed on along the chain as on blocking.
+ *
+ * Each step along a chain only tries the next mutex's lock, so the walk
+ * never waits with a lock held; if it can't get one the chain is boosted
+ * that far only. */
+
+/* Longest chain of owners to walk */
+#define PI_MAX_DEPTH 8
+
+/* Called with mutex->lock held and interrupts disabled */
+static void mutex_boost(mutex_t *mutex, unsigned long priority)
+{
+	mutex_t *next, *locked = NULL;
+	thread_t owner;
+	waitqueue_node_t *node;
+	int depth;
+	
+	for(depth = 0; depth < PI_MAX_DEPTH; depth++) {
+		owner = mutex->owner;
+		if(owner == NULL || owner->priority >= priority) {
+			break;
+		}
+		set_effective_priority(owner, priority);
+		
+		next = owner->blocked_on;
+		if(next == NULL || !spin_trylock(&next->lock)) {
+			break;
+		}
+		if(locked != NULL) {
+			spin_unlock(&locked->lock);
+		}
+		locked = next;
+		/* Move the owner up the queue it's in, if it's still in it */
+		node = owner->blocked_node;
+		if(owner->blocked_on == next && node != NULL && node->link.next != NULL) {
+			list_remove(&node->link);
+			waitqueue_insert(&next->waitqueue_head, node, 1);
+			if(priority > next->waiter_priority) {
+				next->waiter_priority = priority;
+			}
+		}
+		mutex = next;
+	}
+	if(locked != NULL) {
+		spin_unlock(&locked->lock);
+	}
+}
+
+/* t, blocked on a mutex, has gone from priority old to its current one:
+ * move it to its new place in the wait queue, and if it went up lend that
+ * to the owner and on along the chain. Called with interrupts disabled and
+ * no mutex lock held */
+static void mutex_requeue(thread_t t, unsigned long old)
+{
+	mutex_t *mutex = t->blocked_on;
+	waitqueue_node_t *node;
+	
+	if(mutex == NULL) {
+		return;
+	}
+	spin_lock(&mutex->lock);
+	/* It may have been woken, or timed out, since we looked */
+	node = t->blocked_node;
+	if(t->blocked_on != mutex || node == NULL || node->link.next == NULL) {
+		spin_unlock(&mutex->lock);
+		return;
+	}
+	list_remove(&node->link);
+	waitqueue_insert(&mutex->waitqueue_head, node, 1);
+	if(t->priority > old) {
+		if(t->priority > mutex->waiter_priority) {
+			mutex->waiter_priority = t->priority;
+		}
+		mutex_boost(mutex, t->priority);
+	}
+	spin_unlock(&mutex->lock);
+}
+
+/* Block on mutex, lending it our priority, until woken or the deadline (in
+ * ticks, 0 for none) passes. Called with mutex->lock held and returns with
+ * it held again; returns -1 on timeout */
+static int mutex_wait(mutex_t *mutex, unsigned long long deadline)
+{
+	int retcode = 0;
+	
+	current->blocked_on = mutex;
+	if(current->priority > mutex->waiter_priority) {
+		mutex->waiter_priority = current->priority;
+	}
+	mutex_boost(mutex, current->priority);
+	if(deadline != 0) {
+		retcode = wait_on_until(&mutex->waitqueue_head, &mutex->lock, deadline, 1);
+	} else {
+		wait_on_queue(&mutex->waitqueue_head, &mutex->lock, 1);
+	}
+	spin_lock(&mutex->lock);
+	current->blocked_on = NULL;
+	current->blocked_node = NULL;
+	return retcode;
+}
+
+/* Called with mutex->lock held once it is free */
+static void mutex_acquired(mutex_t *mutex, unsigned long long start)
+{
+	mutex->owner = current;
+	list_append(&mutex->held_link, &current->held_mutexes);
+	/* Anyone still waiting lends us their priority */
+	if(mutex->waiter_priority > current->priority) {
+		set_effective_priority(current, mutex->waiter_priority);
+	}
+	if(lock_profiling) {
+		lock_stats_acquired(&mutex->stats, start);
+	}
+}
+
+/* Base priority, or more if a mutex t holds has a more urgent waiter. Only
+ * for the current thread, nobody else touches held_mutexes */
+static unsigned long inherited_priority(thread_t t)
+{
+	link_t *link;
+	mutex_t *held;
+	unsigned long priority = t->base_priority;
+	
+	for(link = t->held_mutexes.next; link != &t->held_mutexes; link = link->next) {
+		held = list_get_instance(link, mutex_t, held_link);
+		if(held->waiter_priority > priority) {
+			priority = held->waiter_priority;
+		}
+	}
+	return priority;
+}
+
+/* Called with mutex->lock held, by the owner */
+static void mutex_released(mutex_t *mutex)
+{
+	unsigned long priority;
+	
+	lock_stats_released(&mutex->stats);
+	list_remove(&mutex->held_link);
+	/* Wake the first thread */
+	wake_first(&mutex->waitqueue_head);
+	mutex->waiter_priority = list_empty(&mutex->waitqueue_head) ? PRIORITY_MIN :
+		(list_get_instance(mutex->waitqueue_head.next, waitqueue_node_t, link))->thread->priority;
+	mutex->owner = NULL;
+	
+	if(current->priority != current->base_priority) {
+		/* Boosted, keep only what the other mutexes we hold lend us */
+		priority = inherited_priority(current);
+		if(current->priority != priority) {
+			set_effective_priority(current, priority);
+		}
 	}
 }
 
 void mutex_init(mutex_t *mutex) {
+	spin_init(&mutex->lock);
 	list_initialize(&mutex->waitqueue_head);
 	mutex->owner = NULL;
-	mutex->id = next_id++;
+	link_initialize(&mutex->held_link);
+	mutex->waiter_priority = PRIORITY_MIN;
+	mutex->id = atomic_fetch_add(&next_id, 1);
+	lock_stats_init(&mutex->stats, 'm', mutex->id);
 #ifdef DEBUG_THREADS
 	dprintf("m %d:%d %x init\r\n", mutex->id, current->id, (long)mutex);
 #endif
@@ -287,10 +1684,12 @@ void mutex_destroy(mutex_t *mutex) {
 #endif
 	/* Should not be anything waiting */
 	assert(list_empty(&mutex->waitqueue_head));
+	lock_stats_destroy(&mutex->stats);
 }
 
 void mutex_lock(mutex_t *mutex) {
-	long istate = interrupts_disable();
+	unsigned long long start = 0;
+	long istate = spin_lock_irqsave(&mutex->lock);
 #ifdef DEBUG_THREADS
 	dprintf("m %d:%d %x locking\r\n", mutex->id, current->id, (long)mutex);
 #endif
@@ -303,64 +1702,101 @@ void mutex_lock(mutex_t *mutex) {
 #ifdef DEBUG_THREADS
 		dprintf("m %d:%d %x locked by %d\r\n", mutex->id, current->id, mutex->owner->id, (long)mutex);
 #endif
-		wait_on(&mutex->waitqueue_head);
+		if(lock_profiling && start == 0) {
+			start = rdtsc();
+		}
+		mutex_wait(mutex, 0);
 	}
 	
-	mutex->owner = current;
+	mutex_acquired(mutex, start);
 #ifdef DEBUG_THREADS
 	dprintf("m %d:%d %x locked\r\n", mutex->id, current->id, (long)mutex);
 #endif
-	interrupts_restore(istate);
+	spin_unlock_irqrestore(&mutex->lock, istate);
+}
+
+/* mutex_lock giving up after ns nanoseconds. Returns 0 once locked, -1 if
+ * the time ran out first */
+int mutex_timedlock(mutex_t *mutex, unsigned long long ns) {
+	unsigned long long deadline, start = 0;
+	
+	timer_ensure_started();
+	deadline = timer_ticks + timer_ns_to_ticks(ns);
+	long istate = spin_lock_irqsave(&mutex->lock);
+	
+	/* Check for recursive locking */
+	assert(mutex->owner != current);
+	
+	while(mutex->owner) {
+		if(lock_profiling && start == 0) {
+			start = rdtsc();
+		}
+		if(mutex_wait(mutex, deadline) != 0) {
+			/* One last look, it may have been freed just as we gave up */
+			if(mutex->owner) {
+				spin_unlock_irqrestore(&mutex->lock, istate);
+				return -1;
+			}
+			break;
+		}
+	}
+	
+	mutex_acquired(mutex, start);
+	spin_unlock_irqrestore(&mutex->lock, istate);
+	return 0;
 }
 
 void mutex_unsafe_lock(mutex_t *mutex) {
-	long istate = interrupts_disable();
+	unsigned long long start = 0;
+	long istate = spin_lock_irqsave(&mutex->lock);
 	while (mutex->owner) {
-		wait_on(&mutex->waitqueue_head);
+		if(lock_profiling && start == 0) {
+			start = rdtsc();
+		}
+		mutex_wait(mutex, 0);
 	}
-	mutex->owner = current;
-	interrupts_restore(istate);
+	mutex_acquired(mutex, start);
+	spin_unlock_irqrestore(&mutex->lock, istate);
 }
 
 void mutex_unlock(mutex_t *mutex) {
-	long istate = interrupts_disable();
+	long istate = spin_lock_irqsave(&mutex->lock);
 	
 	/* Ensure the mutex is locked by us */
 	assert(mutex->owner == current);
 	
-	/* Wake the first thread */
-	wake_first(&mutex->waitqueue_head);
+	mutex_released(mutex);
 #ifdef DEBUG_THREADS
 	dprintf("m %d:%d %x unlocked\r\n", mutex->id, current->id, (long)mutex);
 #endif
-	mutex->owner = NULL;
-	interrupts_restore(istate);
+	spin_unlock_irqrestore(&mutex->lock, istate);
 }
 
 void mutex_unsafe_unlock(mutex_t *mutex) {
-	long istate = interrupts_disable();
-	wake_first(&mutex->waitqueue_head);
-	mutex->owner = NULL;
-	interrupts_restore(istate);
+	long istate = spin_lock_irqsave(&mutex->lock);
+	mutex_released(mutex);
+	spin_unlock_irqrestore(&mutex->lock, istate);
 }
 
 int mutex_trylock(mutex_t *mutex) {
-	long istate = interrupts_disable();
+	long istate = spin_lock_irqsave(&mutex->lock);
 	int retcode = -1;
 	if(mutex->owner == NULL) {
-		mutex->owner = current;
+		mutex_acquired(mutex, 0);
 		retcode = 0;
 	}
 #ifdef DEBUG_THREADS
 	dprintf("m %d:%d %x try lock = %d\r\n", mutex->id, current->id, (long)mutex, retcode);
 #endif
-	interrupts_restore(istate);
+	spin_unlock_irqrestore(&mutex->lock, istate);
 	return retcode;
 }
 
 void cond_init(cond_t *cond) {
+	spin_init(&cond->lock);
 	list_initialize(&cond->waitqueue_head);
-	cond->id = next_id++;
+	cond->id = atomic_fetch_add(&next_id, 1);
+	lock_stats_init(&cond->stats, 'c', cond->id);
 #ifdef DEBUG_THREADS
 	dprintf("c %d:%d init\r\n", cond->id, current->id);
 #endif
@@ -372,6 +1808,7 @@ void cond_destroy(cond_t *cond) {
 #endif
 	/* Should not be anything waiting */
 	assert(list_empty(&cond->waitqueue_head));
+	lock_stats_destroy(&cond->stats);
 }
 
 /* cvar wait:
@@ -381,12 +1818,18 @@ void cond_destroy(cond_t *cond) {
  *   retake mutex */
 void cond_wait(cond_t *cond, mutex_t *mutex) {
 	/* Go atomic */
-	long istate = interrupts_disable();
+	long istate = spin_lock_irqsave(&cond->lock);
 #ifdef DEBUG_THREADS
 	dprintf("c %d:%d waiting\r\n", cond->id, current->id);
 #endif
+	unsigned long long start = lock_profiling ? rdtsc() : 0;
 	mutex_unlock(mutex);
-	wait_on(&cond->waitqueue_head);
+	wait_on(&cond->waitqueue_head, &cond->lock);
+	if(start != 0) {
+		spin_lock(&cond->lock);
+		lock_stats_acquired(&cond->stats, start);
+		spin_unlock(&cond->lock);
+	}
 	mutex_lock(mutex);
 #ifdef DEBUG_THREADS
 	dprintf("c %d:%d resumed\r\n", cond->id, current->id);
@@ -394,20 +1837,239 @@ void cond_wait(cond_t *cond, mutex_t *mutex) {
 	interrupts_restore(istate);
 }
 
+/* cond_wait giving up after ns nanoseconds. The mutex is retaken either
+ * way; returns 0 if signalled, -1 on timeout */
+int cond_timedwait(cond_t *cond, mutex_t *mutex, unsigned long long ns) {
+	unsigned long long deadline;
+	int retcode;
+	
+	timer_ensure_started();
+	deadline = timer_ticks + timer_ns_to_ticks(ns);
+	long istate = spin_lock_irqsave(&cond->lock);
+	unsigned long long start = lock_profiling ? rdtsc() : 0;
+	mutex_unlock(mutex);
+	retcode = wait_on_until(&cond->waitqueue_head, &cond->lock, deadline, 0);
+	if(start != 0) {
+		spin_lock(&cond->lock);
+		lock_stats_acquired(&cond->stats, start);
+		spin_unlock(&cond->lock);
+	}
+	mutex_lock(mutex);
+	interrupts_restore(istate);
+	return retcode;
+}
+
 void cond_signal(cond_t *cond) {
-	long istate = interrupts_disable();
+	long istate = spin_lock_irqsave(&cond->lock);
 #ifdef DEBUG_THREADS
 	dprintf("c %d:%d signalled\r\n", cond->id, current->id);
 #endif
-	wake_first(&cond->waitqueue_head);
-	interrupts_restore(istate);
+	cond->stats.contended += wake_first(&cond->waitqueue_head);
+	spin_unlock_irqrestore(&cond->lock, istate);
 }
 
 void cond_broadcast(cond_t *cond) {
-	long istate = interrupts_disable();
+	long istate = spin_lock_irqsave(&cond->lock);
 #ifdef DEBUG_THREADS
 	dprintf("c %d:%d broadcasted\r\n", cond->id, current->id);
 #endif
-	wake_all(&cond->waitqueue_head);
-	interrupts_restore(istate);
+	cond->stats.contended += wake_all(&cond->waitqueue_head);
+	spin_unlock_irqrestore(&cond->lock, istate);
+}
+
+/* Reader-writer locks
+ *
+ * Any number of readers, or one writer. Writers are preferred: once one is
+ * queued, new readers wait behind it, so a steady stream of readers can't
+ * starve updates. Adaptive: a thread that finds the lock write-held by a
+ * thread running on another CPU polls for a while before going to sleep,
+ * since a short critical section usually ends sooner than a sleep and
+ * wakeup would take. */
+
+/* Iterations of pause before giving up and blocking */
+#define ADAPTIVE_SPINS 1000
+
+/* Called with lock held and interrupts disabled, returns the same way */
+static void spin_on_owner(spinlock_t *lock, thread_t volatile *owner)
+{
+	thread_t t = *owner;
+	int i;
+	
+	if(cpu_count == 1 || t == NULL || !t->on_cpu) {
+		return;
+	}
+	spin_unlock(lock);
+	for(i = 0; i < ADAPTIVE_SPINS && *owner == t && t->on_cpu; i++) {
+		asm volatile("pause");
+	}
+	spin_lock(lock);
+}
+
+void rwlock_init(rwlock_t *rwlock) {
+	spin_init(&rwlock->lock);
+	list_initialize(&rwlock->readers_head);
+	list_initialize(&rwlock->writers_head);
+	rwlock->readers = 0;
+	rwlock->writer = NULL;
+	rwlock->writers_waiting = 0;
+	rwlock->id = atomic_fetch_add(&next_id, 1);
+}
+
+void rwlock_destroy(rwlock_t *rwlock) {
+	/* Should not be held or waited on */
+	assert(rwlock->readers == 0 && rwlock->writer == NULL);
+	assert(list_empty(&rwlock->readers_head) && list_empty(&rwlock->writers_head));
+}
+
+void rwlock_rdlock(rwlock_t *rwlock) {
+	long istate = spin_lock_irqsave(&rwlock->lock);
+	
+	while(rwlock->writer || rwlock->writers_waiting) {
+		spin_on_owner(&rwlock->lock, &rwlock->writer);
+		if(!rwlock->writer && !rwlock->writers_waiting) {
+			break;
+		}
+		wait_on(&rwlock->readers_head, &rwlock->lock);
+		spin_lock(&rwlock->lock);
+	}
+	rwlock->readers++;
+	spin_unlock_irqrestore(&rwlock->lock, istate);
+}
+
+int rwlock_tryrdlock(rwlock_t *rwlock) {
+	long istate = spin_lock_irqsave(&rwlock->lock);
+	int retcode = -1;
+	
+	if(!rwlock->writer && !rwlock->writers_waiting) {
+		rwlock->readers++;
+		retcode = 0;
+	}
+	spin_unlock_irqrestore(&rwlock->lock, istate);
+	return retcode;
+}
+
+void rwlock_wrlock(rwlock_t *rwlock) {
+	long istate = spin_lock_irqsave(&rwlock->lock);
+	
+	/* Check for recursive locking */
+	assert(rwlock->writer != current);
+	
+	rwlock->writers_waiting++;
+	while(rwlock->writer || rwlock->readers) {
+		spin_on_owner(&rwlock->lock, &rwlock->writer);
+		if(!rwlock->writer && !rwlock->readers) {
+			break;
+		}
+		wait_on(&rwlock->writers_head, &rwlock->lock);
+		spin_lock(&rwlock->lock);
+	}
+	rwlock->writers_waiting--;
+	rwlock->writer = current;
+	spin_unlock_irqrestore(&rwlock->lock, istate);
+}
+
+int rwlock_trywrlock(rwlock_t *rwlock) {
+	long istate = spin_lock_irqsave(&rwlock->lock);
+	int retcode = -1;
+	
+	if(!rwlock->writer && !rwlock->readers) {
+		rwlock->writer = current;
+		retcode = 0;
+	}
+	spin_unlock_irqrestore(&rwlock->lock, istate);
+	return retcode;
+}
+
+/* Drops a read or write hold, whichever the caller has */
+void rwlock_unlock(rwlock_t *rwlock) {
+	long istate = spin_lock_irqsave(&rwlock->lock);
+	
+	if(rwlock->writer != NULL) {
+		assert(rwlock->writer == current);
+		rwlock->writer = NULL;
+	} else {
+		assert(rwlock->readers > 0);
+		rwlock->readers--;
+	}
+	
+	if(rwlock->readers == 0) {
+		/* A writer if there is one, otherwise every waiting reader */
+		if(wake_first(&rwlock->writers_head) == 0) {
+			wake_all(&rwlock->readers_head);
+		}
+	}
+	spin_unlock_irqrestore(&rwlock->lock, istate);
+}
+
+/* Counting semaphores */
+
+void sem_init(sem_t *sem, unsigned long count) {
+	spin_init(&sem->lock);
+	list_initialize(&sem->waitqueue_head);
+	sem->count = count;
+	sem->id = atomic_fetch_add(&next_id, 1);
+}
+
+void sem_destroy(sem_t *sem) {
+	/* Should not be anything waiting */
+	assert(list_empty(&sem->waitqueue_head));
+}
+
+void sem_wait(sem_t *sem) {
+	long istate = spin_lock_irqsave(&sem->lock);
+	
+	while(sem->count == 0) {
+		wait_on(&sem->waitqueue_head, &sem->lock);
+		spin_lock(&sem->lock);
+	}
+	sem->count--;
+	spin_unlock_irqrestore(&sem->lock, istate);
+}
+
+int sem_trywait(sem_t *sem) {
+	long istate = spin_lock_irqsave(&sem->lock);
+	int retcode = -1;
+	
+	if(sem->count > 0) {
+		sem->count--;
+		retcode = 0;
+	}
+	spin_unlock_irqrestore(&sem->lock, istate);
+	return retcode;
+}
+
+/* sem_wait giving up after ns nanoseconds. Returns 0 once decremented, -1 if
+ * the time ran out first */
+int sem_timedwait(sem_t *sem, unsigned long long ns) {
+	unsigned long long deadline;
+	
+	timer_ensure_started();
+	deadline = timer_ticks + timer_ns_to_ticks(ns);
+	long istate = spin_lock_irqsave(&sem->lock);
+	
+	while(sem->count == 0) {
+		if(wait_on_until(&sem->waitqueue_head, &sem->lock, deadline, 0) != 0) {
+			spin_lock(&sem->lock);
+			if(sem->count == 0) {
+				spin_unlock_irqrestore(&sem->lock, istate);
+				return -1;
+			}
+			break;
+		}
+		spin_lock(&sem->lock);
+	}
+	sem->count--;
+	spin_unlock_irqrestore(&sem->lock, istate);
+	return 0;
+}
+
+void sem_post(sem_t *sem) {
+	long istate = spin_lock_irqsave(&sem->lock);
+	sem->count++;
+	wake_first(&sem->waitqueue_head);
+	spin_unlock_irqrestore(&sem->lock, istate);
+}
+
+unsigned long sem_getvalue(sem_t *sem) {
+	return sem->count;
 }
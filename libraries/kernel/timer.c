@@ -0,0 +1,377 @@
+#include "timer.h"
+#include "idt.h"
+#include "smp.h"
+#include "ioapic.h"
+#include "irqstat.h"
+
+#include <asm.h>
+#include <threads.h>
+
+/* Number of IRQ0 ticks since timer_init, and the rate they arrive at */
+volatile unsigned long long timer_ticks = 0;
+unsigned int timer_hz = 0;
+/* PIT counts per tick */
+static unsigned int timer_divisor = 0;
+
+/* Program PIT channel 0 as a rate generator firing IRQ0 at hz */
+void timer_init(unsigned int hz) {
+	unsigned int divisor = PIT_FREQUENCY / hz;
+	
+	/* The counter is only 16 bits wide, 0 means 65536 */
+	if (divisor > 0xFFFF) {
+		divisor = 0;
+	} else if (divisor < 1) {
+		divisor = 1;
+	}
+	
+	long istate = interrupts_disable();
+	out8(PIT_COMMAND, 0x34); /* channel 0, lobyte/hibyte, mode 2 */
+	out8(PIT_CHANNEL0, divisor & 0xFF);
+	out8(PIT_CHANNEL0, divisor >> 8);
+	timer_hz = hz;
+	timer_divisor = divisor ? divisor : 0x10000;
+	interrupts_restore(istate);
+}
+
+/* Start the PIT at PREEMPT_HZ if nothing else has. Timeouts call this
+ * before converting to ticks, which needs timer_hz */
+void timer_ensure_started() {
+	if (timer_hz == 0) {
+		timer_init(PREEMPT_HZ);
+	}
+}
+
+/* PIT counts since IRQ0 was last raised, for seeing how late it was taken.
+ * 0 if the PIT isn't ticking periodically. Only meaningful from the IRQ0
+ * path: a tick that was missed altogether can't be told apart */
+unsigned int timer_pit_elapsed() {
+	unsigned int remaining;
+	
+	if (timer_hz == 0 || timer_tick_stopped) {
+		return 0;
+	}
+	out8(PIT_COMMAND, 0x00); /* latch channel 0 */
+	remaining = in8(PIT_CHANNEL0);
+	remaining |= in8(PIT_CHANNEL0) << 8;
+	if (remaining == 0 || remaining > timer_divisor) {
+		return 0;
+	}
+	return timer_divisor - remaining;
+}
+
+/* Ticks to cover at least ns, never 0 */
+unsigned long long timer_ns_to_ticks(unsigned long long ns) {
+	unsigned long long ticks = (ns * timer_hz + 999999999ULL) / 1000000000ULL;
+	return ticks ? ticks : 1;
+}
+
+/* Timer wheel
+ *
+ * Pending timeouts hang off a hierarchical wheel, as in the BSD callout and
+ * Linux timer code. The first level has a slot for each of the next 256
+ * ticks; each of the four levels above it has 64 slots, each covering 64
+ * times as many ticks as a slot of the level below. Adding or cancelling a
+ * timeout is O(1). Every 256 ticks the next slot of the level above is
+ * cascaded down, so a timeout is moved at most once per level before it
+ * fires. Nothing is done for a timeout until then, however many there are.
+ *
+ * The wheel runs from timer_tick on the boot CPU. Timeouts further away than
+ * the wheel reaches (2^32 ticks) are clamped to its far end. */
+
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 4
+
+static spinlock_t timeout_lock = SPINLOCK_INITIALIZER;
+static link_t tv1[TVR_SIZE];
+static link_t tvn[TVN_LEVELS][TVN_SIZE];
+static int wheel_ready = 0;
+/* Next tick the wheel will process */
+static unsigned long long wheel_clock = 0;
+/* Timeout whose function is running, timeout_cancel waits for it */
+static timeout_t * volatile timeout_running = NULL;
+
+static void wheel_init(void) {
+	int i, j;
+	
+	for (i = 0; i < TVR_SIZE; i++) {
+		list_initialize(&tv1[i]);
+	}
+	for (i = 0; i < TVN_LEVELS; i++) {
+		for (j = 0; j < TVN_SIZE; j++) {
+			list_initialize(&tvn[i][j]);
+		}
+	}
+	wheel_clock = timer_ticks;
+	wheel_ready = 1;
+}
+
+/* Called with timeout_lock held */
+static void wheel_insert(timeout_t *t) {
+	unsigned long long delta;
+	link_t *slot;
+	int level;
+	
+	if (t->expires < wheel_clock) {
+		/* Already due, run on the next tick */
+		t->expires = wheel_clock;
+	}
+	delta = t->expires - wheel_clock;
+	if (delta >= (1ULL << (TVR_BITS + TVN_LEVELS * TVN_BITS))) {
+		t->expires = wheel_clock + (1ULL << (TVR_BITS + TVN_LEVELS * TVN_BITS)) - 1;
+		delta = t->expires - wheel_clock;
+	}
+	
+	if (delta < TVR_SIZE) {
+		slot = &tv1[t->expires & TVR_MASK];
+	} else {
+		for (level = 0; delta >= (1ULL << (TVR_BITS + (level + 1) * TVN_BITS)); level++)
+			;
+		slot = &tvn[level][(t->expires >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK];
+	}
+	list_append(&t->link, slot);
+}
+
+/* Re-file everything in one slot of an upper level, returns its index */
+static int wheel_cascade(int level) {
+	int index = (wheel_clock >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+	link_t *slot = &tvn[level][index];
+	timeout_t *t;
+	
+	while (!list_empty(slot)) {
+		t = list_get_instance(slot->next, timeout_t, link);
+		list_remove(&t->link);
+		wheel_insert(t);
+	}
+	return index;
+}
+
+/* Run everything due up to and including now */
+static void wheel_run(unsigned long long now) {
+	timeout_t *t;
+	link_t *slot;
+	int index, level;
+	
+	spin_lock(&timeout_lock);
+	while (wheel_clock <= now) {
+		index = wheel_clock & TVR_MASK;
+		if (index == 0) {
+			for (level = 0; level < TVN_LEVELS && wheel_cascade(level) == 0; level++)
+				;
+		}
+		slot = &tv1[index];
+		wheel_clock++;
+		while (!list_empty(slot)) {
+			t = list_get_instance(slot->next, timeout_t, link);
+			list_remove(&t->link);
+			timeout_running = t;
+			spin_unlock(&timeout_lock);
+			t->func(t->arg);
+			spin_lock(&timeout_lock);
+			timeout_running = NULL;
+		}
+	}
+	spin_unlock(&timeout_lock);
+}
+
+void timeout_init(timeout_t *t, void (*func)(void *), void *arg) {
+	link_initialize(&t->link);
+	t->expires = 0;
+	t->func = func;
+	t->arg = arg;
+}
+
+/* Tick the earliest pending timeout is due at, ~0 if there are none. Anything
+ * on the upper levels counts as due at the next cascade, which is early but
+ * safe: the caller just finds nothing to do and asks again */
+static unsigned long long timeout_next_expiry(void) {
+	unsigned long long next = ~0ULL;
+	unsigned long long boundary = (wheel_clock | TVR_MASK) + 1;
+	unsigned long long tick;
+	int i, j;
+	
+	spin_lock(&timeout_lock);
+	for (tick = wheel_clock; tick < wheel_clock + TVR_SIZE; tick++) {
+		if (!list_empty(&tv1[tick & TVR_MASK])) {
+			next = tick;
+			break;
+		}
+	}
+	if (next > boundary) {
+		for (i = 0; i < TVN_LEVELS; i++) {
+			for (j = 0; j < TVN_SIZE; j++) {
+				if (!list_empty(&tvn[i][j])) {
+					next = boundary;
+					goto out;
+				}
+			}
+		}
+	}
+out:
+	spin_unlock(&timeout_lock);
+	return next;
+}
+
+/* Arm t to fire at tick expires. Starts the PIT if nothing else has */
+void timeout_add(timeout_t *t, unsigned long long expires) {
+	timer_ensure_started();
+	
+	long istate = spin_lock_irqsave(&timeout_lock);
+	if (!wheel_ready) {
+		wheel_init();
+	}
+	if (t->link.next != NULL) {
+		list_remove(&t->link);
+	}
+	t->expires = expires;
+	wheel_insert(t);
+	spin_unlock_irqrestore(&timeout_lock, istate);
+}
+
+/* Disarm t. Returns 1 if it was still pending. When this returns t->func is
+ * not running, so t and anything it refers to can go away */
+int timeout_cancel(timeout_t *t) {
+	int pending = 0;
+	long istate = spin_lock_irqsave(&timeout_lock);
+	
+	if (t->link.next != NULL) {
+		list_remove(&t->link);
+		pending = 1;
+	}
+	while (timeout_running == t) {
+		spin_unlock(&timeout_lock);
+		asm volatile("pause");
+		spin_lock(&timeout_lock);
+	}
+	spin_unlock_irqrestore(&timeout_lock, istate);
+	return pending;
+}
+
+/* Tickless idle
+ *
+ * When every CPU is idle there is nothing to preempt, so the only reason to
+ * take a tick is the next timeout. timer_idle then stops the periodic tick,
+ * programs the PIT in one-shot mode (mode 0) for that deadline, as far as its
+ * 16-bit counter reaches, and halts. Whatever interrupt wakes us up,
+ * timer_ticks is advanced by the time that actually passed, the wheel
+ * catches up and the periodic tick is restarted. */
+
+static int timer_tickless = 0;
+/* The periodic tick is stopped for a one-shot */
+volatile int timer_tick_stopped = 0;
+static unsigned long oneshot_ticks;
+static unsigned long oneshot_count;
+
+void timer_set_tickless(int enable) {
+	timer_tickless = enable;
+}
+
+static void timer_periodic(void) {
+	out8(PIT_COMMAND, 0x34); /* channel 0, lobyte/hibyte, mode 2 */
+	out8(PIT_CHANNEL0, timer_divisor & 0xFF);
+	out8(PIT_CHANNEL0, (timer_divisor >> 8) & 0xFF);
+}
+
+/* Back to periodic ticks after a one-shot, having been asleep for ticks.
+ * Interrupts are disabled */
+static void timer_restart(unsigned long ticks) {
+	timer_tick_stopped = 0;
+	timer_periodic();
+	timer_ticks += ticks;
+}
+
+/* Called by the boot CPU's idle thread, with interrupts disabled, when no
+ * CPU has anything to run. Returns with interrupts enabled after the next
+ * interrupt */
+void timer_idle() {
+	unsigned long long next;
+	unsigned long ticks, count, remaining;
+	
+	if (!timer_tickless || timer_hz == 0 || !wheel_ready) {
+		asm volatile("sti; hlt");
+		return;
+	}
+	
+	next = timeout_next_expiry();
+	if (next <= timer_ticks + 1) {
+		/* Due on the next tick anyway */
+		asm volatile("sti; hlt");
+		return;
+	}
+	ticks = next - timer_ticks > 0x10000 ? 0x10000 : next - timer_ticks;
+	if (ticks * timer_divisor > 0xFFFF) {
+		ticks = 0xFFFF / timer_divisor;
+	}
+	if (ticks <= 1) {
+		/* Ticks are as long as the PIT can count, nothing to gain */
+		asm volatile("sti; hlt");
+		return;
+	}
+	count = ticks * timer_divisor;
+	
+	out8(PIT_COMMAND, 0x30); /* channel 0, lobyte/hibyte, mode 0 */
+	out8(PIT_CHANNEL0, count & 0xFF);
+	out8(PIT_CHANNEL0, count >> 8);
+	oneshot_ticks = ticks;
+	oneshot_count = count;
+	timer_tick_stopped = 1;
+	
+	asm volatile("sti; hlt; cli");
+	
+	if (timer_tick_stopped) {
+		/* Woken by something other than the one-shot, see how far it got */
+		out8(PIT_COMMAND, 0x00); /* latch channel 0 */
+		remaining = in8(PIT_CHANNEL0);
+		remaining |= in8(PIT_CHANNEL0) << 8;
+		if (remaining > count) {
+			/* Wrapped, the IRQ is pending behind cli */
+			remaining = 0;
+		}
+		timer_restart((count - remaining) / timer_divisor);
+		wheel_run(timer_ticks);
+	}
+	interrupts_enable();
+}
+
+/* Called from the irq0 stub after signal_handlers[0] has run, with
+ * interrupts disabled */
+void timer_tick() {
+	if (timer_hz == 0) {
+		/* PIT still at the BIOS rate, nobody asked for ticks */
+		if (irqstat_enabled) {
+			irqstat_irq_exit(0);
+		}
+		return;
+	}
+	if (timer_tick_stopped) {
+		/* The one-shot expired, the final tick is counted below */
+		timer_restart(oneshot_ticks - 1);
+	}
+	timer_ticks++;
+	if (wheel_ready) {
+		wheel_run(timer_ticks);
+	}
+	/* Specific EOI for IRQ0, a no-op if the handler already sent one. The
+	 * handler may have left it to OCaml code, which won't run until the
+	 * interrupted thread is picked again if thread_tick switches away. The
+	 * local APIC only has a non-specific EOI, so check IRQ0 is still the
+	 * one in service before sending it */
+	if (ioapic_enabled) {
+		if (lapic_in_service(MASTER)) {
+			lapic_eoi();
+		}
+	} else {
+		out8(PICM, 0x60);
+	}
+	if (cpu_count > 1) {
+		smp_broadcast_tick();
+	}
+	if (irqstat_enabled) {
+		irqstat_irq_exit(0);
+	}
+	thread_tick();
+}
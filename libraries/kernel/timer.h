@@ -0,0 +1,36 @@
+#ifndef TIMER_HEADER
+#define TIMER_HEADER
+
+/* 8253/8254 programmable interval timer */
+#define PIT_FREQUENCY	1193182
+#define PIT_CHANNEL0	0x40
+#define PIT_COMMAND		0x43
+
+#include <list.h>
+
+extern volatile unsigned long long timer_ticks;
+extern unsigned int timer_hz;
+
+extern void timer_init(unsigned int hz);
+extern void timer_ensure_started();
+extern void timer_tick();
+extern unsigned long long timer_ns_to_ticks(unsigned long long ns);
+extern unsigned int timer_pit_elapsed();
+extern volatile int timer_tick_stopped;
+extern void timer_set_tickless(int enable);
+extern void timer_idle();
+
+/* One-shot callback at an absolute tick count, see the timer wheel in
+ * timer.c. func runs from the timer interrupt with interrupts disabled */
+typedef struct timeout {
+	link_t link;
+	unsigned long long expires;
+	void (*func)(void *);
+	void *arg;
+} timeout_t;
+
+extern void timeout_init(timeout_t *, void (*func)(void *), void *arg);
+extern void timeout_add(timeout_t *, unsigned long long expires);
+extern int timeout_cancel(timeout_t *);
+
+#endif
@@ -0,0 +1,96 @@
+#include <asm.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <threads.h>
+#include <trace.h>
+#include "smp.h"
+#include "timer.h"
+
+volatile int trace_enabled = 0;
+
+/* One ring per CPU, allocated by the first trace_start. heads count every
+ * event written, the slot is the count modulo TRACE_EVENTS */
+static trace_event_t *trace_rings[MAX_CPUS];
+static unsigned long trace_heads[MAX_CPUS];
+
+/* For working out the TSC rate when dumping */
+static unsigned long long trace_start_tsc;
+static unsigned long long trace_start_ticks;
+
+void trace_start()
+{
+	unsigned int i;
+
+	for(i = 0; i < cpu_count; i++) {
+		if(trace_rings[i] == NULL) {
+			trace_rings[i] = malloc(TRACE_EVENTS * sizeof(trace_event_t));
+		}
+		trace_heads[i] = 0;
+	}
+	trace_start_ticks = timer_ticks;
+	trace_start_tsc = rdtsc();
+	trace_enabled = 1;
+}
+
+void trace_stop()
+{
+	trace_enabled = 0;
+}
+
+void trace_record(unsigned long type, unsigned long a, unsigned long b)
+{
+	trace_event_t *event;
+	unsigned int cpu;
+
+	long istate = interrupts_disable();
+	cpu = this_cpu()->index;
+	if(trace_rings[cpu] != NULL) {
+		event = &trace_rings[cpu][trace_heads[cpu]++ & (TRACE_EVENTS - 1)];
+		event->tsc = rdtsc();
+		event->type = type;
+		event->a = a;
+		event->b = b;
+	}
+	interrupts_restore(istate);
+}
+
+/* TSC rate in kHz, measured against the PIT since trace_start. 0 if the
+ * timer isn't running, trace2json then needs to be told */
+static unsigned long trace_khz(void)
+{
+	unsigned long long ms;
+
+	if(timer_hz == 0) {
+		return 0;
+	}
+	ms = (timer_ticks - trace_start_ticks) * 1000 / timer_hz;
+	if(ms == 0) {
+		return 0;
+	}
+	return (rdtsc() - trace_start_tsc) / ms;
+}
+
+/* Events go out oldest first, one CPU after another. No 64-bit printf, so
+ * the TSC is printed as two 32-bit halves */
+void trace_dump()
+{
+	trace_event_t *event;
+	unsigned long i, head;
+	unsigned int cpu;
+
+	trace_stop();
+	dprintf("trace-begin %u\r\n", trace_khz());
+	for(cpu = 0; cpu < cpu_count; cpu++) {
+		if(trace_rings[cpu] == NULL) {
+			continue;
+		}
+		head = trace_heads[cpu];
+		for(i = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0; i < head; i++) {
+			event = &trace_rings[cpu][i & (TRACE_EVENTS - 1)];
+			dprintf("trace %u %u %x %x %u %u\r\n", cpu, event->type,
+				(unsigned long)(event->tsc >> 32), (unsigned long)event->tsc,
+				event->a, event->b);
+		}
+	}
+	dprintf("trace-end\r\n");
+}
@@ -0,0 +1,524 @@
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include <vmm.h>
+#include "paging.h"
+#include "pmm.h"
+#include "idt.h"
+#include "smp.h"
+
+/* Page directory and table entry bits */
+#define PG_PRESENT	0x001
+#define PG_WRITE	0x002
+#define PG_LARGE	0x080
+#define PG_GLOBAL	0x100
+#define PG_FRAME	0xFFFFF000
+
+#define PAGE_SHIFT	12
+#define LARGE_PAGE_SIZE	VMM_LARGE_PAGE_SIZE
+
+/* The window ends where the PCI hole usually starts, the local and IO
+ * APICs and framebuffers above it stay identity mapped */
+#define WINDOW_END	0xC0000000
+
+static unsigned int __attribute__((section(".bss.pagealigned"),used)) page_dir[1024];
+static unsigned int __attribute__((section(".bss.pagealigned"))) first_page_table[1024];
+static unsigned int __attribute__((section(".bss.pagealigned"))) last_page_table[1024];
+
+int paging_enabled = 0;
+
+/* Page tables and the window, protected by vmm_lock */
+static spinlock_t vmm_lock = SPINLOCK_INITIALIZER;
+static unsigned long window_start = 0;
+static unsigned long window_pages = 0;
+/* A bit per window page, set while it's allocated or waiting on TLBs */
+static unsigned long *window_used = NULL;
+/* Freed but maybe still in some CPU's TLB */
+static unsigned long *window_pending = NULL;
+static unsigned long pending_pages = 0;
+/* tlb_gen when the last pending range was freed */
+static unsigned long pending_gen = 0;
+/* Where the next window search starts */
+static unsigned long window_hint = 0;
+static unsigned long page_tables = 0;
+/* A bit per 4MB page handed out by vmm_alloc_large */
+static unsigned long large_used[1024 / 32];
+static unsigned long large_pages = 0;
+
+/* Bumped by every unmap or downgrade, each CPU's cpu_t.tlb_gen says how
+ * far it has caught up */
+static volatile unsigned long tlb_gen = 0;
+
+void paging_init(void)
+{
+	unsigned int i;
+
+	if(paging_enabled) {
+		return;
+	}
+	// build a simple pagedir
+	// very first and last pages are unmapped
+	// everything else has a 1:1 mapping with physical memory using 4MB pages
+	for(i = 1; i < 1024; i++) {
+		first_page_table[i] = (i * 0x1000) | 0x103;
+	}
+	first_page_table[0] = 0;
+	for(i = 1; i < 1024; i++) {
+		last_page_table[i] = (0xFFC00000 + (i * 0x1000)) | 0x103;
+	}
+	last_page_table[1023] = 0;
+	for(i = 1; i < 1023; i++) {
+		page_dir[i] = (i * 0x400000) | 0x183;
+	}
+	page_dir[0] = (unsigned int)first_page_table | 0x103;
+	page_dir[1023] = (unsigned int)last_page_table | 0x103;
+	paging_load();
+	tss_set_cr3((unsigned long)page_dir);
+	paging_enabled = 1;
+}
+
+void paging_load(void)
+{
+	__asm__ volatile(
+		"movl	$page_dir, %%eax\n\t"
+		"mov	%%eax, %%cr3\n\t"
+
+		"movl	%%cr4, %%eax\n\t"
+		"bts	$4, %%eax\n\t"
+		"movl	%%eax, %%cr4\n\t"
+
+		"mov	%%cr0, %%eax\n\t"
+		"bts	$31, %%eax\n\t"
+		"mov	%%eax, %%cr0\n\t" ::: "eax");
+}
+
+// mark a single 4KB page present or not, splitting its 4MB page first if needed
+void page_set_present(unsigned long addr, int present)
+{
+	vmm_protect(addr & ~(PAGE_SIZE - 1), 1, present ? VMM_READ | VMM_WRITE : VMM_NONE);
+}
+
+static inline void flush_tlb(void)
+{
+	unsigned long cr3;
+
+	__asm__ volatile("mov %%cr3, %0\n\tmov %0, %%cr3" : "=r"(cr3) :: "memory");
+}
+
+static inline unsigned int pte_bits(int prot)
+{
+	return (prot != VMM_NONE ? PG_PRESENT : 0) | (prot & VMM_WRITE ? PG_WRITE : 0);
+}
+
+/* The page table covering virt, with vmm_lock held. A 4MB page is split
+ * into 4KB ones mapping the same frames; with create, a missing table is
+ * allocated. NULL if there's no table and none could be made */
+static unsigned int *get_table(unsigned long virt, int create)
+{
+	unsigned int *pde = &page_dir[virt >> 22];
+	unsigned int *table;
+	unsigned long phys;
+	int i;
+
+	if((*pde & PG_PRESENT) && !(*pde & PG_LARGE)) {
+		return (unsigned int *)(*pde & PG_FRAME);
+	}
+	if(!create && !(*pde & PG_LARGE)) {
+		return NULL;
+	}
+	phys = pmm_alloc(1);
+	if(phys == 0) {
+		return NULL;
+	}
+	page_tables++;
+	table = (unsigned int *)phys;
+	if(*pde & PG_LARGE) {
+		for(i = 0; i < 1024; i++) {
+			table[i] = ((*pde & 0xFFC00000) + (i * 0x1000)) | (*pde & (PG_PRESENT | PG_WRITE | PG_GLOBAL));
+		}
+	} else {
+		memset(table, 0, PAGE_SIZE);
+	}
+	*pde = phys | PG_PRESENT | PG_WRITE;
+	return table;
+}
+
+/* After an unmap or downgrade with vmm_lock held: flush here, and let the
+ * other CPUs know at their next tick. Halted ones don't tick, wake them */
+static void shootdown(void)
+{
+	unsigned int i;
+	cpu_t *self = this_cpu();
+
+	tlb_gen++;
+	flush_tlb();
+	self->tlb_gen = tlb_gen;
+	for(i = 0; i < cpu_count; i++) {
+		cpu_t *cpu = &cpus[i];
+		if(cpu != self && cpu->online && cpu->running == cpu->idle) {
+			smp_send_ipi(cpu, IPI_RESCHED);
+		}
+	}
+}
+
+void vmm_tlb_sync()
+{
+	cpu_t *cpu = this_cpu();
+	unsigned long gen = tlb_gen;
+
+	if(cpu->tlb_gen != gen) {
+		flush_tlb();
+		cpu->tlb_gen = gen;
+	}
+}
+
+/* Every online CPU has flushed since gen */
+static int tlb_caught_up(unsigned long gen)
+{
+	unsigned int i;
+
+	for(i = 0; i < cpu_count; i++) {
+		if(cpus[i].online && (long)(cpus[i].tlb_gen - gen) < 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int map_locked(unsigned long virt, unsigned long phys, unsigned long count, int prot)
+{
+	unsigned int *table = NULL;
+	unsigned long i;
+
+	for(i = 0; i < count; i++, virt += PAGE_SIZE, phys += PAGE_SIZE) {
+		if(table == NULL || (virt & (LARGE_PAGE_SIZE - 1)) == 0) {
+			table = get_table(virt, 1);
+			if(table == NULL) {
+				return -1;
+			}
+		}
+		table[(virt >> PAGE_SHIFT) & 1023] = phys | pte_bits(prot);
+	}
+	return 0;
+}
+
+int vmm_map(unsigned long virt, unsigned long phys, unsigned long count, int prot)
+{
+	long istate = spin_lock_irqsave(&vmm_lock);
+	int ret = map_locked(virt, phys, count, prot);
+
+	/* What was there before may be cached anywhere */
+	shootdown();
+	spin_unlock_irqrestore(&vmm_lock, istate);
+	return ret;
+}
+
+/* Unmap count pages at virt, freeing their frames with free_frames. With
+ * vmm_lock held, the caller does the shootdown */
+static void unmap_locked(unsigned long virt, unsigned long count, int free_frames)
+{
+	unsigned int *table = NULL;
+	unsigned long i, phys, run_start = 0, run = 0;
+
+	for(i = 0; i < count; i++, virt += PAGE_SIZE) {
+		if(table == NULL || (virt & (LARGE_PAGE_SIZE - 1)) == 0) {
+			table = get_table(virt, 0);
+		}
+		if(table == NULL || !(table[(virt >> PAGE_SHIFT) & 1023] & PG_PRESENT)) {
+			continue;
+		}
+		phys = table[(virt >> PAGE_SHIFT) & 1023] & PG_FRAME;
+		table[(virt >> PAGE_SHIFT) & 1023] = 0;
+		if(!free_frames) {
+			continue;
+		}
+		/* Free runs of consecutive frames in one go */
+		if(run > 0 && phys == run_start + run * PAGE_SIZE) {
+			run++;
+			continue;
+		}
+		if(run > 0) {
+			pmm_free(run_start, run);
+		}
+		run_start = phys;
+		run = 1;
+	}
+	if(run > 0) {
+		pmm_free(run_start, run);
+	}
+}
+
+void vmm_unmap(unsigned long virt, unsigned long count)
+{
+	long istate = spin_lock_irqsave(&vmm_lock);
+
+	unmap_locked(virt, count, 0);
+	shootdown();
+	spin_unlock_irqrestore(&vmm_lock, istate);
+}
+
+int vmm_protect(unsigned long virt, unsigned long count, int prot)
+{
+	unsigned int *table = NULL;
+	unsigned int *pte;
+	unsigned long i;
+	int ret = 0;
+	long istate = spin_lock_irqsave(&vmm_lock);
+
+	for(i = 0; i < count; i++, virt += PAGE_SIZE) {
+		if(table == NULL || (virt & (LARGE_PAGE_SIZE - 1)) == 0) {
+			table = get_table(virt, 0);
+		}
+		pte = table != NULL ? &table[(virt >> PAGE_SHIFT) & 1023] : NULL;
+		/* Not present pages keep their frame, so a frame of 0 is all
+		 * there is to tell unmapped apart. Only page zero has it */
+		if(pte == NULL || ((*pte & PG_FRAME) == 0 && virt != 0)) {
+			ret = -1;
+			continue;
+		}
+		*pte = (*pte & ~(PG_PRESENT | PG_WRITE)) | pte_bits(prot);
+	}
+	shootdown();
+	spin_unlock_irqrestore(&vmm_lock, istate);
+	return ret;
+}
+
+unsigned long vmm_phys(unsigned long virt)
+{
+	unsigned int pde = page_dir[virt >> 22], pte;
+
+	if(!paging_enabled) {
+		return virt;
+	}
+	if(!(pde & PG_PRESENT)) {
+		return 0;
+	}
+	if(pde & PG_LARGE) {
+		return (pde & 0xFFC00000) | (virt & (LARGE_PAGE_SIZE - 1));
+	}
+	pte = ((unsigned int *)(pde & PG_FRAME))[(virt >> PAGE_SHIFT) & 1023];
+	if(!(pte & PG_PRESENT)) {
+		return 0;
+	}
+	return (pte & PG_FRAME) | (virt & (PAGE_SIZE - 1));
+}
+
+static inline int bit_test(unsigned long *bits, unsigned long i)
+{
+	return (bits[i / 32] >> (i % 32)) & 1;
+}
+
+static void bits_set(unsigned long *bits, unsigned long first, unsigned long count, int set)
+{
+	unsigned long i;
+
+	for(i = first; i < first + count; i++) {
+		if(set) {
+			bits[i / 32] |= 1UL << (i % 32);
+		} else {
+			bits[i / 32] &= ~(1UL << (i % 32));
+		}
+	}
+}
+
+/* Once every CPU has flushed since the last free, pending pages are free */
+static void window_reclaim(void)
+{
+	unsigned long i;
+
+	if(pending_pages == 0 || !tlb_caught_up(pending_gen)) {
+		return;
+	}
+	for(i = 0; i < (window_pages + 31) / 32; i++) {
+		window_used[i] &= ~window_pending[i];
+		window_pending[i] = 0;
+	}
+	pending_pages = 0;
+}
+
+/* Next fit, so freed ranges go unused for as long as possible. Returns the
+ * first page, or window_pages if there's no room */
+static unsigned long window_find(unsigned long count)
+{
+	unsigned long i = window_hint, n, run = 0;
+
+	for(n = 0; n < window_pages + count; n++, i++) {
+		if(i >= window_pages) {
+			i = 0;
+			run = 0;
+		}
+		if(i % 32 == 0 && window_used[i / 32] == ~0UL && i + 32 <= window_pages) {
+			/* Skip whole words in use */
+			i += 31;
+			n += 31;
+			run = 0;
+		} else if(bit_test(window_used, i)) {
+			run = 0;
+		} else if(++run == count) {
+			window_hint = i + 1;
+			return i + 1 - count;
+		}
+	}
+	return window_pages;
+}
+
+void *vmm_alloc(unsigned long size, int prot)
+{
+	unsigned long count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	unsigned long first, virt, phys, done, run;
+	long istate;
+
+	if(count == 0 || count > window_pages) {
+		return NULL;
+	}
+	istate = spin_lock_irqsave(&vmm_lock);
+	window_reclaim();
+	first = window_find(count);
+	if(first == window_pages) {
+		spin_unlock_irqrestore(&vmm_lock, istate);
+		return NULL;
+	}
+	bits_set(window_used, first, count, 1);
+	virt = window_start + first * PAGE_SIZE;
+
+	/* Back it with runs of frames as long as are free, halving the run
+	 * until one is */
+	for(done = 0, run = count; done < count; ) {
+		if(run > count - done) {
+			run = count - done;
+		}
+		phys = pmm_alloc(run);
+		if(phys == 0) {
+			if(run == 1) {
+				goto fail;
+			}
+			run /= 2;
+			continue;
+		}
+		if(map_locked(virt + done * PAGE_SIZE, phys, run, prot) != 0) {
+			unmap_locked(virt + done * PAGE_SIZE, run, 0);
+			pmm_free(phys, run);
+			goto fail;
+		}
+		done += run;
+	}
+	spin_unlock_irqrestore(&vmm_lock, istate);
+	return (void *)virt;
+
+fail:
+	/* Nobody else knows about these addresses, so no other TLB has them */
+	unmap_locked(virt, done, 1);
+	flush_tlb();
+	bits_set(window_used, first, count, 0);
+	spin_unlock_irqrestore(&vmm_lock, istate);
+	return NULL;
+}
+
+void *vmm_alloc_large(unsigned long size)
+{
+	unsigned long count = (size + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE;
+	unsigned long phys;
+	long istate;
+
+	if(count == 0 || count > 1024) {
+		return NULL;
+	}
+	/* Nothing to map, RAM is all under 4MB pages already */
+	phys = pmm_alloc_contig(count * (LARGE_PAGE_SIZE / PAGE_SIZE), LARGE_PAGE_SIZE, 0, 0);
+	if(phys == 0) {
+		return NULL;
+	}
+	istate = spin_lock_irqsave(&vmm_lock);
+	bits_set(large_used, phys / LARGE_PAGE_SIZE, count, 1);
+	large_pages += count;
+	spin_unlock_irqrestore(&vmm_lock, istate);
+	return (void *)phys;
+}
+
+/* Give back vmm_alloc_large memory, -1 if that isn't where addr is from */
+static int free_large(unsigned long addr, unsigned long size)
+{
+	unsigned long count = (size + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE;
+	unsigned long i;
+	long istate;
+
+	if(addr & (LARGE_PAGE_SIZE - 1)) {
+		return -1;
+	}
+	istate = spin_lock_irqsave(&vmm_lock);
+	for(i = addr / LARGE_PAGE_SIZE; i < addr / LARGE_PAGE_SIZE + count; i++) {
+		if(i >= 1024 || !bit_test(large_used, i)) {
+			spin_unlock_irqrestore(&vmm_lock, istate);
+			return -1;
+		}
+	}
+	bits_set(large_used, addr / LARGE_PAGE_SIZE, count, 0);
+	large_pages -= count;
+	spin_unlock_irqrestore(&vmm_lock, istate);
+	/* The mapping stays, only the frames change hands */
+	pmm_free(addr, count * (LARGE_PAGE_SIZE / PAGE_SIZE));
+	return 0;
+}
+
+int vmm_free(void *addr, unsigned long size)
+{
+	unsigned long count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	unsigned long first = ((unsigned long)addr - window_start) / PAGE_SIZE;
+	long istate;
+
+	if((unsigned long)addr < window_start || first + count > window_pages) {
+		return free_large((unsigned long)addr, size);
+	}
+	istate = spin_lock_irqsave(&vmm_lock);
+	unmap_locked((unsigned long)addr, count, 1);
+	shootdown();
+	bits_set(window_pending, first, count, 1);
+	pending_pages += count;
+	pending_gen = tlb_gen;
+	spin_unlock_irqrestore(&vmm_lock, istate);
+	return 0;
+}
+
+void vmm_init()
+{
+	unsigned long top = pmm_top_pfn(), bitmap_pages, i;
+
+	paging_init();
+	if(top < (WINDOW_END >> PAGE_SHIFT)) {
+		window_start = ((top << PAGE_SHIFT) + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+		window_pages = (WINDOW_END - window_start) >> PAGE_SHIFT;
+	}
+	bitmap_pages = ((window_pages + 31) / 32 * sizeof(unsigned long) + PAGE_SIZE - 1) / PAGE_SIZE;
+	if(window_pages != 0) {
+		window_used = (unsigned long *)pmm_alloc(bitmap_pages);
+		window_pending = (unsigned long *)pmm_alloc(bitmap_pages);
+	}
+	if(window_used == NULL || window_pending == NULL) {
+		dprintf("vmm: no room for a window above RAM, large allocations stay on sbrk\r\n");
+		window_pages = 0;
+		return;
+	}
+	memset(window_used, 0, bitmap_pages * PAGE_SIZE);
+	memset(window_pending, 0, bitmap_pages * PAGE_SIZE);
+
+	/* Nothing is there, take the identity mapping away */
+	for(i = window_start >> 22; i < WINDOW_END >> 22; i++) {
+		page_dir[i] = 0;
+	}
+	flush_tlb();
+}
+
+void vmm_report()
+{
+	unsigned long i, used = 0;
+	long istate = spin_lock_irqsave(&vmm_lock);
+
+	for(i = 0; i < window_pages; i++) {
+		used += bit_test(window_used, i);
+	}
+	dprintf("vmm: window 0x%x-0x%x, %u KB in use, %u KB waiting on TLB flushes, %u page tables, %u large pages\r\n",
+		window_start, window_start + window_pages * PAGE_SIZE,
+		(used - pending_pages) * (PAGE_SIZE / 1024), pending_pages * (PAGE_SIZE / 1024), page_tables,
+		large_pages);
+	spin_unlock_irqrestore(&vmm_lock, istate);
+}
@@ -0,0 +1,158 @@
+#include <asm.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <signal.h>
+#include "workqueue.h"
+#include "idt.h"
+#include "irqstat.h"
+
+workqueue_t *system_wq = NULL;
+
+static void *do_worker(void *arg)
+{
+	workqueue_t *wq = arg;
+	work_t *work;
+	long istate;
+
+	while(1) {
+		sem_wait(&wq->sem);
+
+		istate = spin_lock_irqsave(&wq->lock);
+		work = list_get_instance(wq->works.next, work_t, link);
+		list_remove(&work->link);
+		/* Let it be queued again while it runs */
+		work->pending = 0;
+		spin_unlock_irqrestore(&wq->lock, istate);
+
+		work->func(work->arg);
+	}
+	return NULL;
+}
+
+workqueue_t *workqueue_create(int priority)
+{
+	workqueue_t *wq = malloc(sizeof(workqueue_t));
+
+	if(wq == NULL) {
+		return NULL;
+	}
+	spin_init(&wq->lock);
+	list_initialize(&wq->works);
+	sem_init(&wq->sem, 0);
+	if(thread_create(&wq->thread, do_worker, wq) != 0) {
+		sem_destroy(&wq->sem);
+		free(wq);
+		return NULL;
+	}
+	thread_set_priority(wq->thread, priority);
+	return wq;
+}
+
+void workqueue_init()
+{
+	system_wq = workqueue_create(PRIORITY_DEFAULT);
+	assert(system_wq != NULL);
+}
+
+void work_init(work_t *work, work_func func, void *arg)
+{
+	link_initialize(&work->link);
+	work->func = func;
+	work->arg = arg;
+	work->pending = 0;
+}
+
+int queue_work(workqueue_t *wq, work_t *work)
+{
+	long istate = spin_lock_irqsave(&wq->lock);
+
+	if(work->pending) {
+		spin_unlock_irqrestore(&wq->lock, istate);
+		return -1;
+	}
+	work->pending = 1;
+	list_append(&work->link, &wq->works);
+	spin_unlock_irqrestore(&wq->lock, istate);
+	sem_post(&wq->sem);
+	return 0;
+}
+
+int schedule_work(work_t *work)
+{
+	return queue_work(system_wq, work);
+}
+
+/* Threaded IRQs */
+
+typedef struct irq_thread {
+	int irq;
+	irq_thread_func fn;
+	void *arg;
+	workqueue_t *wq;
+	work_t work;
+} irq_thread_t;
+
+extern sighandler_t signal_handlers[16];
+
+static irq_thread_t *irq_threads[16];
+/* signal_mask is shared by the top halves and the IRQ threads */
+static spinlock_t irq_mask_lock = SPINLOCK_INITIALIZER;
+
+static void irq_set_masked(int irq, int masked)
+{
+	long istate = spin_lock_irqsave(&irq_mask_lock);
+	if(masked) {
+		mask_irq(irq);
+	} else {
+		unmask_irq(irq);
+	}
+	update_mask();
+	spin_unlock_irqrestore(&irq_mask_lock, istate);
+}
+
+/* Interrupt context: keep the line quiet until the thread has dealt with
+ * the device, otherwise a level-triggered one fires again straight away */
+static void irq_top_half(int irq)
+{
+	irq_set_masked(irq, 1);
+	irq_eoi(irq);
+	queue_work(irq_threads[irq]->wq, &irq_threads[irq]->work);
+}
+
+static void irq_bottom_half(void *arg)
+{
+	irq_thread_t *it = arg;
+
+	if(irqstat_enabled) {
+		irqstat_handler_start(it->irq);
+	}
+	it->fn(it->irq, it->arg);
+	irq_set_masked(it->irq, 0);
+}
+
+int irq_request_threaded(int irq, irq_thread_func fn, void *arg, int priority)
+{
+	irq_thread_t *it;
+
+	if(irq < 0 || irq >= 16 || irq_threads[irq] != NULL) {
+		return -1;
+	}
+	it = malloc(sizeof(irq_thread_t));
+	if(it == NULL) {
+		return -1;
+	}
+	it->irq = irq;
+	it->fn = fn;
+	it->arg = arg;
+	it->wq = workqueue_create(priority);
+	if(it->wq == NULL) {
+		free(it);
+		return -1;
+	}
+	work_init(&it->work, irq_bottom_half, it);
+	irq_threads[irq] = it;
+
+	signal_handlers[irq] = irq_top_half;
+	irq_set_masked(irq, 0);
+	return 0;
+}
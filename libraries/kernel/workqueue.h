@@ -0,0 +1,54 @@
+#ifndef WORKQUEUE_HEADER
+#define WORKQUEUE_HEADER
+
+#include <threads.h>
+
+/* Work queues
+ *
+ * A work queue is a kernel thread, at a priority of its choosing, running
+ * work items queued to it one after another. queue_work is safe from
+ * interrupt handlers, so anything slow an IRQ needs done can be pushed out
+ * of interrupt context. An item is queued at most once at a time; queuing
+ * it again before it has started running does nothing.
+ *
+ * Threaded IRQs build on this: the top half only masks the line, acknowledges
+ * it and queues the IRQ's work item; the handler then runs in the IRQ's own
+ * thread with interrupts on, and the line is unmasked once it returns. */
+
+typedef void (*work_func)(void *);
+
+typedef struct work {
+	link_t link;
+	work_func func;
+	void *arg;
+	/* Set from queue_work until the worker picks it up */
+	volatile int pending;
+} work_t;
+
+typedef struct workqueue {
+	spinlock_t lock;
+	link_t works;
+	/* Counts queued items, the worker sleeps on it */
+	sem_t sem;
+	thread_t thread;
+} workqueue_t;
+
+/* Runs at PRIORITY_DEFAULT, created by thread_init */
+extern workqueue_t *system_wq;
+
+extern void workqueue_init();
+/* NULL if there's no memory for it or its worker */
+extern workqueue_t *workqueue_create(int priority);
+extern void work_init(work_t *, work_func, void *);
+/* Returns 0 if queued, -1 if it already was */
+extern int queue_work(workqueue_t *, work_t *);
+extern int schedule_work(work_t *);
+
+typedef void (*irq_thread_func)(int irq, void *arg);
+
+/* Route irq to fn, run in a new thread at priority, and unmask it. Returns
+ * -1, leaving the line alone, if irq isn't 0-15, already has a thread, or
+ * there's no memory for one */
+extern int irq_request_threaded(int irq, irq_thread_func fn, void *arg, int priority);
+
+#endif
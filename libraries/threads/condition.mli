@@ -0,0 +1,17 @@
+(** Condition variables to synchronize between threads. *)
+
+type t
+(** The type of condition variables. *)
+
+val create : unit -> t
+(** Return a new condition variable. *)
+
+val wait : t -> Mutex.t -> unit
+(** [wait c m] atomically unlocks [m] and suspends the calling thread on
+   [c], then locks [m] again before returning. *)
+
+val signal : t -> unit
+(** Restart one of the threads waiting on the condition variable. *)
+
+val broadcast : t -> unit
+(** Restart all threads waiting on the condition variable. *)
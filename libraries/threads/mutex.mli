@@ -0,0 +1,19 @@
+(** Locks for mutual exclusion between threads. *)
+
+type t
+(** The type of mutexes. *)
+
+val create : unit -> t
+(** Return a new mutex. *)
+
+val lock : t -> unit
+(** Lock the given mutex, suspending the calling thread until it is free.
+   Locking a mutex the thread already holds deadlocks. *)
+
+val try_lock : t -> bool
+(** Like [lock], but return [false] instead of waiting if the mutex is
+   already locked. *)
+
+val unlock : t -> unit
+(** Unlock the given mutex. Raises [Failure] if the calling thread does
+   not hold it. *)
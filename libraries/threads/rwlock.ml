@@ -0,0 +1,7 @@
+type t
+external create : unit -> t = "caml_rwlock_new"
+external read_lock : t -> unit = "caml_rwlock_read_lock"
+external try_read_lock : t -> bool = "caml_rwlock_try_read_lock"
+external write_lock : t -> unit = "caml_rwlock_write_lock"
+external try_write_lock : t -> bool = "caml_rwlock_try_write_lock"
+external unlock : t -> unit = "caml_rwlock_unlock"
@@ -0,0 +1,26 @@
+(** Reader-writer locks: any number of readers, or one writer. Once a
+   writer is waiting, new readers wait behind it. *)
+
+type t
+(** The type of reader-writer locks. *)
+
+val create : unit -> t
+(** Return a new, unlocked reader-writer lock. *)
+
+val read_lock : t -> unit
+(** Take the lock for reading, suspending the calling thread while a writer
+   holds it or is waiting for it. *)
+
+val try_read_lock : t -> bool
+(** Like [read_lock], but return [false] instead of waiting. *)
+
+val write_lock : t -> unit
+(** Take the lock for writing, suspending the calling thread until no other
+   thread holds it. *)
+
+val try_write_lock : t -> bool
+(** Like [write_lock], but return [false] instead of waiting. *)
+
+val unlock : t -> unit
+(** Release a read or write hold. Raises [Failure] if the lock is not held
+   by the calling thread for writing, nor by anyone for reading. *)
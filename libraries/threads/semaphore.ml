@@ -0,0 +1,6 @@
+type t
+external create : int -> t = "caml_semaphore_new"
+external acquire : t -> unit = "caml_semaphore_acquire"
+external try_acquire : t -> bool = "caml_semaphore_try_acquire"
+external release : t -> unit = "caml_semaphore_release"
+external get_value : t -> int = "caml_semaphore_get_value"
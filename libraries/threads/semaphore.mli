@@ -0,0 +1,20 @@
+(** Counting semaphores. *)
+
+type t
+(** The type of semaphores. *)
+
+val create : int -> t
+(** [create n] returns a new semaphore with count [n]. Raises
+   [Invalid_argument] if [n] is negative. *)
+
+val acquire : t -> unit
+(** Decrement the count, suspending the calling thread while it is zero. *)
+
+val try_acquire : t -> bool
+(** Like [acquire], but return [false] instead of waiting. *)
+
+val release : t -> unit
+(** Increment the count, restarting one waiting thread if there are any. *)
+
+val get_value : t -> int
+(** The current count. *)
@@ -0,0 +1,672 @@
+/* Thread support for OCaml, on top of the kernel threads in threads.c
+ *
+ * Modelled on otherlibs/systhreads. Every OCaml thread is a kernel thread,
+ * and only the one holding the master lock may touch the OCaml heap. The
+ * lock is released around blocking C calls (caml_enter_blocking_section)
+ * and reacquired after (caml_leave_blocking_section), at which point the
+ * runtime's stack and exception state are swapped for the new thread's.
+ *
+ * As with the systhreads tick thread, a kernel thread wakes every
+ * CAML_THREAD_TICK_NS and, if the same holder has had the master lock for
+ * the whole period while others wait for it, asks it to give the lock up
+ * by forcing a poll: the holder's next allocation goes through
+ * caml_garbage_collection, which runs caml_async_action_hook. */
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/callback.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+#include <caml/memory.h>
+#include <caml/minor_gc.h>
+#include <caml/misc.h>
+#include <caml/roots.h>
+#include <caml/signals.h>
+#include <caml/stack.h>
+
+#include <stdlib.h>
+#include <threads.h>
+
+/* OCaml code recurses a lot more than the kernel does */
+#define CAML_THREAD_STACK_SIZE (256 * 1024)
+/* How long a thread may keep the runtime while others want it, 50ms as in
+ * systhreads */
+#define CAML_THREAD_TICK_NS 50000000ULL
+
+/* Set when a thread terminates, for Thread.join */
+struct caml_thread_event {
+	mutex_t lock;
+	cond_t cond;
+	int set;
+};
+
+/* Runtime state of a thread that isn't running OCaml code */
+struct caml_thread_struct {
+	value descr;                /* The Thread.t for this thread */
+	struct caml_thread_struct *next, *prev;
+	thread_t kthread;
+	char *top_of_stack;         /* Top of stack for this thread (approx.) */
+	char *bottom_of_stack;      /* Saved value of caml_bottom_of_stack */
+	uintnat last_retaddr;       /* Saved value of caml_last_return_address */
+	value *gc_regs;             /* Saved value of caml_gc_regs */
+	char *exception_pointer;    /* Saved value of caml_exception_pointer */
+	struct caml__roots_block *local_roots; /* Saved value of local_roots */
+	int yielding;               /* In caml_thread_yield_if_wanted */
+};
+
+typedef struct caml_thread_struct *caml_thread_t;
+
+/* Thread.t is a block: identifier, closure to run, termination event */
+#define Ident(v) Field(v, 0)
+#define Start_closure(v) Field(v, 1)
+#define Terminated(v) Field(v, 2)
+
+#define Event_val(v) (*((struct caml_thread_event **) Data_custom_val(v)))
+#define Mutex_val(v) (*((mutex_t **) Data_custom_val(v)))
+#define Condition_val(v) (*((cond_t **) Data_custom_val(v)))
+#define Rwlock_val(v) (*((rwlock_t **) Data_custom_val(v)))
+#define Semaphore_val(v) (*((sem_t **) Data_custom_val(v)))
+
+/* Ring of all OCaml threads, entered at the one holding the master lock */
+static caml_thread_t curr_thread = NULL;
+
+static mutex_t caml_master_lock;
+/* Threads waiting for the master lock */
+static volatile unsigned long master_waiters = 0;
+/* Bumped on every acquisition, so the tick can tell whether the holder
+ * changed since it last looked */
+static volatile unsigned long master_acquisitions = 0;
+
+static intnat thread_next_ident = 0;
+
+static void (*prev_scan_roots_hook)(scanning_action);
+
+extern char *caml_exception_pointer;
+
+/* Master lock */
+
+static void caml_thread_request_yield(void)
+{
+	/* Same trick as caml_record_signal: make the next allocation poll */
+	caml_signals_are_pending = 1;
+	caml_young_limit = caml_young_end;
+}
+
+static void masterlock_acquire(void)
+{
+	if(mutex_trylock(&caml_master_lock) != 0) {
+		atomic_fetch_add(&master_waiters, 1);
+		mutex_lock(&caml_master_lock);
+		atomic_fetch_add(&master_waiters, -1);
+	}
+	master_acquisitions++;
+}
+
+static void masterlock_release(void)
+{
+	mutex_unlock(&caml_master_lock);
+}
+
+/* Runtime hooks */
+
+static void caml_thread_scan_roots(scanning_action action)
+{
+	caml_thread_t th = curr_thread;
+
+	do {
+		(*action)(th->descr, &th->descr);
+		/* The current thread's stack is scanned by the runtime itself, and
+		 * a thread that hasn't started yet has no stack to scan */
+		if(th != curr_thread && th->bottom_of_stack != NULL) {
+			caml_do_local_roots(action, th->bottom_of_stack, th->last_retaddr,
+			                    th->gc_regs, th->local_roots);
+		}
+		th = th->next;
+	} while(th != curr_thread);
+
+	if(prev_scan_roots_hook != NULL) {
+		(*prev_scan_roots_hook)(action);
+	}
+}
+
+static void caml_thread_enter_blocking_section(void)
+{
+	/* Save the runtime's per-thread globals, then let someone else in */
+	curr_thread->top_of_stack = caml_top_of_stack;
+	curr_thread->bottom_of_stack = caml_bottom_of_stack;
+	curr_thread->last_retaddr = caml_last_return_address;
+	curr_thread->gc_regs = caml_gc_regs;
+	curr_thread->exception_pointer = caml_exception_pointer;
+	curr_thread->local_roots = caml_local_roots;
+	masterlock_release();
+}
+
+static void caml_thread_leave_blocking_section(void)
+{
+	masterlock_acquire();
+	curr_thread = thread_getspecific();
+	caml_top_of_stack = curr_thread->top_of_stack;
+	caml_bottom_of_stack = curr_thread->bottom_of_stack;
+	caml_last_return_address = curr_thread->last_retaddr;
+	caml_gc_regs = curr_thread->gc_regs;
+	caml_exception_pointer = curr_thread->exception_pointer;
+	caml_local_roots = curr_thread->local_roots;
+}
+
+static int caml_thread_try_leave_blocking_section(void)
+{
+	/* Nothing here runs OCaml code from an interrupt handler */
+	return 0;
+}
+
+static void caml_thread_yield_if_wanted(void)
+{
+	caml_thread_t th = curr_thread;
+
+	/* Entering and leaving the blocking section both poll, which lands
+	 * back here */
+	if(master_waiters == 0 || th->yielding) {
+		return;
+	}
+	th->yielding = 1;
+	caml_enter_blocking_section();
+	thread_yield();
+	caml_leave_blocking_section();
+	th->yielding = 0;
+}
+
+/* Never takes the master lock, it only looks at who holds it */
+static void *caml_thread_tick(void *arg)
+{
+	unsigned long last = master_acquisitions;
+
+	for(;;) {
+		thread_sleep_for(CAML_THREAD_TICK_NS);
+		if(master_waiters > 0 && master_acquisitions == last) {
+			caml_thread_request_yield();
+		}
+		last = master_acquisitions;
+	}
+	return NULL;
+}
+
+/* Thread creation and termination */
+
+static void caml_thread_event_finalize(value v)
+{
+	struct caml_thread_event *event = Event_val(v);
+
+	cond_destroy(&event->cond);
+	mutex_destroy(&event->lock);
+	free(event);
+}
+
+static struct custom_operations caml_thread_event_ops = {
+	"snowflake.thread.event",
+	caml_thread_event_finalize,
+	custom_compare_default,
+	custom_hash_default,
+	custom_serialize_default,
+	custom_deserialize_default
+};
+
+static value caml_thread_new_descriptor(value clos)
+{
+	CAMLparam1(clos);
+	CAMLlocal2(event, descr);
+	struct caml_thread_event *e = malloc(sizeof(struct caml_thread_event));
+
+	if(e == NULL) {
+		caml_raise_out_of_memory();
+	}
+	mutex_init(&e->lock);
+	cond_init(&e->cond);
+	e->set = 0;
+	event = caml_alloc_custom(&caml_thread_event_ops, sizeof(struct caml_thread_event *), 0, 1);
+	Event_val(event) = e;
+
+	descr = caml_alloc_small(3, 0);
+	Ident(descr) = Val_long(thread_next_ident);
+	Start_closure(descr) = clos;
+	Terminated(descr) = event;
+	thread_next_ident++;
+	CAMLreturn(descr);
+}
+
+static caml_thread_t caml_thread_new_info(void)
+{
+	caml_thread_t th = malloc(sizeof(struct caml_thread_struct));
+
+	if(th == NULL) {
+		caml_raise_out_of_memory();
+	}
+	th->descr = Val_unit;
+	th->kthread = NULL;
+	th->top_of_stack = NULL;
+	th->bottom_of_stack = NULL;
+	th->last_retaddr = 1;
+	th->gc_regs = NULL;
+	th->exception_pointer = NULL;
+	th->local_roots = NULL;
+	th->yielding = 0;
+	return th;
+}
+
+static void caml_thread_link(caml_thread_t th)
+{
+	th->next = curr_thread->next;
+	th->prev = curr_thread;
+	curr_thread->next->prev = th;
+	curr_thread->next = th;
+}
+
+/* Called with the master lock held, drops it for good */
+static void caml_thread_stop(void)
+{
+	struct caml_thread_event *event = Event_val(Terminated(curr_thread->descr));
+	caml_thread_t th = curr_thread;
+
+	mutex_lock(&event->lock);
+	event->set = 1;
+	cond_broadcast(&event->cond);
+	mutex_unlock(&event->lock);
+
+	th->next->prev = th->prev;
+	th->prev->next = th->next;
+	/* Point curr_thread at a live thread for the next root scan, whoever
+	 * takes the lock next replaces it anyway */
+	curr_thread = th->next;
+	free(th);
+	masterlock_release();
+}
+
+static void *caml_thread_start(void *arg)
+{
+	caml_thread_t th = arg;
+	value clos;
+	int tos;
+
+	thread_setspecific(th);
+	th->top_of_stack = (char *)&tos;
+	caml_leave_blocking_section();
+	clos = Start_closure(th->descr);
+	caml_modify(&(Start_closure(th->descr)), Val_unit);
+	caml_callback_exn(clos, Val_unit);
+	caml_thread_stop();
+	return NULL;
+}
+
+CAMLprim value caml_thread_initialize(value unit) {
+	CAMLparam1(unit);
+	CAMLlocal1(descr);
+	caml_thread_t th;
+	thread_t tick;
+
+	/* Already done */
+	if(curr_thread != NULL) {
+		CAMLreturn(Val_unit);
+	}
+	if(thread_self() == NULL) {
+		thread_init();
+	}
+
+	/* Everything that can fail comes first, so nothing is left half set
+	 * up. The descriptor before the info, which would leak otherwise */
+	descr = caml_thread_new_descriptor(Val_unit);
+	th = caml_thread_new_info();
+	if(thread_create(&tick, caml_thread_tick, NULL) != 0) {
+		free(th);
+		caml_raise_out_of_memory();
+	}
+
+	mutex_init(&caml_master_lock);
+	mutex_lock(&caml_master_lock);
+
+	/* The thread running caml_startup becomes the first OCaml thread */
+	th->kthread = thread_self();
+	th->next = th;
+	th->prev = th;
+	th->descr = descr;
+	curr_thread = th;
+	thread_setspecific(th);
+
+	prev_scan_roots_hook = caml_scan_roots_hook;
+	caml_scan_roots_hook = caml_thread_scan_roots;
+	caml_enter_blocking_section_hook = caml_thread_enter_blocking_section;
+	caml_leave_blocking_section_hook = caml_thread_leave_blocking_section;
+	caml_try_leave_blocking_section_hook = caml_thread_try_leave_blocking_section;
+	caml_async_action_hook = caml_thread_yield_if_wanted;
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value caml_thread_new(value clos) {
+	CAMLparam1(clos);
+	CAMLlocal1(descr);
+	caml_thread_t th;
+
+	/* Descriptor first, th would leak if it raised */
+	descr = caml_thread_new_descriptor(clos);
+	th = caml_thread_new_info();
+	th->descr = descr;
+	caml_thread_link(th);
+	/* Doesn't run before we release the master lock */
+	if(thread_create_ex(&th->kthread, caml_thread_start, th, CAML_THREAD_STACK_SIZE) != 0) {
+		th->next->prev = th->prev;
+		th->prev->next = th->next;
+		free(th);
+		caml_raise_out_of_memory();
+	}
+	CAMLreturn(th->descr);
+}
+
+CAMLprim value caml_thread_self(value unit) {
+	return curr_thread->descr;
+}
+
+CAMLprim value caml_thread_id(value th) {
+	return Ident(th);
+}
+
+CAMLprim value caml_thread_yield(value unit) {
+	caml_enter_blocking_section();
+	thread_yield();
+	caml_leave_blocking_section();
+	return Val_unit;
+}
+
+CAMLprim value caml_thread_delay(value seconds) {
+	double ns = Double_val(seconds) * 1e9;
+
+	caml_enter_blocking_section();
+	thread_sleep_for(ns > 0 ? (unsigned long long)ns : 0);
+	caml_leave_blocking_section();
+	return Val_unit;
+}
+
+CAMLprim value caml_thread_exit(value unit) {
+	caml_thread_stop();
+	thread_exit(NULL);
+	return Val_unit;
+}
+
+CAMLprim value caml_thread_join(value th) {
+	CAMLparam1(th);
+	/* th keeps the event alive while we wait outside the runtime */
+	struct caml_thread_event *event = Event_val(Terminated(th));
+
+	caml_enter_blocking_section();
+	mutex_lock(&event->lock);
+	while(!event->set) {
+		cond_wait(&event->cond, &event->lock);
+	}
+	mutex_unlock(&event->lock);
+	caml_leave_blocking_section();
+	CAMLreturn(Val_unit);
+}
+
+/* Mutex */
+
+static void caml_mutex_finalize(value v)
+{
+	mutex_destroy(Mutex_val(v));
+	free(Mutex_val(v));
+}
+
+static int caml_mutex_compare(value v1, value v2)
+{
+	mutex_t *m1 = Mutex_val(v1), *m2 = Mutex_val(v2);
+	return m1 == m2 ? 0 : (m1 < m2 ? -1 : 1);
+}
+
+static struct custom_operations caml_mutex_ops = {
+	"snowflake.mutex",
+	caml_mutex_finalize,
+	caml_mutex_compare,
+	custom_hash_default,
+	custom_serialize_default,
+	custom_deserialize_default
+};
+
+CAMLprim value caml_mutex_new(value unit) {
+	mutex_t *m = malloc(sizeof(mutex_t));
+	value v;
+
+	if(m == NULL) {
+		caml_raise_out_of_memory();
+	}
+	mutex_init(m);
+	v = caml_alloc_custom(&caml_mutex_ops, sizeof(mutex_t *), 1, 1000);
+	Mutex_val(v) = m;
+	return v;
+}
+
+CAMLprim value caml_mutex_lock(value wrapper) {
+	CAMLparam1(wrapper);
+	mutex_t *m = Mutex_val(wrapper);
+
+	/* Avoid leaving the runtime if we can get it straight away */
+	if(mutex_trylock(m) == 0) {
+		CAMLreturn(Val_unit);
+	}
+	caml_enter_blocking_section();
+	mutex_lock(m);
+	caml_leave_blocking_section();
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value caml_mutex_unlock(value wrapper) {
+	mutex_t *m = Mutex_val(wrapper);
+
+	if(m->owner != thread_self()) {
+		caml_failwith("Mutex.unlock: not owner");
+	}
+	mutex_unlock(m);
+	return Val_unit;
+}
+
+CAMLprim value caml_mutex_try_lock(value wrapper) {
+	return Val_bool(mutex_trylock(Mutex_val(wrapper)) == 0);
+}
+
+/* Condition */
+
+static void caml_condition_finalize(value v)
+{
+	cond_destroy(Condition_val(v));
+	free(Condition_val(v));
+}
+
+static int caml_condition_compare(value v1, value v2)
+{
+	cond_t *c1 = Condition_val(v1), *c2 = Condition_val(v2);
+	return c1 == c2 ? 0 : (c1 < c2 ? -1 : 1);
+}
+
+static struct custom_operations caml_condition_ops = {
+	"snowflake.condition",
+	caml_condition_finalize,
+	caml_condition_compare,
+	custom_hash_default,
+	custom_serialize_default,
+	custom_deserialize_default
+};
+
+CAMLprim value caml_condition_new(value unit) {
+	cond_t *c = malloc(sizeof(cond_t));
+	value v;
+
+	if(c == NULL) {
+		caml_raise_out_of_memory();
+	}
+	cond_init(c);
+	v = caml_alloc_custom(&caml_condition_ops, sizeof(cond_t *), 1, 1000);
+	Condition_val(v) = c;
+	return v;
+}
+
+CAMLprim value caml_condition_wait(value wcond, value wmut) {
+	CAMLparam2(wcond, wmut);
+	cond_t *c = Condition_val(wcond);
+	mutex_t *m = Mutex_val(wmut);
+
+	caml_enter_blocking_section();
+	cond_wait(c, m);
+	caml_leave_blocking_section();
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value caml_condition_signal(value wrapper) {
+	cond_signal(Condition_val(wrapper));
+	return Val_unit;
+}
+
+CAMLprim value caml_condition_broadcast(value wrapper) {
+	cond_broadcast(Condition_val(wrapper));
+	return Val_unit;
+}
+
+/* Rwlock */
+
+static void caml_rwlock_finalize(value v)
+{
+	rwlock_destroy(Rwlock_val(v));
+	free(Rwlock_val(v));
+}
+
+static int caml_rwlock_compare(value v1, value v2)
+{
+	rwlock_t *r1 = Rwlock_val(v1), *r2 = Rwlock_val(v2);
+	return r1 == r2 ? 0 : (r1 < r2 ? -1 : 1);
+}
+
+static struct custom_operations caml_rwlock_ops = {
+	"snowflake.rwlock",
+	caml_rwlock_finalize,
+	caml_rwlock_compare,
+	custom_hash_default,
+	custom_serialize_default,
+	custom_deserialize_default
+};
+
+CAMLprim value caml_rwlock_new(value unit) {
+	rwlock_t *r = malloc(sizeof(rwlock_t));
+	value v;
+
+	if(r == NULL) {
+		caml_raise_out_of_memory();
+	}
+	rwlock_init(r);
+	v = caml_alloc_custom(&caml_rwlock_ops, sizeof(rwlock_t *), 1, 1000);
+	Rwlock_val(v) = r;
+	return v;
+}
+
+CAMLprim value caml_rwlock_read_lock(value wrapper) {
+	CAMLparam1(wrapper);
+	rwlock_t *r = Rwlock_val(wrapper);
+
+	if(rwlock_tryrdlock(r) == 0) {
+		CAMLreturn(Val_unit);
+	}
+	caml_enter_blocking_section();
+	rwlock_rdlock(r);
+	caml_leave_blocking_section();
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value caml_rwlock_write_lock(value wrapper) {
+	CAMLparam1(wrapper);
+	rwlock_t *r = Rwlock_val(wrapper);
+
+	if(rwlock_trywrlock(r) == 0) {
+		CAMLreturn(Val_unit);
+	}
+	caml_enter_blocking_section();
+	rwlock_wrlock(r);
+	caml_leave_blocking_section();
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value caml_rwlock_try_read_lock(value wrapper) {
+	return Val_bool(rwlock_tryrdlock(Rwlock_val(wrapper)) == 0);
+}
+
+CAMLprim value caml_rwlock_try_write_lock(value wrapper) {
+	return Val_bool(rwlock_trywrlock(Rwlock_val(wrapper)) == 0);
+}
+
+CAMLprim value caml_rwlock_unlock(value wrapper) {
+	rwlock_t *r = Rwlock_val(wrapper);
+
+	if(r->writer != NULL ? r->writer != thread_self() : r->readers == 0) {
+		caml_failwith("Rwlock.unlock: not held");
+	}
+	rwlock_unlock(r);
+	return Val_unit;
+}
+
+/* Semaphore */
+
+static void caml_semaphore_finalize(value v)
+{
+	sem_destroy(Semaphore_val(v));
+	free(Semaphore_val(v));
+}
+
+static int caml_semaphore_compare(value v1, value v2)
+{
+	sem_t *s1 = Semaphore_val(v1), *s2 = Semaphore_val(v2);
+	return s1 == s2 ? 0 : (s1 < s2 ? -1 : 1);
+}
+
+static struct custom_operations caml_semaphore_ops = {
+	"snowflake.semaphore",
+	caml_semaphore_finalize,
+	caml_semaphore_compare,
+	custom_hash_default,
+	custom_serialize_default,
+	custom_deserialize_default
+};
+
+CAMLprim value caml_semaphore_new(value count) {
+	sem_t *s;
+	value v;
+
+	if(Long_val(count) < 0) {
+		caml_invalid_argument("Semaphore.create");
+	}
+	s = malloc(sizeof(sem_t));
+	if(s == NULL) {
+		caml_raise_out_of_memory();
+	}
+	sem_init(s, Long_val(count));
+	v = caml_alloc_custom(&caml_semaphore_ops, sizeof(sem_t *), 1, 1000);
+	Semaphore_val(v) = s;
+	return v;
+}
+
+CAMLprim value caml_semaphore_acquire(value wrapper) {
+	CAMLparam1(wrapper);
+	sem_t *s = Semaphore_val(wrapper);
+
+	if(sem_trywait(s) == 0) {
+		CAMLreturn(Val_unit);
+	}
+	caml_enter_blocking_section();
+	sem_wait(s);
+	caml_leave_blocking_section();
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value caml_semaphore_try_acquire(value wrapper) {
+	return Val_bool(sem_trywait(Semaphore_val(wrapper)) == 0);
+}
+
+CAMLprim value caml_semaphore_release(value wrapper) {
+	sem_post(Semaphore_val(wrapper));
+	return Val_unit;
+}
+
+CAMLprim value caml_semaphore_get_value(value wrapper) {
+	return Val_long(sem_getvalue(Semaphore_val(wrapper)));
+}
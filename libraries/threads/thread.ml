@@ -0,0 +1,27 @@
+type t
+
+external thread_initialize : unit -> unit = "caml_thread_initialize"
+external thread_new : (unit -> unit) -> t = "caml_thread_new"
+external yield : unit -> unit = "caml_thread_yield"
+external self : unit -> t = "caml_thread_self"
+external id : t -> int = "caml_thread_id"
+external join : t -> unit = "caml_thread_join"
+external delay : float -> unit = "caml_thread_delay"
+external exit_stub : unit -> unit = "caml_thread_exit"
+
+let () = thread_initialize ()
+
+let create fn arg =
+  thread_new
+    (fun () ->
+      try
+        ignore (fn arg)
+      with exn ->
+        flush stdout;
+        prerr_string "Thread ";
+        prerr_int (id (self ()));
+        prerr_string " killed on uncaught exception ";
+        prerr_string (Printexc.to_string exn);
+        prerr_newline ())
+
+let exit () = exit_stub ()
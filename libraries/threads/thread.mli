@@ -0,0 +1,33 @@
+(** Threads backed by kernel threads.
+
+   Only one thread runs OCaml code at a time; the others may be blocked in
+   C code (device I/O, [Mutex.lock], [Condition.wait]) in the meantime.
+   A thread that wants the runtime makes the one holding it give it up at
+   its next allocation. *)
+
+type t
+(** The type of thread handles. *)
+
+val create : ('a -> 'b) -> 'a -> t
+(** [create funct arg] starts a new thread running [funct arg]. The
+   thread ends when [funct] returns. If [funct] raises, the exception is
+   reported on stderr and the thread ends. *)
+
+val self : unit -> t
+(** The thread currently executing. *)
+
+val id : t -> int
+(** Identifier of the given thread, unique within the program. *)
+
+val exit : unit -> unit
+(** Terminate the calling thread. *)
+
+val join : t -> unit
+(** [join th] suspends the calling thread until [th] has terminated. *)
+
+val delay : float -> unit
+(** [delay d] suspends the calling thread for at least [d] seconds. Other
+   threads run in the meantime. *)
+
+val yield : unit -> unit
+(** Let other threads run. *)
@@ -76,11 +76,11 @@ let copy_rule' ?insert src dst =
 	
 	snowflake_lib "bigarray";;*)
 
-(*(*** threads.cmxa ***)
+(*** threads.cmxa ***)
 
 	snowflake_lib "threads";;
 
-(*** cairo.cmxa ***)
+(*(*** cairo.cmxa ***)
 
 	snowflake_lib "cairo";;
 	
@@ -227,6 +227,9 @@ let caml_headers = [
                 "libraries/include/string.h";
                 "libraries/include/asm.h";
                 "libraries/include/signal.h";
+                "libraries/include/vmm.h";
+                "libraries/include/mallocstat.h";
+                "libraries/include/malloc.h";
             ]
         };;
 
@@ -254,6 +257,9 @@ let caml_headers = [
                 "libraries/include/ctype.h";
                 "libraries/include/asm.h";
                 "libraries/include/threads.h";
+                "libraries/include/spinlock.h";
+                "libraries/include/trace.h";
+                "libraries/include/vmm.h";
 							] @ caml_headers;
         };;
 
@@ -281,6 +287,7 @@ let caml_headers = [
                 "libraries/include/ctype.h";
                 "libraries/include/asm.h";
                 "libraries/include/threads.h";
+                "libraries/include/spinlock.h";
                 "libraries/include/caml/bigarray.h";
 							] @ caml_headers;
         };;*)
@@ -311,11 +318,12 @@ let caml_headers = [
                 "libraries/include/ctype.h";
                 "libraries/include/asm.h";
                 "libraries/include/threads.h";
+                "libraries/include/spinlock.h";
                 "libraries/include/caml/bigarray.h";
 							] @ caml_headers;
         };;*)
 
-(*(*** libthreads.a ***)
+(*** libthreads.a ***)
 
     mk_stlib {
         name = "libthreads";
@@ -339,9 +347,9 @@ let caml_headers = [
                 "libraries/include/ctype.h";
                 "libraries/include/asm.h";
                 "libraries/include/threads.h";
-                "libraries/include/caml/bigarray.h";
+                "libraries/include/spinlock.h";
 							] @ caml_headers;
-        };;*)
+        };;
 
 (*** libgcc.a ***)
 
@@ -379,18 +387,37 @@ let caml_headers = [
             ]
         end;;
 
+    flag ["compile"; "S"; "libkernel"] (S[A"-I"; A"libraries/include"]);;
     flag ["compile"; "c"; "libkernel"] (S[A"-I"; A"libraries/include"; A"-I"; A"libraries/x86emu"; A"-I"; A"../tools/custom/include/cairo"; A"-nostdinc"; A"-DCAML_NAME_SPACE"; A"-DSYS_linux_elf"; A"-DTARGET_i386"; A"-DNATIVE_CODE"; A"-O2"]);;
 	
 	let deps = [
 		"libraries/include/multiboot.h";
 		(*"libraries/include/caml/bigarray.h";*)
 		"libraries/kernel/idt.h";
+		"libraries/kernel/timer.h";
+		"libraries/kernel/paging.h";
+		"libraries/kernel/smp.h";
+		"libraries/kernel/workqueue.h";
+		"libraries/kernel/ioapic.h";
+		"libraries/kernel/irqstat.h";
+		"libraries/kernel/ksyms.h";
+		"libraries/kernel/profile.h";
+		"libraries/kernel/pmm.h";
+		"libraries/include/vmm.h";
+		"libraries/kernel/slab.h";
+		"libraries/include/mallocstat.h";
+		"libraries/include/malloc.h";
+		"libraries/kernel/dma.h";
+		"libraries/include/threads.h";
+		"libraries/include/spinlock.h";
+		"libraries/include/trace.h";
 		"libraries/include/list.h";
 		"libraries/include/assert.h";
 		(*"libraries/x86emu/x86emu.h";
 		"libraries/x86emu/x86emu/types.h";
 		"libraries/x86emu/x86emu/regs.h";*)
-	] in dep ["compile"; "c"; "libkernel"] deps;;
+	] in dep ["compile"; "c"; "libkernel"] deps;
+	dep ["compile"; "S"; "libkernel"] ["libraries/include/trace.h"; "libraries/kernel/smp.h"];;
 
     copy_rule' "libraries/kernel/libkernel.a" "libkernel.a";;
 
@@ -407,10 +434,10 @@ let caml_headers = [
             A"-clibrary"; A"-lc";
             A"-clibrary"; A"-lm";
 			(*A"-clibrary"; A"-lbigarray";*)
-			(*A"-clibrary"; A"-lthreads";*)
+			A"-clibrary"; A"-lthreads";
         ]);;
 	
-	dep ["file:kernel/snowflake.native"] ["libkernel.a"; "libm.a"; "libc.a"; "libgcc.a"; (*"libbigarray.a"; "libthreads.a"; "libbitstring.a"; "libx86emu.a"; "libmlcairo.a"; "libmlfreetype.a"*)];;
+	dep ["file:kernel/snowflake.native"] ["libkernel.a"; "libm.a"; "libc.a"; "libgcc.a"; "libthreads.a"; (*"libbigarray.a"; "libbitstring.a"; "libx86emu.a"; "libmlcairo.a"; "libmlfreetype.a"*)];;
 
 (*** ocamlopt.opt ***)
 		
@@ -0,0 +1,116 @@
+
+(* convert a trace_dump from the serial log into Chrome trace JSON *)
+(* usage: ocaml trace2json.ml serial.log [mhz] > trace.json *)
+(* then load trace.json in chrome://tracing *)
+
+open Printf
+
+(* event numbers, as in libraries/include/trace.h *)
+let trace_switch = 1
+let trace_wake = 2
+let trace_irq_enter = 3
+let trace_irq_exit = 4
+let trace_minor_begin = 5
+let trace_minor_end = 6
+let trace_major_begin = 7
+let trace_major_end = 8
+
+(* chrome "processes", one row per cpu in each *)
+let pid_threads = 0
+let pid_irqs = 1
+let pid_gc = 2
+
+let infile = open_in Sys.argv.(1)
+let khz = ref (if Array.length Sys.argv > 2 then float_of_string Sys.argv.(2) *. 1000. else 0.)
+let events = ref []
+let cpus = ref 0
+
+let parse line =
+	try Scanf.sscanf line " trace-begin %d" (fun k ->
+		if k > 0 && !khz = 0. then khz := float_of_int k)
+	with _ ->
+	try Scanf.sscanf line " trace %d %d %Lx %Lx %d %d" (fun cpu typ hi lo a b ->
+		let tsc = Int64.to_float hi *. 4294967296. +. Int64.to_float lo in
+		if cpu >= !cpus then cpus := cpu + 1;
+		events := (tsc, cpu, typ, a, b) :: !events)
+	with _ -> ()
+
+let output = ref []
+let emit s = output := s :: !output
+
+let slice pid cpu name start stop args =
+	emit (sprintf "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f%s}"
+		name pid cpu start (stop -. start) args)
+
+let irq_name irq =
+	if irq = 0xF0 then "resched IPI"
+	else if irq = 0xF1 then "tick IPI"
+	else sprintf "irq %d" irq
+
+let () =
+	begin try
+		while true do parse (input_line infile) done
+	with End_of_file -> () end;
+	close_in infile;
+	if !khz = 0. then begin
+		eprintf "no TSC rate in the dump, assuming 1000 MHz\n";
+		khz := 1000000.
+	end;
+	let events = List.sort compare !events in
+	let base = match events with (tsc, _, _, _, _) :: _ -> tsc | [] -> 0. in
+	let us tsc = (tsc -. base) *. 1000. /. !khz in
+	(* per cpu: running thread and since when, open irqs, open gc phases *)
+	let running = Array.make !cpus None in
+	let irqs = Array.make !cpus [] in
+	let minor = Array.make !cpus None in
+	let major = Array.make !cpus None in
+	let last = ref 0. in
+	List.iter (fun (tsc, cpu, typ, a, b) ->
+		let ts = us tsc in
+		last := ts;
+		if typ = trace_switch then begin
+			begin match running.(cpu) with
+			| Some (thread, start) -> slice pid_threads cpu (sprintf "thread %d" thread) start ts ""
+			| None -> ()
+			end;
+			(* an irq that switched away exits once its thread runs again,
+			 * maybe on another cpu, so end it here *)
+			List.iter (fun (irq, start) -> slice pid_irqs cpu (irq_name irq) start ts "") irqs.(cpu);
+			irqs.(cpu) <- [];
+			running.(cpu) <- Some (b, ts)
+		end else if typ = trace_wake then
+			emit (sprintf "{\"name\":\"wake %d\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"waker\":%d}}"
+				a pid_threads cpu ts b)
+		else if typ = trace_irq_enter then
+			irqs.(cpu) <- (a, ts) :: irqs.(cpu)
+		else if typ = trace_irq_exit then begin
+			match irqs.(cpu) with
+			| (irq, start) :: rest when irq = a ->
+				slice pid_irqs cpu (irq_name irq) start ts "";
+				irqs.(cpu) <- rest
+			| _ -> ()
+		end else if typ = trace_minor_begin then
+			minor.(cpu) <- Some ts
+		else if typ = trace_minor_end then begin
+			match minor.(cpu) with
+			| Some start -> slice pid_gc cpu "minor GC" start ts ""; minor.(cpu) <- None
+			| None -> ()
+		end else if typ = trace_major_begin then
+			major.(cpu) <- Some (a, ts)
+		else if typ = trace_major_end then begin
+			match major.(cpu) with
+			| Some (phase, start) ->
+				slice pid_gc cpu "major GC slice" start ts (sprintf ",\"args\":{\"phase\":%d}" phase);
+				major.(cpu) <- None
+			| None -> ()
+		end) events;
+	(* whatever was running when the dump was taken *)
+	Array.iteri (fun cpu r -> match r with
+		| Some (thread, start) -> slice pid_threads cpu (sprintf "thread %d" thread) start !last ""
+		| None -> ()) running;
+	List.iter (fun (pid, name) ->
+		emit (sprintf "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}" pid name);
+		for cpu = 0 to !cpus - 1 do
+			emit (sprintf "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"cpu %d\"}}" pid cpu cpu)
+		done) [pid_threads, "threads"; pid_irqs, "irqs"; pid_gc, "gc"];
+	printf "[\n%s\n]\n" (String.concat ",\n" (List.rev !output))